@@ -0,0 +1,597 @@
+/*
+ * bench.c - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *           over a serial link (using SLIP)
+ *           benchmark for the SLIP kernels, the checksum routines and the send / receive
+ *           paths of the protocol core in codec.c, runs on the Unix side
+ *
+ * usage: bench [-c]
+ *     -c  print the results as CSV (one line per measurement) instead of tables, so that the
+ *         results of two revisions can be compared with diff or a spreadsheet
+ *
+ * Allocations are counted by wrapping malloc() and friends, which works only with glibc -
+ * elsewhere the column stays empty. The codec doesn't allocate any memory per packet, so
+ * anything else than 0 is a regression.
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec.h"
+
+
+/*
+ * global constants
+ */
+#define INPUT_SIZE  (1024 * 1024)       /* size of each input */
+#define MIN_RUNTIME 0.25                /* minimum runtime of each measurement in seconds */
+#define PACKET_SIZE 512                 /* payload of a packet for the per-packet benchmarks */
+#define NUM_PACKETS ((INPUT_SIZE + PACKET_SIZE - 1) / PACKET_SIZE)
+#define FRAME_SIZE  (2 * (UDPIP_HDR_LEN + TFTP_HDR_LEN + PACKET_SIZE) + 1)
+
+
+/*
+ * allocation counter
+ */
+static ULONG nallocs = 0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define HAVE_ALLOC_COUNTER 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+
+void *malloc(size_t size)
+{
+    ++nallocs;
+    return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+    ++nallocs;
+    return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+    ++nallocs;
+    return __libc_realloc(ptr, size);
+}
+#else
+#define HAVE_ALLOC_COUNTER 0
+#endif
+
+
+/*
+ * input mixes
+ */
+static ULONG rnd_state = 4711;
+
+
+static ULONG next_random()
+{
+    /* xorshift, so that every run uses the same inputs */
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+
+static void fill_random(UBYTE *buf, ULONG len)
+{
+    ULONG i;
+
+    /* about one byte in 128 needs to be escaped */
+    for (i = 0; i < len; ++i)
+        buf[i] = next_random() & 0xff;
+}
+
+
+static void fill_text(UBYTE *buf, ULONG len)
+{
+    static const char text[] = "The quick brown fox jumps over the lazy dog. 0123456789\n";
+    ULONG i;
+
+    /* no byte needs to be escaped */
+    for (i = 0; i < len; ++i)
+        buf[i] = text[i % (sizeof(text) - 1)];
+}
+
+
+static void fill_escape_light(UBYTE *buf, ULONG len)
+{
+    ULONG i, r;
+
+    /* about one byte in 16 needs to be escaped */
+    for (i = 0; i < len; ++i) {
+        r = next_random();
+        if ((r & 0xf00) == 0)
+            buf[i] = (r & 0x1000) ? SLIP_END : SLIP_ESC;
+        else
+            buf[i] = r & 0xff;
+    }
+}
+
+
+static void fill_escape_heavy(UBYTE *buf, ULONG len)
+{
+    ULONG i, r;
+
+    /* about every other byte needs to be escaped */
+    for (i = 0; i < len; ++i) {
+        r = next_random();
+        if (r & 0x100)
+            buf[i] = (r & 0x200) ? SLIP_END : SLIP_ESC;
+        else
+            buf[i] = r & 0xff;
+    }
+}
+
+
+static const struct {
+    const char *m_name;
+    void      (*m_fill)(UBYTE *buf, ULONG len);
+} mixes[] = {
+    {"random",       fill_random},
+    {"text",         fill_text},
+    {"escape-light", fill_escape_light},
+    {"escape-heavy", fill_escape_heavy},
+};
+
+
+/*
+ * helper functions
+ */
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* run a function until MIN_RUNTIME has passed and return the time per call in seconds,
+ * the number of allocations per call is stored in allocs */
+static double measure(SlipCodecFunc func, UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG srclen, double *allocs)
+{
+    double start, elapsed;
+    ULONG  niter = 0, nallocs_start = nallocs;
+
+    start = now();
+    do {
+        if (func(dst, dstlen, src, srclen) == -1) {
+            printf("ERROR: kernel failed\n");
+            exit(1);
+        }
+        ++niter;
+    } while ((elapsed = now() - start) < MIN_RUNTIME);
+    *allocs = (double) (nallocs - nallocs_start) / niter;
+    return elapsed / niter;
+}
+
+
+/*
+ * output of the results, either as tables or as CSV
+ */
+static int csv_output = 0;
+
+
+static void print_header(const char *title)
+{
+    if (csv_output)
+        return;
+    printf("\n%s\n", title);
+    printf("%-14s %-8s %-16s %8s %10s %10s %10s %9s\n",
+           "INPUT", "KERNEL", "OPERATION", "BYTES", "NS/OP", "MB/s", "ALLOCS/OP", "OVERHEAD");
+}
+
+
+/* print the result of a measurement - nbytes is the number of unencoded bytes processed
+ * per call and nops the number of operations (packets) per call, overhead is the SLIP
+ * overhead in percent of the output (or negative if the operation doesn't produce SLIP) */
+static void report(const char *section, const char *input, const char *kernel, const char *op,
+                   ULONG nbytes, ULONG nops, double secs, double allocs, double overhead)
+{
+    double nsperop = secs / nops * 1e9, rate = nbytes / secs / 1e6;
+    char   allocstr[16] = "", ovhstr[16] = "";
+
+    if (HAVE_ALLOC_COUNTER)
+        snprintf(allocstr, sizeof(allocstr), "%.2f", allocs / nops);
+    if (overhead >= 0)
+        snprintf(ovhstr, sizeof(ovhstr), "%.1f", overhead);
+    if (csv_output)
+        printf("%s,%s,%s,%s,%lu,%.1f,%.1f,%s,%s\n", section, input, kernel, op,
+               (unsigned long) (nbytes / nops), nsperop, rate, allocstr, ovhstr);
+    else
+        printf("%-14s %-8s %-16s %8lu %10.1f %10.1f %10s %8s%s\n", input, kernel, op,
+               (unsigned long) (nbytes / nops), nsperop, rate, HAVE_ALLOC_COUNTER ? allocstr : "n/a",
+               ovhstr, (overhead >= 0) ? "%" : "");
+}
+
+
+/*
+ * SLIP encoding plus UDP checksum of the input in packets of PACKET_SIZE bytes, either
+ * with a separate pass over the payload for the checksum (as netio.c did it before) or
+ * in the same pass with the kernel's k_encode_sum function
+ */
+static const SlipKernel *curkernel;
+static USHORT            pktsums[INPUT_SIZE / PACKET_SIZE + 1];
+
+
+static LONG encode_then_sum(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG pos, len, i;
+    LONG  n, nbytes_tot = 0;
+
+    for (pos = 0, i = 0; pos < nbytes; pos += len, ++i) {
+        len = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        if ((n = curkernel->k_encode(dst + nbytes_tot, dstlen - nbytes_tot, src + pos, len)) == -1)
+            return -1;
+        nbytes_tot += n;
+        pktsums[i]  = inet_fold(inet_sum(src + pos, len, 0));
+    }
+    return nbytes_tot;
+}
+
+
+static LONG encode_and_sum(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG pos, len, i, sum;
+    LONG  n, nbytes_tot = 0;
+
+    for (pos = 0, i = 0; pos < nbytes; pos += len, ++i) {
+        len = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        sum = 0;
+        if ((n = curkernel->k_encode_sum(dst + nbytes_tot, dstlen - nbytes_tot, src + pos, len, &sum)) == -1)
+            return -1;
+        nbytes_tot += n;
+        pktsums[i]  = inet_fold(sum);
+    }
+    return nbytes_tot;
+}
+
+
+/*
+ * send and receive paths of the handler (see send_tftp_packet() and extract_tftp_packet()
+ * in netio.c), again for the input in packets of PACKET_SIZE bytes, with the default
+ * kernels - the TFTP header is encoded separately from the payload, just like netio.c
+ * does it with the data blocks
+ */
+static const UBYTE   srcaddr[4] = {127, 0, 0, 1};
+static const UBYTE   dstaddr[4] = {127, 0, 0, 99};
+static UdpIpTemplate hdrtmpl;
+static ULONG         pktoffs[NUM_PACKETS + 1];          /* start of each packet in the encoded input */
+static UBYTE         txframe[FRAME_SIZE];
+
+
+/* build a SLIP frame with a TFTP packet in txframe, the start of the frame is stored
+ * in start - returns the length of the frame or -1 */
+static LONG build_frame(const UBYTE *hdr, const UBYTE *data, ULONG datalen, UBYTE **start)
+{
+    UBYTE *payload, *pos;
+    ULONG  segsum, datasum;
+    LONG   nbytes;
+
+    payload = pos = txframe + 2 * UDPIP_HDR_LEN;
+    segsum  = 0;
+    if ((nbytes = slip_encode_sum(pos, txframe + FRAME_SIZE - 1 - pos, hdr, TFTP_HDR_LEN, &segsum)) == -1)
+        return -1;
+    pos    += nbytes;
+    datasum = inet_sum_add(0, segsum, 0);
+    if (datalen > 0) {
+        segsum = 0;
+        if ((nbytes = slip_encode_sum(pos, txframe + FRAME_SIZE - 1 - pos, data, datalen, &segsum)) == -1)
+            return -1;
+        pos    += nbytes;
+        datasum = inet_sum_add(datasum, segsum, TFTP_HDR_LEN);
+    }
+    *pos++ = SLIP_END;
+    *start = udpip_prepend_headers(&hdrtmpl, payload, TFTP_HDR_LEN + datalen, datasum);
+    return pos - *start;
+}
+
+
+static LONG pkt_encode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG pos, len, i;
+    LONG  n, nbytes_tot = 0;
+
+    for (pos = 0, i = 0; pos < nbytes; pos += len, ++i) {
+        len = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        if ((n = slip_encode(dst + nbytes_tot, dstlen - nbytes_tot, src + pos, len)) == -1)
+            return -1;
+        pktoffs[i]  = nbytes_tot;
+        nbytes_tot += n;
+    }
+    pktoffs[i] = nbytes_tot;
+    return nbytes_tot;
+}
+
+
+/* decodes the output of pkt_encode() */
+static LONG pkt_decode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG i;
+    LONG  n, nbytes_tot = 0;
+
+    for (i = 0; (i < NUM_PACKETS) && (pktoffs[i] < nbytes); ++i) {
+        if ((n = slip_decode(dst + nbytes_tot, dstlen - nbytes_tot, src + pktoffs[i], pktoffs[i + 1] - pktoffs[i])) == -1)
+            return -1;
+        nbytes_tot += n;
+    }
+    return nbytes_tot;
+}
+
+
+static LONG pkt_checksum(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG pos, len, i;
+
+    (void) dst;
+    (void) dstlen;
+    for (pos = 0, i = 0; pos < nbytes; pos += len, ++i) {
+        len        = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        pktsums[i] = inet_fold(inet_sum(src + pos, len, 0));
+    }
+    return nbytes;
+}
+
+
+/* uses the checksums of the packets calculated by pkt_checksum() and returns the number
+ * of bytes written (the encoded headers only) */
+static LONG pkt_headers(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    ULONG pos, len, i;
+    LONG  nbytes_tot = 0;
+
+    (void) dstlen;
+    (void) src;
+    for (pos = 0, i = 0; pos < nbytes; pos += len, ++i) {
+        len         = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        nbytes_tot += udpip_encode_headers(&hdrtmpl, dst, len, pktsums[i]) - dst;
+    }
+    return nbytes_tot;
+}
+
+
+static LONG pkt_data(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE  hdr[TFTP_HDR_LEN], *frame;
+    ULONG  pos, len, i;
+    LONG   n, nbytes_tot = 0;
+
+    (void) dst;
+    (void) dstlen;
+    for (pos = 0, i = 1; pos < nbytes; pos += len, ++i) {
+        len = (nbytes - pos < PACKET_SIZE) ? nbytes - pos : PACKET_SIZE;
+        tftp_put_header(hdr, OP_DATA, i);
+        if ((n = build_frame(hdr, src + pos, len, &frame)) == -1)
+            return -1;
+        nbytes_tot += n;
+    }
+    return nbytes_tot;
+}
+
+
+/* parses a stream of SLIP frames with ACK packets for the blocks 1, 2, ... and returns
+ * the number of ACKs */
+static LONG pkt_ack(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    SlipDecoder dec;
+    ULONG       pos = 0, len, nconsumed, offset, nacks = 0;
+
+    slip_decoder_init(&dec, dst, dstlen);
+    while (pos < nbytes) {
+        len  = slip_decoder_feed(&dec, src + pos, nbytes - pos, &nconsumed);
+        pos += nconsumed;
+        if (len == 0)
+            break;
+        if ((udpip_parse(dst, len, &offset) != TFTP_HDR_LEN) ||
+            (tftp_get_opcode(dst + offset) != OP_ACK) || (tftp_get_blknum(dst + offset) != (USHORT) (nacks + 1)))
+            return -1;
+        ++nacks;
+    }
+    return nacks;
+}
+
+
+static const struct {
+    const char   *o_name;
+    SlipCodecFunc o_func;
+    int           o_decode;         /* operates on the output of pkt_encode() */
+    int           o_frames;         /* output is SLIP-encoded => report overhead */
+    int           o_outrate;        /* MB/s relative to the output (only headers are written) */
+} hotops[] = {
+    {"slip_encode",   pkt_encode,   0, 1, 0},
+    {"slip_decode",   pkt_decode,   1, 0, 0},
+    {"checksum",      pkt_checksum, 0, 0, 0},
+    {"udpip_headers", pkt_headers,  0, 0, 1},
+    {"tftp_data",     pkt_data,     0, 1, 0},
+};
+
+
+/*
+ * main function
+ */
+int main(int argc, char **argv)
+{
+    const SlipKernel *kernels;
+    ULONG             nkernels, i, k, npkts = NUM_PACKETS;
+    UBYTE            *input, *refenc, *encoded, *decoded, *inplace, hdr[TFTP_HDR_LEN], *frame;
+    LONG              reflen, enclen, declen, len;
+    ULONG             offset;
+    double            secs, allocs;
+    USHORT           *refsums;
+    int               error = 0;
+
+    if ((argc == 2) && (strcmp(argv[1], "-c") == 0))
+        csv_output = 1;
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-c]\n", argv[0]);
+        return 1;
+    }
+
+    kernels = slip_get_kernels(&nkernels);
+    input   = malloc(INPUT_SIZE);
+    refenc  = malloc(2 * INPUT_SIZE);
+    encoded = malloc(2 * INPUT_SIZE);
+    decoded = malloc(INPUT_SIZE);
+    inplace = malloc(2 * INPUT_SIZE);
+    refsums = malloc(sizeof(pktsums));
+    if (!input || !refenc || !encoded || !decoded || !inplace || !refsums) {
+        printf("ERROR: could not allocate memory for the inputs\n");
+        return 1;
+    }
+    if (csv_output)
+        printf("section,input,kernel,op,bytes,ns_per_op,mb_per_s,allocs_per_op,overhead_pct\n");
+
+
+    print_header("SLIP kernels (1 MB blocks)");
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); ++i) {
+        mixes[i].m_fill(input, INPUT_SIZE);
+        /* the scalar kernel (always the first one) is the reference for all others */
+        reflen = kernels[0].k_encode(refenc, 2 * INPUT_SIZE, input, INPUT_SIZE);
+        for (k = 0; k < nkernels; ++k) {
+            /* check that the kernel produces exactly the same output as the reference
+             * and that decoding (also in place) gives back the input */
+            enclen = kernels[k].k_encode(encoded, 2 * INPUT_SIZE, input, INPUT_SIZE);
+            declen = kernels[k].k_decode(decoded, INPUT_SIZE, encoded, enclen);
+            if (enclen != reflen || memcmp(encoded, refenc, reflen) != 0) {
+                printf("ERROR: output of kernel '%s' differs from reference for input '%s'\n",
+                       kernels[k].k_name, mixes[i].m_name);
+                error = 1;
+                continue;
+            }
+            if (declen != INPUT_SIZE || memcmp(decoded, input, INPUT_SIZE) != 0) {
+                printf("ERROR: kernel '%s' does not decode input '%s' correctly\n",
+                       kernels[k].k_name, mixes[i].m_name);
+                error = 1;
+                continue;
+            }
+            memcpy(inplace, encoded, enclen);
+            declen = kernels[k].k_decode(inplace, 2 * INPUT_SIZE, inplace, enclen);
+            if (declen != INPUT_SIZE || memcmp(inplace, input, INPUT_SIZE) != 0) {
+                printf("ERROR: kernel '%s' does not decode input '%s' correctly in place\n",
+                       kernels[k].k_name, mixes[i].m_name);
+                error = 1;
+                continue;
+            }
+
+            secs = measure(kernels[k].k_encode, encoded, 2 * INPUT_SIZE, input, INPUT_SIZE, &allocs);
+            report("kernels", mixes[i].m_name, kernels[k].k_name, "encode", INPUT_SIZE, 1, secs, allocs,
+                   100.0 * (enclen - INPUT_SIZE) / INPUT_SIZE);
+            secs = measure(kernels[k].k_decode, decoded, INPUT_SIZE, encoded, enclen, &allocs);
+            report("kernels", mixes[i].m_name, kernels[k].k_name, "decode", INPUT_SIZE, 1, secs, allocs, -1);
+        }
+    }
+
+
+    print_header("SLIP encoding + UDP checksum (per packet)");
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); ++i) {
+        mixes[i].m_fill(input, INPUT_SIZE);
+        reflen = kernels[0].k_encode(refenc, 2 * INPUT_SIZE, input, INPUT_SIZE);
+        /* the separate pass with the scalar kernel is the reference for the checksums */
+        curkernel = &kernels[0];
+        encode_then_sum(encoded, 2 * INPUT_SIZE, input, INPUT_SIZE);
+        memcpy(refsums, pktsums, sizeof(pktsums));
+        for (k = 0; k < nkernels; ++k) {
+            curkernel = &kernels[k];
+            enclen    = encode_and_sum(encoded, 2 * INPUT_SIZE, input, INPUT_SIZE);
+            if (enclen != reflen || memcmp(encoded, refenc, reflen) != 0) {
+                printf("ERROR: output of fused kernel '%s' differs from reference for input '%s'\n",
+                       kernels[k].k_name, mixes[i].m_name);
+                error = 1;
+                continue;
+            }
+            if (memcmp(pktsums, refsums, npkts * sizeof(USHORT)) != 0) {
+                printf("ERROR: checksums of fused kernel '%s' differ from reference for input '%s'\n",
+                       kernels[k].k_name, mixes[i].m_name);
+                error = 1;
+                continue;
+            }
+
+            secs = measure(encode_then_sum, encoded, 2 * INPUT_SIZE, input, INPUT_SIZE, &allocs);
+            report("checksum", mixes[i].m_name, kernels[k].k_name, "separate", INPUT_SIZE, npkts, secs, allocs, -1);
+            secs = measure(encode_and_sum, encoded, 2 * INPUT_SIZE, input, INPUT_SIZE, &allocs);
+            report("checksum", mixes[i].m_name, kernels[k].k_name, "fused", INPUT_SIZE, npkts, secs, allocs, -1);
+        }
+    }
+
+
+    print_header("send / receive path (per packet)");
+    udpip_init_template(&hdrtmpl, srcaddr, dstaddr, 4711, 69);
+    for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]); ++i) {
+        mixes[i].m_fill(input, INPUT_SIZE);
+        /* check that the packets make it through encoding / decoding and that the DATA
+         * packets are valid datagrams with the right payload */
+        enclen = pkt_encode(encoded, 2 * INPUT_SIZE, input, INPUT_SIZE);
+        declen = pkt_decode(decoded, INPUT_SIZE, encoded, enclen);
+        if (declen != INPUT_SIZE || memcmp(decoded, input, INPUT_SIZE) != 0) {
+            printf("ERROR: packets of input '%s' are not decoded correctly\n", mixes[i].m_name);
+            error = 1;
+            continue;
+        }
+        tftp_put_header(hdr, OP_DATA, 1);
+        len    = build_frame(hdr, input, PACKET_SIZE, &frame);
+        declen = slip_decode(decoded, INPUT_SIZE, frame, len - 1);
+        if ((declen == -1) || (udpip_parse(decoded, declen, &offset) != TFTP_HDR_LEN + PACKET_SIZE) ||
+            (tftp_get_opcode(decoded + offset) != OP_DATA) || (memcmp(decoded + offset + TFTP_HDR_LEN, input, PACKET_SIZE) != 0)) {
+            printf("ERROR: DATA packet of input '%s' is not valid\n", mixes[i].m_name);
+            error = 1;
+            continue;
+        }
+
+        for (k = 0; k < sizeof(hotops) / sizeof(hotops[0]); ++k) {
+            if (hotops[k].o_decode) {
+                secs = measure(hotops[k].o_func, decoded, INPUT_SIZE, encoded, enclen, &allocs);
+                len  = INPUT_SIZE;
+            }
+            else {
+                secs = measure(hotops[k].o_func, refenc, 2 * INPUT_SIZE, input, INPUT_SIZE, &allocs);
+                len  = hotops[k].o_func(refenc, 2 * INPUT_SIZE, input, INPUT_SIZE);
+            }
+            report("packet", mixes[i].m_name, "default", hotops[k].o_name, hotops[k].o_outrate ? len : INPUT_SIZE,
+                   npkts, secs, allocs,
+                   hotops[k].o_frames ? 100.0 * (len - INPUT_SIZE) / INPUT_SIZE : -1);
+        }
+    }
+
+    /* the ACKs of the server are received as one stream of frames, just as they are read
+     * from the serial device */
+    for (i = 0, enclen = 0; i < npkts; ++i) {
+        tftp_put_header(hdr, OP_ACK, i + 1);
+        len = build_frame(hdr, NULL, 0, &frame);
+        memcpy(encoded + enclen, frame, len);
+        enclen += len;
+    }
+    if (pkt_ack(decoded, INPUT_SIZE, encoded, enclen) != (LONG) npkts) {
+        printf("ERROR: stream of ACK packets is not parsed correctly\n");
+        error = 1;
+    }
+    else {
+        secs = measure(pkt_ack, decoded, INPUT_SIZE, encoded, enclen, &allocs);
+        report("packet", "acks", "default", "tftp_ack_parse", npkts * TFTP_HDR_LEN, npkts, secs, allocs, -1);
+    }
+
+    free(refsums);
+    free(inplace);
+    free(decoded);
+    free(encoded);
+    free(refenc);
+    free(input);
+    return error;
+}
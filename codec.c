@@ -0,0 +1,1093 @@
+/*
+ * codec.c - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *           over a serial link (using SLIP)
+ *
+ * OS-independent encoders / decoders that are shared by the handler and the tools
+ * on the Unix side
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+#include <string.h>
+
+#include "codec.h"
+
+#ifdef CODEC_HAVE_SSE2
+#include <immintrin.h>
+#endif
+
+
+/*
+ * SLIP encoding
+ * All kernels produce exactly the same output and return the number of bytes written to
+ * the destination or -1 if the destination is too small. Most bytes of a payload need no
+ * escaping, so the faster kernels look for SLIP_END / SLIP_ESC in a whole word / vector
+ * at a time and copy runs of clean bytes in one go.
+ */
+static LONG encode_scalar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+
+    for (; src < srcend; ++src) {
+        if (*src == SLIP_END || *src == SLIP_ESC) {
+            /* due to the escaping mechanism in SLIP, we get two bytes for this one */
+            if (end - dst < 2)
+                return -1;
+            *dst++ = SLIP_ESC;
+            *dst++ = (*src == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+        }
+        else {
+            if (dst == end)
+                return -1;
+            *dst++ = *src;
+        }
+    }
+    return dst - start;
+}
+
+
+/*
+ * SLIP decoding
+ * All kernels decode up to the first SLIP_END or the end of the source, whatever comes
+ * first. As the decoded data is never longer than the encoded data, the destination may
+ * be the same as the source (decoding in place). They return the number of decoded bytes
+ * or -1 if the frame contains an invalid escape sequence or the destination is too small.
+ */
+static LONG decode_scalar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+
+    for (; src < srcend && *src != SLIP_END; ++src) {
+        if (dst == end)
+            return -1;
+        if (*src == SLIP_ESC) {
+            if (++src == srcend)
+                return -1;
+            if (*src == SLIP_ESCAPED_END)
+                *dst++ = SLIP_END;
+            else if (*src == SLIP_ESCAPED_ESC)
+                *dst++ = SLIP_ESC;
+            else
+                return -1;
+        }
+        else
+            *dst++ = *src;
+    }
+    return dst - start;
+}
+
+
+#ifdef CODEC_HAVE_SWAR
+/*
+ * word-at-a-time kernels, a longword is checked for SLIP_END / SLIP_ESC with the
+ * well-known trick for finding a zero byte in a word
+ */
+#define SWAR_ONES   ((ULONG) 0x01010101)
+#define SWAR_HIGHS  ((ULONG) 0x80808080)
+
+#if defined(__amigaos__) || defined(AMIGA)
+/* the 68020 and better can access longwords at odd addresses */
+#define LOAD_LONG(p)        (*((const ULONG *) (p)))
+#define STORE_LONG(p, w)    (*((ULONG *) (p)) = (w))
+#else
+#define LOAD_LONG(p)        load_long(p)
+#define STORE_LONG(p, w)    memcpy((p), &(w), 4)
+static ULONG load_long(const UBYTE *p)
+{
+    ULONG w;
+    memcpy(&w, p, 4);
+    return w;
+}
+#endif
+
+
+static ULONG has_byte(ULONG w, UBYTE b)
+{
+    w ^= SWAR_ONES * b;
+    return (w - SWAR_ONES) & ~w & SWAR_HIGHS;
+}
+
+
+static LONG encode_swar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+    ULONG        w;
+    LONG         n;
+
+    while (srcend - src >= 4) {
+        w = LOAD_LONG(src);
+        if (!(has_byte(w, SLIP_END) | has_byte(w, SLIP_ESC))) {
+            if (end - dst < 4)
+                break;          /* the scalar kernel below reports the overflow */
+            STORE_LONG(dst, w);
+            dst += 4;
+        }
+        else {
+            /* at least one byte in this word needs to be escaped */
+            if ((n = encode_scalar(dst, end - dst, src, 4)) == -1)
+                return -1;
+            dst += n;
+        }
+        src += 4;
+    }
+    if ((n = encode_scalar(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+
+
+static LONG decode_swar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+    ULONG        w;
+    LONG         n;
+
+    while (srcend - src >= 4 && end - dst >= 4) {
+        w = LOAD_LONG(src);
+        if (!(has_byte(w, SLIP_END) | has_byte(w, SLIP_ESC))) {
+            /* dst never gets ahead of src, so this is safe when decoding in place */
+            STORE_LONG(dst, w);
+            dst += 4;
+            src += 4;
+        }
+        else {
+            /* copy the bytes in front of the special character and then let the
+             * scalar kernel handle the character itself */
+            while (*src != SLIP_END && *src != SLIP_ESC)
+                *dst++ = *src++;
+            if (*src == SLIP_END)
+                return dst - start;
+            if (srcend - src < 2 || (n = decode_scalar(dst, end - dst, src, 2)) == -1)
+                return -1;
+            dst += n;
+            src += 2;
+        }
+    }
+    if ((n = decode_scalar(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+#endif /* CODEC_HAVE_SWAR */
+
+
+#ifdef CODEC_HAVE_SSE2
+/*
+ * SSE2 / AVX2 kernels for the Unix side, a whole vector of clean bytes is stored in one
+ * go, and if it contains a special character, the position of the first one is taken
+ * from the comparison mask
+ */
+static LONG encode_sse2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m128i  vend = _mm_set1_epi8((char) SLIP_END), vesc = _mm_set1_epi8((char) SLIP_ESC);
+    __m128i        v;
+    int            mask;
+    LONG           n;
+
+    while (srcend - src >= 16 && end - dst >= 16) {
+        v    = _mm_loadu_si128((const __m128i *) src);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vend), _mm_cmpeq_epi8(v, vesc)));
+        _mm_storeu_si128((__m128i *) dst, v);
+        if (mask == 0) {
+            dst += 16;
+            src += 16;
+        }
+        else {
+            n = __builtin_ctz(mask);
+            dst += n;
+            src += n;
+            if (end - dst < 2)
+                return -1;
+            *dst++ = SLIP_ESC;
+            *dst++ = (*src == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+            ++src;
+        }
+    }
+    if ((n = encode_scalar(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+
+
+static LONG decode_sse2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m128i  vend = _mm_set1_epi8((char) SLIP_END), vesc = _mm_set1_epi8((char) SLIP_ESC);
+    __m128i        v;
+    int            mask;
+    LONG           n;
+
+    while (srcend - src >= 16 && end - dst >= 16) {
+        v    = _mm_loadu_si128((const __m128i *) src);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vend), _mm_cmpeq_epi8(v, vesc)));
+        if (mask == 0) {
+            /* dst never gets ahead of src and all bytes of the vector are consumed, so
+             * this is safe when decoding in place */
+            _mm_storeu_si128((__m128i *) dst, v);
+            dst += 16;
+            src += 16;
+        }
+        else {
+            /* When decoding in place, dst is behind src after the first escape sequence.
+             * Storing the whole vector would then overwrite bytes not decoded yet, so only
+             * the bytes in front of the special one are copied in this case. */
+            n = __builtin_ctz(mask);
+            if ((dst == src) || ((ULONG) (src - dst) >= 16))
+                _mm_storeu_si128((__m128i *) dst, v);
+            else
+                memmove(dst, src, n);
+            dst += n;
+            src += n;
+            if (*src == SLIP_END)
+                return dst - start;
+            if (srcend - src < 2 || (n = decode_scalar(dst, end - dst, src, 2)) == -1)
+                return -1;
+            dst += n;
+            src += 2;
+        }
+    }
+    if ((n = decode_scalar(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+
+
+__attribute__((target("avx2")))
+static LONG encode_avx2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m256i  vend = _mm256_set1_epi8((char) SLIP_END), vesc = _mm256_set1_epi8((char) SLIP_ESC);
+    __m256i        v;
+    unsigned int   mask;
+    LONG           n;
+
+    while (srcend - src >= 32 && end - dst >= 32) {
+        v    = _mm256_loadu_si256((const __m256i *) src);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, vend), _mm256_cmpeq_epi8(v, vesc)));
+        _mm256_storeu_si256((__m256i *) dst, v);
+        if (mask == 0) {
+            dst += 32;
+            src += 32;
+        }
+        else {
+            n = __builtin_ctz(mask);
+            dst += n;
+            src += n;
+            if (end - dst < 2)
+                return -1;
+            *dst++ = SLIP_ESC;
+            *dst++ = (*src == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+            ++src;
+        }
+    }
+    if ((n = encode_sse2(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+
+
+__attribute__((target("avx2")))
+static LONG decode_avx2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m256i  vend = _mm256_set1_epi8((char) SLIP_END), vesc = _mm256_set1_epi8((char) SLIP_ESC);
+    __m256i        v;
+    unsigned int   mask;
+    LONG           n;
+
+    while (srcend - src >= 32 && end - dst >= 32) {
+        v    = _mm256_loadu_si256((const __m256i *) src);
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, vend), _mm256_cmpeq_epi8(v, vesc)));
+        if (mask == 0) {
+            /* see decode_sse2() */
+            _mm256_storeu_si256((__m256i *) dst, v);
+            dst += 32;
+            src += 32;
+        }
+        else {
+            n = __builtin_ctz(mask);
+            if ((dst == src) || ((ULONG) (src - dst) >= 32))
+                _mm256_storeu_si256((__m256i *) dst, v);
+            else
+                memmove(dst, src, n);
+            dst += n;
+            src += n;
+            if (*src == SLIP_END)
+                return dst - start;
+            if (srcend - src < 2 || (n = decode_scalar(dst, end - dst, src, 2)) == -1)
+                return -1;
+            dst += n;
+            src += 2;
+        }
+    }
+    if ((n = decode_sse2(dst, end - dst, src, srcend - src)) == -1)
+        return -1;
+    return dst + n - start;
+}
+#endif /* CODEC_HAVE_SSE2 */
+
+
+/*
+ * Internet checksum (RFC 1071)
+ * The sums are built over 16-bit words in the byte order of the machine, like in the
+ * well-known in_cksum(). So the result can be stored into a header without swapping
+ * its bytes, and header fields that are already in network byte order can simply be
+ * added. The sums are not folded, the caller has to do this with inet_fold() and take
+ * the one's complement of the result. They are folded only when the upper bit is set,
+ * so that the sum can't overflow.
+ */
+#if defined(__amigaos__) || defined(AMIGA) \
+    || (defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+#define MEM_WORD(b0, b1)    (((ULONG) (b0) << 8) | (b1))
+#else
+#define MEM_WORD(b0, b1)    (((ULONG) (b1) << 8) | (b0))
+#endif
+#define SUM_FOLD(s)         if ((s) & 0x80000000) (s) = ((s) >> 16) + ((s) & 0x0000ffff)
+
+
+static ULONG sum_scalar(const UBYTE *src, ULONG nbytes, ULONG sum)
+{
+    for (; nbytes > 1; nbytes -= 2, src += 2) {
+        sum += MEM_WORD(src[0], src[1]);
+        SUM_FOLD(sum);
+    }
+    if (nbytes == 1)                        /* an odd byte at the end is padded with 0 */
+        sum += MEM_WORD(src[0], 0);
+    return sum;
+}
+
+
+/*
+ * SLIP-encode a block of bytes and add it to a one's complement sum in the same pass, so
+ * that the payload of an outgoing packet is read only once for encoding it and
+ * calculating the UDP checksum. The sum is calculated as if the block started at an
+ * even offset (see inet_sum_add()).
+ */
+static LONG encode_sum_scalar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+    ULONG        s = *sum;
+    UBYTE        odd = 0;
+
+    for (; src < srcend; ++src) {
+        s  += odd ? MEM_WORD(0, *src) : MEM_WORD(*src, 0);
+        odd = !odd;
+        SUM_FOLD(s);
+        if (*src == SLIP_END || *src == SLIP_ESC) {
+            if (end - dst < 2)
+                return -1;
+            *dst++ = SLIP_ESC;
+            *dst++ = (*src == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+        }
+        else {
+            if (dst == end)
+                return -1;
+            *dst++ = *src;
+        }
+    }
+    *sum = s;
+    return dst - start;
+}
+
+
+#ifdef CODEC_HAVE_SWAR
+/* the two halves of a longword are the 16-bit words in memory, regardless of the byte order */
+static LONG encode_sum_swar(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum)
+{
+    UBYTE       *start = dst, *end = dst + dstlen;
+    const UBYTE *srcend = src + nbytes;
+    ULONG        w, s = *sum;
+    LONG         n;
+
+    while (srcend - src >= 4 && end - dst >= 4) {
+        w  = LOAD_LONG(src);
+        s += (w >> 16) + (w & 0x0000ffff);
+        SUM_FOLD(s);
+        if (!(has_byte(w, SLIP_END) | has_byte(w, SLIP_ESC))) {
+            STORE_LONG(dst, w);
+            dst += 4;
+        }
+        else {
+            if ((n = encode_scalar(dst, end - dst, src, 4)) == -1)
+                return -1;
+            dst += n;
+        }
+        src += 4;
+    }
+    /* the rest starts at an even offset, so the scalar kernel can just continue the sum */
+    if ((n = encode_sum_scalar(dst, end - dst, src, srcend - src, &s)) == -1)
+        return -1;
+    *sum = s;
+    return dst + n - start;
+}
+#endif /* CODEC_HAVE_SWAR */
+
+
+#ifdef CODEC_HAVE_SSE2
+/* the words are added up in 32-bit lanes, which are added to the sum after at most
+ * 0x4000 vectors (so that they can't overflow) */
+static ULONG add_lanes(__m128i acc, ULONG sum)
+{
+    ULONG lanes[4], i;
+
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    for (i = 0; i < 4; ++i) {
+        sum += lanes[i];
+        SUM_FOLD(sum);
+    }
+    return sum;
+}
+
+
+/*
+ * The checksum is built over whole vectors of the source, so the escape sequences can't
+ * simply be handled by continuing with the vector after the special byte (as the encode
+ * kernels do), because that would shift the words of the sum. Instead, the clean runs in
+ * front of the special bytes of a vector are copied by storing a vector loaded from the
+ * start of the run (only the bytes of the run are kept, the rest is overwritten by the
+ * next store). This reads up to one vector beyond the current one and writes up to three
+ * vectors, hence the limits in the loop conditions.
+ */
+static LONG encode_sum_sse2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m128i  vend = _mm_set1_epi8((char) SLIP_END), vesc = _mm_set1_epi8((char) SLIP_ESC);
+    const __m128i  zero = _mm_setzero_si128();
+    __m128i        v, acc = zero;
+    ULONG          s = *sum, nvecs = 0, pos, n;
+    int            mask;
+    LONG           nenc;
+
+    while (srcend - src >= 32 && end - dst >= 48) {
+        v    = _mm_loadu_si128((const __m128i *) src);
+        acc  = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(v, zero), _mm_unpackhi_epi16(v, zero)));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vend), _mm_cmpeq_epi8(v, vesc)));
+        _mm_storeu_si128((__m128i *) dst, v);
+        if (mask == 0)
+            dst += 16;
+        else {
+            pos = 0;
+            do {
+                n    = __builtin_ctz(mask);
+                dst += n - pos;
+                *dst++ = SLIP_ESC;
+                *dst++ = (src[n] == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+                pos    = n + 1;
+                _mm_storeu_si128((__m128i *) dst, _mm_loadu_si128((const __m128i *) (src + pos)));
+                mask  &= mask - 1;
+            } while (mask);
+            dst += 16 - pos;
+        }
+        src += 16;
+        if (++nvecs == 0x4000) {
+            s     = add_lanes(acc, s);
+            acc   = zero;
+            nvecs = 0;
+        }
+    }
+    s = add_lanes(acc, s);
+    if ((nenc = encode_sum_scalar(dst, end - dst, src, srcend - src, &s)) == -1)
+        return -1;
+    *sum = s;
+    return dst + nenc - start;
+}
+
+
+/* same as encode_sum_sse2() with 32-byte vectors */
+__attribute__((target("avx2")))
+static LONG encode_sum_avx2(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum)
+{
+    UBYTE         *start = dst, *end = dst + dstlen;
+    const UBYTE   *srcend = src + nbytes;
+    const __m256i  vend = _mm256_set1_epi8((char) SLIP_END), vesc = _mm256_set1_epi8((char) SLIP_ESC);
+    const __m256i  zero = _mm256_setzero_si256();
+    __m256i        v, acc = zero;
+    ULONG          s = *sum, nvecs = 0, pos, n;
+    unsigned int   mask;
+    LONG           nenc;
+
+    while (srcend - src >= 64 && end - dst >= 96) {
+        v    = _mm256_loadu_si256((const __m256i *) src);
+        acc  = _mm256_add_epi32(acc, _mm256_add_epi32(_mm256_unpacklo_epi16(v, zero), _mm256_unpackhi_epi16(v, zero)));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, vend), _mm256_cmpeq_epi8(v, vesc)));
+        _mm256_storeu_si256((__m256i *) dst, v);
+        if (mask == 0)
+            dst += 32;
+        else {
+            pos = 0;
+            do {
+                n    = __builtin_ctz(mask);
+                dst += n - pos;
+                *dst++ = SLIP_ESC;
+                *dst++ = (src[n] == SLIP_END) ? SLIP_ESCAPED_END : SLIP_ESCAPED_ESC;
+                pos    = n + 1;
+                _mm256_storeu_si256((__m256i *) dst, _mm256_loadu_si256((const __m256i *) (src + pos)));
+                mask  &= mask - 1;
+            } while (mask);
+            dst += 32 - pos;
+        }
+        src += 32;
+        if (++nvecs == 0x4000) {
+            s     = add_lanes(_mm256_castsi256_si128(acc), s);
+            s     = add_lanes(_mm256_extracti128_si256(acc, 1), s);
+            acc   = zero;
+            nvecs = 0;
+        }
+    }
+    s = add_lanes(_mm256_castsi256_si128(acc), s);
+    s = add_lanes(_mm256_extracti128_si256(acc, 1), s);
+    /* GCC doesn't always do this itself here, without it the (non-VEX) SSE2 code would
+     * pay for the transition from AVX */
+    _mm256_zeroupper();
+    /* the rest starts at an even offset, so the SSE2 kernel can just continue the sum */
+    if ((nenc = encode_sum_sse2(dst, end - dst, src, srcend - src, &s)) == -1)
+        return -1;
+    *sum = s;
+    return dst + nenc - start;
+}
+#endif /* CODEC_HAVE_SSE2 */
+
+
+/*
+ * table of the kernels available on this machine, the last one is the fastest
+ */
+static SlipKernel kernels[4];
+static ULONG      nkernels = 0;
+
+
+const SlipKernel *slip_get_kernels(ULONG *nk)
+{
+    if (nkernels == 0) {
+        kernels[nkernels].k_name       = "scalar";
+        kernels[nkernels].k_encode     = encode_scalar;
+        kernels[nkernels].k_decode     = decode_scalar;
+        kernels[nkernels].k_encode_sum = encode_sum_scalar;
+        ++nkernels;
+#ifdef CODEC_HAVE_SWAR
+        kernels[nkernels].k_name       = "swar";
+        kernels[nkernels].k_encode     = encode_swar;
+        kernels[nkernels].k_decode     = decode_swar;
+        kernels[nkernels].k_encode_sum = encode_sum_swar;
+        ++nkernels;
+#endif
+#ifdef CODEC_HAVE_SSE2
+        kernels[nkernels].k_name       = "sse2";
+        kernels[nkernels].k_encode     = encode_sse2;
+        kernels[nkernels].k_decode     = decode_sse2;
+        kernels[nkernels].k_encode_sum = encode_sum_sse2;
+        ++nkernels;
+        if (__builtin_cpu_supports("avx2")) {
+            kernels[nkernels].k_name       = "avx2";
+            kernels[nkernels].k_encode     = encode_avx2;
+            kernels[nkernels].k_decode     = decode_avx2;
+            kernels[nkernels].k_encode_sum = encode_sum_avx2;
+            ++nkernels;
+        }
+#endif
+    }
+    if (nk)
+        *nk = nkernels;
+    return kernels;
+}
+
+
+/*
+ * SLIP-encode / decode a block of bytes with the fastest kernel available
+ */
+LONG slip_encode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+#if defined(CODEC_HAVE_SSE2)
+    static SlipCodecFunc encode = NULL;
+    ULONG nk;
+
+    if (encode == NULL)
+        encode = slip_get_kernels(&nk)[nk - 1].k_encode;
+    return encode(dst, dstlen, src, nbytes);
+#elif defined(CODEC_HAVE_SWAR)
+    return encode_swar(dst, dstlen, src, nbytes);
+#else
+    return encode_scalar(dst, dstlen, src, nbytes);
+#endif
+}
+
+
+LONG slip_decode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes)
+{
+#if defined(CODEC_HAVE_SSE2)
+    static SlipCodecFunc decode = NULL;
+    ULONG nk;
+
+    if (decode == NULL)
+        decode = slip_get_kernels(&nk)[nk - 1].k_decode;
+    return decode(dst, dstlen, src, nbytes);
+#elif defined(CODEC_HAVE_SWAR)
+    return decode_swar(dst, dstlen, src, nbytes);
+#else
+    return decode_scalar(dst, dstlen, src, nbytes);
+#endif
+}
+
+
+/*
+ * SLIP-encode a block of bytes and add it to a one's complement sum with the fastest
+ * kernel available
+ */
+LONG slip_encode_sum(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum)
+{
+#if defined(CODEC_HAVE_SSE2)
+    static SlipEncodeSumFunc encode = NULL;
+    ULONG nk;
+
+    if (encode == NULL)
+        encode = slip_get_kernels(&nk)[nk - 1].k_encode_sum;
+    return encode(dst, dstlen, src, nbytes, sum);
+#elif defined(CODEC_HAVE_SWAR)
+    return encode_sum_swar(dst, dstlen, src, nbytes, sum);
+#else
+    return encode_sum_scalar(dst, dstlen, src, nbytes, sum);
+#endif
+}
+
+
+/*
+ * add a block of bytes to a one's complement sum
+ */
+ULONG inet_sum(const UBYTE *src, ULONG nbytes, ULONG sum)
+{
+#ifdef CODEC_HAVE_SWAR
+    ULONG w;
+
+    for (; nbytes >= 4; nbytes -= 4, src += 4) {
+        w    = LOAD_LONG(src);
+        sum += (w >> 16) + (w & 0x0000ffff);
+        SUM_FOLD(sum);
+    }
+#endif
+    return sum_scalar(src, nbytes, sum);
+}
+
+
+/*
+ * fold a sum into 16 bits
+ */
+USHORT inet_fold(ULONG sum)
+{
+    sum  = (sum >> 16) + (sum & 0x0000ffff);
+    sum += (sum >> 16);
+    return (USHORT) sum;
+}
+
+
+/*
+ * add the sum of a block that starts at the given offset in the datagram to the sum of
+ * the datagram - if the offset is odd, the bytes of the block are in the wrong halves
+ * of the words, which is corrected by swapping the bytes of its (folded) sum
+ */
+ULONG inet_sum_add(ULONG sum, ULONG segsum, ULONG offset)
+{
+    segsum = inet_fold(segsum);
+    if (offset & 1)
+        segsum = ((segsum & 0x00ff) << 8) | (segsum >> 8);
+    return sum + segsum;
+}
+
+
+/*
+ * IP and UDP headers
+ */
+/* a header field with the value v as it is added to a one's complement sum (see above) */
+#define NET_WORD(v)         MEM_WORD(((v) >> 8) & 0xff, (v) & 0xff)
+
+/* parts of the headers that are the same in every datagram (start and end offset) - they
+ * are separated by ip_len + ip_id, ip_sum and uh_ulen + uh_sum */
+static const ULONG hdrsegs[UDPIP_NUM_SEGS][2] = {
+    {IPH_VHL, IPH_LEN},
+    {IPH_OFF, IPH_SUM},
+    {IPH_SRC, IP_HDR_LEN + UH_ULEN}
+};
+
+
+/*
+ * build the template for the headers of all datagrams sent from / to the given addresses
+ * and ports
+ * Only the lengths, the identification and the checksums differ from datagram to
+ * datagram, so the template contains 0 in these fields and the SLIP encoding of the
+ * other parts is computed here as well. The checksums of the template (their one's
+ * complement sums, to be precise) are the starting point for the incremental update
+ * (RFC 1624). For the UDP checksum, this includes the addresses and the protocol from
+ * the pseudo header (RFC 768), so only the UDP length (which is in both headers) and
+ * the payload need to be added.
+ */
+void udpip_init_template(UdpIpTemplate *tmpl, const UBYTE *srcaddr, const UBYTE *dstaddr, USHORT sport, USHORT dport)
+{
+    UBYTE *iphdr  = tmpl->ut_hdrs;
+    UBYTE *udphdr = tmpl->ut_hdrs + IP_HDR_LEN;
+    ULONG  i;
+
+    memset(tmpl->ut_hdrs, 0, UDPIP_HDR_LEN);
+    iphdr[IPH_VHL] = (4 << 4) | (IP_HDR_LEN / 4);        /* version, header length */
+    iphdr[IPH_TTL] = 255;                                /* time-to-live */
+    iphdr[IPH_P]   = IP_PROTO_UDP;                       /* transport layer protocol */
+    memcpy(iphdr + IPH_SRC, srcaddr, 4);
+    memcpy(iphdr + IPH_DST, dstaddr, 4);
+    PUT_WORD(udphdr + UH_SPORT, sport);
+    PUT_WORD(udphdr + UH_DPORT, dport);
+    tmpl->ut_ipsum  = inet_fold(inet_sum(iphdr, IP_HDR_LEN, 0));
+    tmpl->ut_udpsum = inet_fold(inet_sum(udphdr, UDP_HDR_LEN, inet_sum(iphdr + IPH_SRC, 8, NET_WORD(IP_PROTO_UDP))));
+    tmpl->ut_id     = 0;
+
+    for (i = 0; i < UDPIP_NUM_SEGS; ++i)
+        tmpl->ut_enclen[i] = encode_scalar(tmpl->ut_enc[i], sizeof(tmpl->ut_enc[i]), tmpl->ut_hdrs + hdrsegs[i][0],
+                                           hdrsegs[i][1] - hdrsegs[i][0]);
+}
+
+
+/*
+ * write the SLIP-encoded IP and UDP headers for a datagram with datalen bytes of payload
+ * to dst (at most 2 * UDPIP_HDR_LEN bytes) and return the end of the encoded headers -
+ * datasum is the one's complement sum of the payload
+ */
+UBYTE *udpip_encode_headers(UdpIpTemplate *tmpl, UBYTE *dst, ULONG datalen, ULONG datasum)
+{
+    ULONG  iplen = UDPIP_HDR_LEN + datalen, ulen = UDP_HDR_LEN + datalen;
+    USHORT id    = tmpl->ut_id++;
+    USHORT ipsum, udpsum;
+    UBYTE  fields[10];
+
+    /* the fields are 0 in the template, so their new values are simply added to its sum
+     * (the UDP length is counted twice, once in the pseudo header and once in the UDP header) */
+    ipsum  = ~inet_fold(tmpl->ut_ipsum + NET_WORD(iplen) + NET_WORD(id));
+    udpsum = ~inet_fold(tmpl->ut_udpsum + 2 * NET_WORD(ulen) + datasum);
+    if (udpsum == 0)
+        udpsum = 0xffff;                /* 0 means that there is no checksum */
+    PUT_WORD(fields, iplen);
+    PUT_WORD(fields + 2, id);
+    memcpy(fields + 4, &ipsum, 2);      /* the sums are already in network byte order */
+    PUT_WORD(fields + 6, ulen);
+    memcpy(fields + 8, &udpsum, 2);
+
+    memcpy(dst, tmpl->ut_enc[0], tmpl->ut_enclen[0]);
+    dst += tmpl->ut_enclen[0];
+    dst += encode_scalar(dst, 8, fields, 4);
+    memcpy(dst, tmpl->ut_enc[1], tmpl->ut_enclen[1]);
+    dst += tmpl->ut_enclen[1];
+    dst += encode_scalar(dst, 4, fields + 4, 2);
+    memcpy(dst, tmpl->ut_enc[2], tmpl->ut_enclen[2]);
+    dst += tmpl->ut_enclen[2];
+    return dst + encode_scalar(dst, 8, fields + 6, 4);
+}
+
+
+/*
+ * put the SLIP-encoded headers directly in front of the SLIP-encoded payload, which needs
+ * 2 * UDPIP_HDR_LEN bytes of room in front of it (for the worst case), and return the
+ * start of the frame
+ */
+UBYTE *udpip_prepend_headers(UdpIpTemplate *tmpl, UBYTE *payload, ULONG datalen, ULONG datasum)
+{
+    UBYTE hdrbuf[2 * UDPIP_HDR_LEN];
+    ULONG hdrlen;
+
+    hdrlen = udpip_encode_headers(tmpl, hdrbuf, datalen, datasum) - hdrbuf;
+    memcpy(payload - hdrlen, hdrbuf, hdrlen);
+    return payload - hdrlen;
+}
+
+
+/*
+ * check the IP and UDP headers of a received datagram (including the checksums) and
+ * determine where the UDP payload is - returns the length of the payload (its offset
+ * is stored in offset) or one of the UDPIP_Exxx errors
+ */
+LONG udpip_parse(const UBYTE *bytes, ULONG nbytes, ULONG *offset)
+{
+    const UBYTE *udphdr;
+    ULONG        iphlen, iplen, udplen, sum;
+
+    if (nbytes < IP_HDR_LEN)
+        return UDPIP_ESHORT;
+    iphlen = (bytes[IPH_VHL] & 0x0f) * 4;
+    iplen  = GET_WORD(bytes + IPH_LEN);
+    if ((bytes[IPH_VHL] >> 4) != 4 || iphlen < IP_HDR_LEN || iplen < iphlen + UDP_HDR_LEN || iplen > nbytes)
+        return UDPIP_EHEADER;
+    if (inet_fold(inet_sum(bytes, iphlen, 0)) != 0xffff)
+        return UDPIP_EIPSUM;
+    if (bytes[IPH_P] != IP_PROTO_UDP)
+        return UDPIP_EPROTO;
+
+    udphdr = bytes + iphlen;
+    udplen = GET_WORD(udphdr + UH_ULEN);
+    if (udplen < UDP_HDR_LEN || udplen > iplen - iphlen)
+        return UDPIP_EUDPHDR;
+    /* the checksum is optional for UDP, but if it's there, a corrupted ACK must not get
+     * through (it could acknowledge a block that the server never received) */
+    if (udphdr[UH_SUM] || udphdr[UH_SUM + 1]) {
+        sum = inet_sum(bytes + IPH_SRC, 8, NET_WORD(IP_PROTO_UDP) + NET_WORD(udplen));
+        if (inet_fold(inet_sum(udphdr, udplen, sum)) != 0xffff)
+            return UDPIP_EUDPSUM;
+    }
+
+    *offset = iphlen + UDP_HDR_LEN;
+    return udplen - UDP_HDR_LEN;
+}
+
+
+const char *udpip_error_string(LONG error)
+{
+    static const char *msgs[] = {
+        "datagram is too short for an IP header",
+        "invalid IP header",
+        "wrong IP header checksum",
+        "not a UDP datagram",
+        "invalid UDP header",
+        "wrong UDP checksum"
+    };
+
+    if (error > UDPIP_ESHORT || error < UDPIP_EUDPSUM)
+        return "unknown error";
+    return msgs[-error - 1];
+}
+
+
+/*
+ * TFTP packets
+ */
+static UBYTE *put_string(UBYTE *dst, const char *s)
+{
+    ULONG len = strlen(s) + 1;
+
+    memcpy(dst, s, len);
+    return dst + len;
+}
+
+
+/* buf must have room for 11 characters, the number starts at the returned position */
+static const char *format_number(char *buf, ULONG val)
+{
+    char *pos = buf + 10;
+
+    *pos = 0;
+    do {
+        *--pos = '0' + val % 10;
+        val   /= 10;
+    } while (val);
+    return pos;
+}
+
+
+/*
+ * build a read / write request in buf and return its length, or 0 if buf is too small
+ * The blksize (RFC 2348) and windowsize (RFC 7440) options are only added if they're
+ * not 0.
+ */
+ULONG tftp_build_request(UBYTE *buf, ULONG buflen, USHORT opcode, const char *fname, ULONG blksize,
+                         ULONG windowsize)
+{
+    char        blksize_buf[11], windowsize_buf[11];
+    const char *blksize_str, *windowsize_str;
+    ULONG       pktlen;
+    UBYTE      *pos;
+
+    /*
+     * length of packet = 2 bytes for the opcode
+     *                  + length of the file name
+     *                  + terminating NUL byte
+     *                  + 8 bytes for the mode "NETASCII"
+     *                  + terminating NUL byte
+     * and for each option
+     *                  + 8 / 11 bytes for the option name "blksize" / "windowsize"
+     *                    (including NUL byte)
+     *                  + length of the option value
+     *                  + terminating NUL byte
+     */
+    blksize_str    = format_number(blksize_buf, blksize);
+    windowsize_str = format_number(windowsize_buf, windowsize);
+    pktlen = strlen(fname) + 12;
+    if (blksize)
+        pktlen += 8 + strlen(blksize_str) + 1;
+    if (windowsize)
+        pktlen += 11 + strlen(windowsize_str) + 1;
+    if (pktlen > buflen)
+        return 0;
+
+    pos = buf;
+    PUT_WORD(pos, opcode);                  /* opcode */
+    pos = put_string(pos + 2, fname);       /* file name */
+    pos = put_string(pos, "NETASCII");      /* mode */
+    if (blksize)                            /* options */
+        pos = put_string(put_string(pos, "blksize"), blksize_str);
+    if (windowsize)
+        pos = put_string(put_string(pos, "windowsize"), windowsize_str);
+    return pktlen;
+}
+
+
+/*
+ * write the header of a DATA / ACK / ERROR packet (the opcode and the block number /
+ * error code)
+ */
+void tftp_put_header(UBYTE *buf, USHORT opcode, USHORT num)
+{
+    PUT_WORD(buf, opcode);
+    PUT_WORD(buf + 2, num);
+}
+
+
+USHORT tftp_get_opcode(const UBYTE *pkt)
+{
+    return GET_WORD(pkt);
+}
+
+
+USHORT tftp_get_blknum(const UBYTE *pkt)
+{
+    return GET_WORD(pkt + 2);
+}
+
+
+/*
+ * compare two strings without regard to case (option names in TFTP are case-insensitive)
+ */
+static LONG is_same_option(const char *s1, const char *s2)
+{
+    for (; *s1 && *s2; ++s1, ++s2) {
+        if ((*s1 | 0x20) != (*s2 | 0x20))
+            return 0;
+    }
+    return *s1 == *s2;
+}
+
+
+/*
+ * get the value of a numeric option from an OACK packet of len bytes, returns 1 if the
+ * option has been found and 0 otherwise
+ * The packet consists of the opcode followed by pairs of NUL-terminated strings for the
+ * option name and its value.
+ */
+LONG tftp_get_option(const UBYTE *pkt, ULONG len, const char *name, ULONG *value)
+{
+    const char *pos = (const char *) pkt + 2, *end = (const char *) pkt + len;
+    const char *optname, *optval;
+    ULONG       val;
+
+    while (pos < end) {
+        /* find end of option name and value, both have to be NUL-terminated */
+        optname = pos;
+        while ((pos < end) && *pos)
+            ++pos;
+        if (++pos >= end)
+            break;
+        optval = pos;
+        while ((pos < end) && *pos)
+            ++pos;
+        if (pos++ >= end)
+            break;
+
+        if (is_same_option(optname, name)) {
+            if (*optval == 0)
+                return 0;       /* value is empty */
+            for (val = 0; (*optval >= '0') && (*optval <= '9'); ++optval) {
+                if (val > (0xffffffff - (*optval - '0')) / 10)
+                    return 0;   /* value doesn't fit into a ULONG */
+                val = val * 10 + (*optval - '0');
+            }
+            if (*optval != 0)
+                return 0;       /* value is not a number */
+            *value = val;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * streaming SLIP decoder
+ */
+void slip_decoder_init(SlipDecoder *dec, UBYTE *buf, ULONG size)
+{
+    dec->sd_buf      = buf;
+    dec->sd_size     = size;
+    dec->sd_len      = 0;
+    dec->sd_state    = SD_NORMAL;
+    dec->sd_nframes  = 0;
+    dec->sd_ndropped = 0;
+}
+
+
+/*
+ * feed a chunk of serial input to the decoder
+ * Decoding stops after the first datagram that has been completed. The function returns
+ * its length (the datagram is at the beginning of sd_buf and stays there until the next
+ * call) or 0 if all the input has been consumed without completing a datagram. In both
+ * cases, the number of bytes consumed is stored in nconsumed, so that the caller can
+ * continue with the rest of the input. Frames that are too long for the buffer or
+ * contain invalid escape sequences are dropped, empty frames (two consecutive SLIP_END
+ * characters, which many implementations send to flush out line noise) are ignored.
+ */
+ULONG slip_decoder_feed(SlipDecoder *dec, const UBYTE *src, ULONG nbytes, ULONG *nconsumed)
+{
+    const UBYTE *start = src, *srcend = src + nbytes;
+    ULONG        len;
+    UBYTE        c;
+
+    for (; src < srcend; ++src) {
+        c = *src;
+        if (c == SLIP_END) {
+            len           = dec->sd_len;
+            dec->sd_len   = 0;
+            if (dec->sd_state == SD_NORMAL && len > 0) {
+                ++dec->sd_nframes;
+                *nconsumed = src + 1 - start;
+                return len;
+            }
+            if (dec->sd_state != SD_NORMAL)
+                ++dec->sd_ndropped;
+            dec->sd_state = SD_NORMAL;
+            continue;
+        }
+
+        switch (dec->sd_state) {
+            case SD_NORMAL:
+                if (c == SLIP_ESC) {
+                    dec->sd_state = SD_ESCAPE;
+                    continue;
+                }
+                break;
+
+            case SD_ESCAPE:
+                if (c == SLIP_ESCAPED_END)
+                    c = SLIP_END;
+                else if (c == SLIP_ESCAPED_ESC)
+                    c = SLIP_ESC;
+                else {
+                    dec->sd_state = SD_DISCARD;
+                    continue;
+                }
+                dec->sd_state = SD_NORMAL;
+                break;
+
+            case SD_DISCARD:
+                continue;
+        }
+
+        if (dec->sd_len == dec->sd_size) {
+            dec->sd_state = SD_DISCARD;
+            continue;
+        }
+        dec->sd_buf[dec->sd_len++] = c;
+    }
+    *nconsumed = nbytes;
+    return 0;
+}
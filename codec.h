@@ -0,0 +1,182 @@
+#ifndef CWNET_CODEC_H
+#define CWNET_CODEC_H
+/*
+ * codec.h - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *           over a serial link (using SLIP)
+ *
+ * OS-independent protocol core that is shared by the handler and the tools on the
+ * Unix side: SLIP framing, Internet checksums, IP / UDP headers and TFTP packets
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#if defined(__amigaos__) || defined(AMIGA)
+#include <exec/types.h>
+#else
+#include <stdint.h>
+typedef uint8_t  UBYTE;
+typedef uint16_t USHORT;
+typedef int32_t  LONG;
+typedef uint32_t ULONG;
+#endif
+
+
+/*
+ * SLIP protocol
+ */
+#define SLIP_END                0xc0
+#define SLIP_ESCAPED_END        0xdc
+#define SLIP_ESC                0xdb
+#define SLIP_ESCAPED_ESC        0xdd
+
+
+/*
+ * IP and UDP (only what we need for sending UDP datagrams over SLIP)
+ * The headers are accessed byte by byte at the offsets below, with all fields in network
+ * byte order, so that the code neither depends on the byte order nor on the alignment.
+ */
+#define IP_HDR_LEN              20      /* IP header without options */
+#define UDP_HDR_LEN             8
+#define UDPIP_HDR_LEN           (IP_HDR_LEN + UDP_HDR_LEN)
+#define IP_PROTO_UDP            17
+
+#define IPH_VHL                 0       /* version and header length (in 32-bit words) */
+#define IPH_LEN                 2       /* total length */
+#define IPH_ID                  4       /* identification */
+#define IPH_OFF                 6       /* fragment offset field */
+#define IPH_TTL                 8       /* time to live */
+#define IPH_P                   9       /* protocol */
+#define IPH_SUM                 10      /* checksum */
+#define IPH_SRC                 12      /* source address */
+#define IPH_DST                 16      /* destination address */
+#define UH_SPORT                0       /* source port (offsets relative to the UDP header) */
+#define UH_DPORT                2       /* destination port */
+#define UH_ULEN                 4       /* datagram length */
+#define UH_SUM                  6       /* UDP checksum */
+
+#define GET_WORD(p)             ((USHORT) (((p)[0] << 8) | (p)[1]))
+#define PUT_WORD(p, v)          ((p)[0] = (UBYTE) ((v) >> 8), (p)[1] = (UBYTE) (v))
+
+/* errors returned by udpip_parse() */
+#define UDPIP_ESHORT            (-1)    /* datagram is too short for an IP header */
+#define UDPIP_EHEADER           (-2)    /* invalid IP header */
+#define UDPIP_EIPSUM            (-3)    /* wrong IP header checksum */
+#define UDPIP_EPROTO            (-4)    /* not a UDP datagram */
+#define UDPIP_EUDPHDR           (-5)    /* invalid UDP header */
+#define UDPIP_EUDPSUM           (-6)    /* wrong UDP checksum */
+
+/*
+ * template for the IP and UDP headers of all outgoing datagrams (see udpip_init_template())
+ */
+#define UDPIP_NUM_SEGS          3       /* constant parts of the headers */
+
+typedef struct {
+    UBYTE  ut_hdrs[UDPIP_HDR_LEN];      /* headers with 0 in the fields that vary */
+    USHORT ut_ipsum;                    /* one's complement sum of the IP header ... */
+    USHORT ut_udpsum;                   /* ... and of the UDP header and the pseudo header */
+    USHORT ut_id;                       /* identification of the next datagram */
+    UBYTE  ut_enc[UDPIP_NUM_SEGS][2 * UDPIP_HDR_LEN];   /* SLIP encoding of the constant parts */
+    ULONG  ut_enclen[UDPIP_NUM_SEGS];
+} UdpIpTemplate;
+
+
+/*
+ * TFTP
+ */
+#define TFTP_HDR_LEN 4                  /* opcode + block number */
+#define TFTP_DEFAULT_BLKSIZE 512        /* block size if no other has been negotiated (RFC 1350) */
+#define TFTP_MIN_BLKSIZE 8              /* limits for the blksize option (RFC 2348) */
+#define TFTP_MAX_BLKSIZE 65464
+#define TFTP_MAX_BLK_NUM 65535
+
+/* packet types */
+#define    OP_RRQ    1            /* read request */
+#define    OP_WRQ    2            /* write request */
+#define    OP_DATA   3            /* data packet */
+#define    OP_ACK    4            /* acknowledgement */
+#define    OP_ERROR  5            /* error code */
+#define    OP_OACK   6            /* option acknowledgement (RFC 2347) */
+
+/* error codes */
+#define    EUNDEF      0        /* not defined */
+#define    ENOTFOUND   1        /* file not found */
+#define    EACCESS     2        /* access violation */
+#define    ENOSPACE    3        /* disk full or allocation exceeded */
+#define    EBADOP      4        /* illegal TFTP operation */
+#define    EBADID      5        /* unknown transfer ID */
+#define    EEXISTS     6        /* file already exists */
+#define    ENOUSER     7        /* no such user */
+#define    EOPTNEG     8        /* option negotiation failed */
+
+
+/*
+ * kernels available for SLIP encoding / decoding
+ * The word-at-a-time (SWAR) kernel reads and writes unaligned longwords, so on the Amiga
+ * it can only be used on a 68020 or better. The SSE2 / AVX2 kernels are only available
+ * on the Unix side (x86).
+ */
+#if defined(__mc68020__) || defined(__mc68030__) || defined(__mc68040__) || defined(__mc68060__) \
+    || !(defined(__amigaos__) || defined(AMIGA))
+#define CODEC_HAVE_SWAR 1
+#endif
+#if defined(__SSE2__) && !(defined(__amigaos__) || defined(AMIGA))
+#define CODEC_HAVE_SSE2 1
+#define CODEC_HAVE_AVX2 1       /* selected at runtime if the CPU supports it */
+#endif
+
+/*
+ * resumable SLIP decoder that is fed with arbitrary chunks of serial input and assembles
+ * the datagrams in its own buffer
+ */
+#define SD_NORMAL   0           /* decoding regular bytes */
+#define SD_ESCAPE   1           /* last byte was SLIP_ESC */
+#define SD_DISCARD  2           /* frame is invalid or too long => skip until next SLIP_END */
+
+typedef struct {
+    UBYTE *sd_buf;              /* buffer for the datagram being decoded */
+    ULONG  sd_size;             /* size of this buffer */
+    ULONG  sd_len;              /* number of bytes decoded so far */
+    UBYTE  sd_state;
+    ULONG  sd_nframes;          /* number of complete datagrams */
+    ULONG  sd_ndropped;         /* number of frames dropped (too long or invalid escape) */
+} SlipDecoder;
+
+typedef LONG (*SlipCodecFunc)(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes);
+typedef LONG (*SlipEncodeSumFunc)(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum);
+typedef struct {
+    const char       *k_name;
+    SlipCodecFunc     k_encode;
+    SlipCodecFunc     k_decode;
+    SlipEncodeSumFunc k_encode_sum;     /* encoding + one's complement sum (see slip_encode_sum()) */
+} SlipKernel;
+
+
+/*
+ * function prototypes
+ */
+LONG slip_encode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes);
+LONG slip_decode(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes);
+LONG slip_encode_sum(UBYTE *dst, ULONG dstlen, const UBYTE *src, ULONG nbytes, ULONG *sum);
+ULONG inet_sum(const UBYTE *src, ULONG nbytes, ULONG sum);
+ULONG inet_sum_add(ULONG sum, ULONG segsum, ULONG offset);
+USHORT inet_fold(ULONG sum);
+void udpip_init_template(UdpIpTemplate *tmpl, const UBYTE *srcaddr, const UBYTE *dstaddr, USHORT sport, USHORT dport);
+UBYTE *udpip_encode_headers(UdpIpTemplate *tmpl, UBYTE *dst, ULONG datalen, ULONG datasum);
+UBYTE *udpip_prepend_headers(UdpIpTemplate *tmpl, UBYTE *payload, ULONG datalen, ULONG datasum);
+LONG udpip_parse(const UBYTE *bytes, ULONG nbytes, ULONG *offset);
+const char *udpip_error_string(LONG error);
+ULONG tftp_build_request(UBYTE *buf, ULONG buflen, USHORT opcode, const char *fname, ULONG blksize,
+                         ULONG windowsize);
+void tftp_put_header(UBYTE *buf, USHORT opcode, USHORT num);
+USHORT tftp_get_opcode(const UBYTE *pkt);
+USHORT tftp_get_blknum(const UBYTE *pkt);
+LONG tftp_get_option(const UBYTE *pkt, ULONG len, const char *name, ULONG *value);
+const SlipKernel *slip_get_kernels(ULONG *nkernels);
+void slip_decoder_init(SlipDecoder *dec, UBYTE *buf, ULONG size);
+ULONG slip_decoder_feed(SlipDecoder *dec, const UBYTE *src, ULONG nbytes, ULONG *nconsumed);
+
+#endif /* CWNET_CODEC_H */
@@ -0,0 +1,234 @@
+/*
+ * config.c - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *            over a serial link (using SLIP)
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+#include "config.h"
+
+
+/*
+ * The options are taken from the startup string in the mountlist, for example
+ *     Startup = "BAUD=115200 RADBOOGIE RTSCTS RBUFLEN=16384"
+ * and / or from a config file given with FROM=<file>, which contains the same options
+ * (spread over several lines if you like, lines starting with ';' are comments). Options
+ * in the startup string take precedence over the ones in the file.
+ *
+ * UNIT         unit of serial.device (default 0)
+ * BAUD         baud rate (default: as set in the Serial preferences)
+ * RADBOOGIE    enable the device's fast mode (8N1, no XON/XOFF, needed for high baud rates)
+ * RTSCTS       use RTS/CTS (7-wire) handshaking
+ * RBUFLEN      size of the device's read buffer (default: as set in the Serial preferences)
+ * MTU          maximum size of an IP datagram
+ * MAXQUEUED    maximum number of bytes queued in all transfers / per transfer before the
+ * MAXTRANSFER  clients are blocked (must be greater than 0)
+ * ZEROCOPY     send large writes directly from the client's buffer
+ * LOGLEVEL     minimum level of the messages logged (0 = DEBUG ... 4 = CRITICAL)
+ * KEEPFINISHED number of finished / failed transfers kept in the queue (default 32 / 128)
+ * KEEPFAILED
+ * KEEPFINISHEDMINS  number of minutes finished / failed transfers are kept in the queue
+ * KEEPFAILEDMINS    (default 60 / 1440, 0 = no limit)
+ */
+#define ARG_FROM             0
+#define ARG_UNIT             1
+#define ARG_BAUD             2
+#define ARG_RADBOOGIE        3
+#define ARG_RTSCTS           4
+#define ARG_RBUFLEN          5
+#define ARG_MTU              6
+#define ARG_MAXQUEUED        7
+#define ARG_MAXTRANSFER      8
+#define ARG_ZEROCOPY         9
+#define ARG_LOGLEVEL         10
+#define ARG_KEEPFINISHED     11
+#define ARG_KEEPFAILED       12
+#define ARG_KEEPFINISHEDMINS 13
+#define ARG_KEEPFAILEDMINS   14
+#define NUM_ARGS             15
+
+
+/*
+ * check the options and apply them to the global variables
+ */
+static LONG apply_options(const LONG *args)
+{
+    static const char *limitopts[] = {"MAXQUEUED", "MAXTRANSFER"};
+    static const char *keepopts[]  = {"KEEPFINISHED", "KEEPFAILED", "KEEPFINISHEDMINS", "KEEPFAILEDMINS"};
+    ULONG              i;
+
+    if (args[ARG_RBUFLEN] && (*((LONG *) args[ARG_RBUFLEN]) < MIN_RBUFLEN)) {
+        LOG_CRITICAL("read buffer must be at least %ld bytes\n", (LONG) MIN_RBUFLEN);
+        return DOSFALSE;
+    }
+    if (args[ARG_MTU] && ((*((LONG *) args[ARG_MTU]) < MIN_MTU) || (*((LONG *) args[ARG_MTU]) > MAX_MTU))) {
+        LOG_CRITICAL("MTU must be between %ld and %ld bytes\n", (LONG) MIN_MTU, (LONG) MAX_MTU);
+        return DOSFALSE;
+    }
+    if (args[ARG_LOGLEVEL] && ((*((LONG *) args[ARG_LOGLEVEL]) < LOG_LEVEL_DEBUG) || (*((LONG *) args[ARG_LOGLEVEL]) > LOG_LEVEL_CRITICAL))) {
+        LOG_CRITICAL("log level must be between %ld and %ld\n", (LONG) LOG_LEVEL_DEBUG, (LONG) LOG_LEVEL_CRITICAL);
+        return DOSFALSE;
+    }
+    /* the values are stored as ULONG, so -1 would mean no limit at all (and 0 would
+     * allow only one block per transfer to be queued) */
+    for (i = ARG_MAXQUEUED; i <= ARG_MAXTRANSFER; ++i) {
+        if (args[i] && (*((LONG *) args[i]) <= 0)) {
+            LOG_CRITICAL("%s must be greater than 0\n", limitopts[i - ARG_MAXQUEUED]);
+            return DOSFALSE;
+        }
+    }
+    /* the values are stored as ULONG, so -1 would mean to keep everything */
+    for (i = ARG_KEEPFINISHED; i <= ARG_KEEPFAILEDMINS; ++i) {
+        if (args[i] && (*((LONG *) args[i]) < 0)) {
+            LOG_CRITICAL("%s must not be negative\n", keepopts[i - ARG_KEEPFINISHED]);
+            return DOSFALSE;
+        }
+    }
+
+    if (args[ARG_UNIT])
+        g_ser_unit = *((LONG *) args[ARG_UNIT]);
+    if (args[ARG_BAUD])
+        g_ser_baud = *((LONG *) args[ARG_BAUD]);
+    if (args[ARG_RADBOOGIE])
+        g_ser_flags |= SERF_RAD_BOOGIE;
+    if (args[ARG_RTSCTS])
+        g_ser_flags |= SERF_7WIRE;
+    if (args[ARG_RBUFLEN])
+        g_ser_rbuflen = *((LONG *) args[ARG_RBUFLEN]);
+    if (args[ARG_MTU])
+        g_max_buffer_size = *((LONG *) args[ARG_MTU]);
+    if (args[ARG_MAXQUEUED])
+        g_max_queued_bytes = *((LONG *) args[ARG_MAXQUEUED]);
+    if (args[ARG_MAXTRANSFER])
+        g_max_transfer_bytes = *((LONG *) args[ARG_MAXTRANSFER]);
+    if (args[ARG_ZEROCOPY])
+        g_zero_copy = 1;
+    if (args[ARG_LOGLEVEL])
+        g_loglevel = *((LONG *) args[ARG_LOGLEVEL]);
+    if (args[ARG_KEEPFINISHED])
+        g_keep_finished = *((LONG *) args[ARG_KEEPFINISHED]);
+    if (args[ARG_KEEPFAILED])
+        g_keep_failed = *((LONG *) args[ARG_KEEPFAILED]);
+    if (args[ARG_KEEPFINISHEDMINS])
+        g_keep_finished_mins = *((LONG *) args[ARG_KEEPFINISHEDMINS]);
+    if (args[ARG_KEEPFAILEDMINS])
+        g_keep_failed_mins = *((LONG *) args[ARG_KEEPFAILEDMINS]);
+    return DOSTRUE;
+}
+
+
+/*
+ * parse a string of options (terminated by a newline) - the options are applied if
+ * from is NULL, otherwise only the name of the config file is returned in from
+ */
+static LONG parse_options(char *options, char *from)
+{
+    struct RDArgs *rdargs;
+    LONG           args[NUM_ARGS], result;
+
+    memset(args, 0, sizeof(args));
+    if ((rdargs = AllocDosObject(DOS_RDARGS, NULL)) == NULL) {
+        LOG_CRITICAL("could not allocate memory for parsing the options\n");
+        return DOSFALSE;
+    }
+    rdargs->RDA_Source.CS_Buffer = (UBYTE *) options;
+    rdargs->RDA_Source.CS_Length = strlen(options);
+    rdargs->RDA_Source.CS_CurChr = 0;
+    rdargs->RDA_Flags           |= RDAF_NOPROMPT;
+    if (ReadArgs(CONFIG_TEMPLATE, args, rdargs) == NULL) {
+        LOG_CRITICAL("invalid options (error %ld), template is %s\n", IoErr(), CONFIG_TEMPLATE);
+        FreeDosObject(DOS_RDARGS, rdargs);
+        return DOSFALSE;
+    }
+    if (from) {
+        if (args[ARG_FROM]) {
+            strncpy(from, (char *) args[ARG_FROM], MAX_PATH_LEN - 1);
+            from[MAX_PATH_LEN - 1] = 0;
+        }
+        result = DOSTRUE;
+    }
+    else
+        result = apply_options(args);
+    FreeArgs(rdargs);
+    FreeDosObject(DOS_RDARGS, rdargs);
+    return result;
+}
+
+
+/*
+ * read the config file into a buffer as one line of options, without the comments
+ */
+static LONG read_config_file(const char *fname, char *buffer)
+{
+    BPTR  fh;
+    LONG  nbytes, i;
+    BOOL  comment = 0, linestart = 1;
+
+    if ((fh = Open(fname, MODE_OLDFILE)) == 0) {
+        LOG_CRITICAL("could not open config file '%s'\n", fname);
+        return DOSFALSE;
+    }
+    nbytes = Read(fh, buffer, CONFIG_MAX_LEN - 2);
+    Close(fh);
+    if (nbytes < 0) {
+        LOG_CRITICAL("could not read config file '%s'\n", fname);
+        return DOSFALSE;
+    }
+    for (i = 0; i < nbytes; ++i) {
+        if (linestart && (buffer[i] == ';'))
+            comment = 1;
+        linestart = (buffer[i] == '\n');
+        if (linestart)
+            comment = 0;
+        if (comment || (buffer[i] == '\n') || (buffer[i] == '\r') || (buffer[i] == '\t'))
+            buffer[i] = ' ';
+    }
+    buffer[nbytes]     = '\n';
+    buffer[nbytes + 1] = 0;
+    return DOSTRUE;
+}
+
+
+/*
+ * read_config - read the options from the startup string in the mountlist and the
+ * config file (if any)
+ * The config file is opened by the handler process itself, which is only safe because
+ * clients don't send us packets this early (see the comment in handler.c).
+ */
+LONG read_config(const struct DeviceNode *dnode)
+{
+    static char startup[CONFIG_MAX_LEN], file[CONFIG_MAX_LEN];
+    char        from[MAX_PATH_LEN], *p;
+    ULONG       len;
+
+    /* the string may still be enclosed in quotes, depending on the version of Mount */
+    startup[0] = 0;
+    if (dnode->dn_Startup) {
+        p   = (char *) BCPL_TO_C_PTR(dnode->dn_Startup);
+        len = (UBYTE) p[0];
+        if (len > CONFIG_MAX_LEN - 2)
+            len = CONFIG_MAX_LEN - 2;
+        memcpy(startup, p + 1, len);
+        startup[len] = 0;
+        if ((len >= 2) && (startup[0] == '"') && (startup[len - 1] == '"')) {
+            memmove(startup, startup + 1, len - 2);
+            startup[len - 2] = 0;
+        }
+    }
+    strcat(startup, "\n");
+
+    from[0] = 0;
+    if (parse_options(startup, from) == DOSFALSE)
+        return DOSFALSE;
+    if (from[0]) {
+        LOG_INFO("reading config file '%s'\n", from);
+        if ((read_config_file(from, file) == DOSFALSE) || (parse_options(file, NULL) == DOSFALSE))
+            return DOSFALSE;
+    }
+    if (parse_options(startup, NULL) == DOSFALSE)
+        return DOSFALSE;
+    LOG_INFO("serial unit %ld, baud rate %ld, read buffer %ld bytes, flags 0x%02lx, MTU %ld bytes\n",
+             g_ser_unit, g_ser_baud, g_ser_rbuflen, (ULONG) g_ser_flags, g_max_buffer_size);
+    return DOSTRUE;
+}
@@ -0,0 +1,42 @@
+#ifndef CWNET_CONFIG_H
+#define CWNET_CONFIG_H
+/*
+ * config.h - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *            over a serial link (using SLIP)
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#include <dos/dos.h>
+#include <dos/dosextens.h>
+#include <dos/rdargs.h>
+#include <exec/types.h>
+#include <proto/dos.h>
+
+#include "util.h"
+#include "dos.h"
+#include "netio.h"
+
+
+/*
+ * constants
+ */
+#define CONFIG_TEMPLATE "FROM/K,UNIT/K/N,BAUD/K/N,RADBOOGIE/S,RTSCTS/S,RBUFLEN/K/N,MTU/K/N," \
+                        "MAXQUEUED/K/N,MAXTRANSFER/K/N,ZEROCOPY/S,LOGLEVEL/K/N,KEEPFINISHED/K/N," \
+                        "KEEPFAILED/K/N,KEEPFINISHEDMINS/K/N,KEEPFAILEDMINS/K/N"
+#define CONFIG_MAX_LEN 1024     /* maximum length of the startup string / config file */
+#define MIN_MTU 296             /* limits for the MTU (the smallest one is common for SLIP) */
+#define MAX_MTU 65535
+#define MIN_RBUFLEN 64          /* minimum size of the serial device's read buffer */
+
+
+/*
+ * function prototypes
+ */
+LONG read_config(const struct DeviceNode *dnode);
+
+#endif /* CWNET_CONFIG_H */
@@ -9,14 +9,136 @@
 #include "dos.h"
 
 
+typedef struct
+{
+    UBYTE         ev_type;
+    FileTransfer *ev_ftx;       /* NULL for EV_SEND_NEXT_FILE */
+} Event;
+
+static NetMsg      wrqmsg, abortmsg;               /* messages for the network task */
+static NetMsg      datamsgs[MAX_WINDOW_SIZE];
+static struct List freemsgs;                       /* data messages not in use */
+static Event       events[EVENT_QUEUE_SIZE];       /* ring buffer of internal events ... */
+static ULONG       evhead, evtail;                 /* ... and number of events dispatched / posted */
+static BOOL        sendnext_posted;                /* EV_SEND_NEXT_FILE is pending */
+static struct MinList readyq;                      /* transfers in S_READY, ordered by ftx_seqnum */
+static ULONG       nextseqnum;
+static FileTransfer *nameidx[NAME_HASH_SIZE];      /* hash table of the transfers by file name */
+static LinkedLock *locktbl[MAX_LOCKS];             /* all open locks ... */
+static UWORD       freeslots[MAX_LOCKS];           /* ... and a stack of the free slots */
+static ULONG       nfreeslots;
+static ULONG       nwrites_held;                   /* ACTION_WRITE packets held back in all transfers */
+static struct MinList finishedq, failedq;          /* completed transfers in the order they ended ... */
+static ULONG       nkept_finished, nkept_failed;   /* ... and their number */
+static FileTransfer *lastsent;                     /* transfer handed over to the network task last */
+static QueueStats  qstats;
+
+/* FileTransfer structure a node in the ready queue / lists of completed transfers belongs to */
+#define QNODE_FTX(node) ((FileTransfer *) ((UBYTE *) (node) - offsetof(FileTransfer, ftx_qnode)))
+
+
+/*
+ * post_event - queue an internal event, it is dispatched before the handler waits for
+ * the next message (see dispatch_events())
+ * The queue can't overflow: It is empty whenever a message is handled, and handling a
+ * message posts at most two events for the transfer it refers to. Handling an event
+ * posts at most one event for a transfer (release_held_writes() posts EV_CLOSED only for
+ * the transfer in progress) plus EV_SEND_NEXT_FILE, which is pending at most once because
+ * start_next_transfer() sees everything that happened before anyway. So at most four
+ * events are pending at a time, and EVENT_QUEUE_SIZE leaves plenty of room.
+ */
+void post_event(UBYTE type, FileTransfer *ftx)
+{
+    Event *ev;
+
+    if (type == EV_SEND_NEXT_FILE) {
+        if (sendnext_posted)
+            return;
+        sendnext_posted = 1;
+    }
+    if (evtail - evhead == EVENT_QUEUE_SIZE) {
+        /* can only be a bug, see above */
+        LOG_CRITICAL("event queue is full - dropping event %ld\n", (LONG) type);
+        return;
+    }
+    ev = &events[evtail++ % EVENT_QUEUE_SIZE];
+    ev->ev_type = type;
+    ev->ev_ftx  = ftx;
+}
+
+
+/*
+ * init_indexes - initialize the ready queue, the name index and the lock table
+ */
+void init_indexes()
+{
+    ULONG i;
+
+    NewList((struct List *) &readyq);
+    nextseqnum = 0;
+    for (i = 0; i < NAME_HASH_SIZE; ++i)
+        nameidx[i] = NULL;
+    for (i = 0; i < MAX_LOCKS; ++i) {
+        locktbl[i]   = NULL;
+        freeslots[i] = MAX_LOCKS - 1 - i;
+    }
+    nfreeslots   = MAX_LOCKS;
+    nwrites_held = 0;
+    NewList((struct List *) &finishedq);
+    NewList((struct List *) &failedq);
+    nkept_finished = 0;
+    nkept_failed   = 0;
+    lastsent       = NULL;
+    memset(&qstats, 0, sizeof(QueueStats));
+}
+
+
+/*
+ * create_pools - preallocate the structures used by the handler
+ */
+LONG create_pools()
+{
+    ULONG chunksize;
+
+    /* chunks need to hold at least one block */
+    chunksize = netio_get_max_blksize();
+    if (chunksize < CHUNK_SIZE)
+        chunksize = CHUNK_SIZE;
+    if (create_pool(&g_ftx_pool, "FileTransfer", sizeof(FileTransfer), FTX_POOL_SIZE) == DOSFALSE)
+        goto ERROR_NO_FTX_POOL;
+    if (create_pool(&g_fbuf_pool, "FileBuffer", sizeof(FileBuffer), FBUF_POOL_SIZE) == DOSFALSE)
+        goto ERROR_NO_FBUF_POOL;
+    if (create_pool(&g_chunk_pool, "chunk", chunksize, CHUNK_POOL_SIZE) == DOSFALSE)
+        goto ERROR_NO_CHUNK_POOL;
+    if (create_pool(&g_lock_pool, "LinkedLock", sizeof(LinkedLock), LOCK_POOL_SIZE) == DOSFALSE)
+        goto ERROR_NO_LOCK_POOL;
+    return DOSTRUE;
+
+ERROR_NO_LOCK_POOL:
+    delete_pool(&g_chunk_pool);
+ERROR_NO_CHUNK_POOL:
+    delete_pool(&g_fbuf_pool);
+ERROR_NO_FBUF_POOL:
+    delete_pool(&g_ftx_pool);
+ERROR_NO_FTX_POOL:
+    return DOSFALSE;
+}
+
+
 /*
- * send_internal_packet - send a DOS packet to ourselves
+ * delete_pools - log the statistics of the pools (so that their sizes can be adjusted)
+ * and free them
  */
-void send_internal_packet(struct StandardPacket *pkt, LONG type, APTR arg)
+void delete_pools()
 {
-    pkt->sp_Pkt.dp_Type = type;
-    pkt->sp_Pkt.dp_Arg1 = (LONG) arg;
-    PutMsg(pkt->sp_Pkt.dp_Port, pkt->sp_Pkt.dp_Link);
+    log_pool_stats(&g_ftx_pool);
+    log_pool_stats(&g_fbuf_pool);
+    log_pool_stats(&g_chunk_pool);
+    log_pool_stats(&g_lock_pool);
+    delete_pool(&g_lock_pool);
+    delete_pool(&g_chunk_pool);
+    delete_pool(&g_fbuf_pool);
+    delete_pool(&g_ftx_pool);
 }
 
 
@@ -35,19 +157,157 @@ void return_dos_packet(struct DosPacket *pkt, LONG res1, LONG res2)
 }
 
 
+/*
+ * init_net_msgs - initialize the messages for the network task
+ */
+static void init_net_msg(NetMsg *nm, LONG type)
+{
+    nm->nm_sp.sp_Msg.mn_ReplyPort    = g_port;
+    nm->nm_sp.sp_Msg.mn_Node.ln_Name = (char *) &(nm->nm_sp.sp_Pkt);
+    nm->nm_sp.sp_Pkt.dp_Link         = &(nm->nm_sp.sp_Msg);
+    nm->nm_sp.sp_Pkt.dp_Port         = g_port;
+    nm->nm_sp.sp_Pkt.dp_Type         = type;
+}
+
+
+void init_net_msgs()
+{
+    ULONG i;
+
+    init_net_msg(&wrqmsg, ACTION_NET_WRQ);
+    init_net_msg(&abortmsg, ACTION_NET_ABORT);
+    NewList(&freemsgs);
+    for (i = 0; i < MAX_WINDOW_SIZE; ++i) {
+        init_net_msg(&datamsgs[i], ACTION_NET_DATA);
+        AddTail(&freemsgs, (struct Node *) &datamsgs[i]);
+    }
+}
+
+
+static void send_net_msg(NetMsg *nm, FileTransfer *ftx)
+{
+    ++ftx->ftx_nnetmsgs;
+    nm->nm_sp.sp_Pkt.dp_Arg1 = (LONG) ftx;
+    PutMsg(g_netport, &(nm->nm_sp.sp_Msg));
+}
+
+
+/*
+ * terminate the file transfer in progress because of an error reported by the network task
+ */
+static void fail_transfer(FileTransfer *ftx, LONG error)
+{
+    ftx->ftx_state = S_ERROR;
+    ftx->ftx_error = error;
+    g_busy = 0;
+    post_event(EV_FAILED, ftx);
+}
+
+
+/*
+ * check if a file transfer is the one in progress (the network task may be using its data)
+ */
+static BOOL is_in_progress(FileTransfer *ftx)
+{
+    return (ftx->ftx_state == S_WRQ_SENT) || (ftx->ftx_state == S_DATA_SENT) || (ftx->ftx_state == S_WAITING);
+}
+
+
+/*
+ * terminate the file transfer in progress because of an error on our side
+ * The network task returns all blocks it still holds and then the ACTION_NET_ABORT
+ * message, only then the data of the transfer may be freed.
+ */
+static void abort_transfer(FileTransfer *ftx, LONG error)
+{
+    LOG_ERROR("aborting transfer of file '%s'\n", ftx->ftx_fname);
+    ftx->ftx_state = S_ERROR;
+    ftx->ftx_error = error;
+    abortmsg.nm_sp.sp_Pkt.dp_Arg2 = error;
+    send_net_msg(&abortmsg, ftx);
+}
+
+
+/*
+ * send_write_request - let the network task send the write request for a file transfer
+ */
+void send_write_request(FileTransfer *ftx)
+{
+    LOG_DEBUG("starting transfer of file '%s'\n", ftx->ftx_fname);
+    ftx->ftx_state = S_WRQ_SENT;
+    lastsent       = ftx;
+    DateStamp(&ftx->ftx_stats.ts_started);
+    wrqmsg.nm_sp.sp_Pkt.dp_Arg2 = (LONG) ftx->ftx_fname;
+    send_net_msg(&wrqmsg, ftx);
+}
+
+
+/*
+ * put a file transfer into S_READY and into the ready queue - usually it's appended,
+ * but a transfer opened earlier than the ones already waiting goes in front of them
+ */
+static void make_transfer_ready(FileTransfer *ftx)
+{
+    struct MinNode *pred;
+
+    ftx->ftx_state = S_READY;
+    for (pred = readyq.mlh_TailPred;
+         (pred != (struct MinNode *) &readyq.mlh_Head) && (QNODE_FTX(pred)->ftx_seqnum > ftx->ftx_seqnum);
+         pred = pred->mln_Pred)
+        ;
+    if (pred == (struct MinNode *) &readyq.mlh_Head)
+        pred = NULL;
+    Insert((struct List *) &readyq, (struct Node *) &ftx->ftx_qnode, (struct Node *) pred);
+}
+
+
+/*
+ * let a file transfer that hasn't been started yet fail (takes it out of the ready queue)
+ */
+static void fail_waiting_transfer(FileTransfer *ftx)
+{
+    if (ftx->ftx_state == S_READY)
+        Remove((struct Node *) &ftx->ftx_qnode);
+    ftx->ftx_state = S_ERROR;
+}
+
+
 /*
  * get_next_file_from_queue - get next file from queue that is ready for transfer (or NULL)
  */
 FileTransfer *get_next_file_from_queue()
 {
-    FileTransfer *ftx = (FileTransfer *) g_transfers.lh_Head;
+    struct MinNode *node;
 
-    if (IsListEmpty(&g_transfers))
+    if ((node = (struct MinNode *) RemHead((struct List *) &readyq)) == NULL)
         return NULL;
-    for (ftx = (FileTransfer *) g_transfers.lh_Head;
-         ftx != (FileTransfer *) &g_transfers.lh_Tail;
-         ftx = (FileTransfer *) ftx->ftx_node.ln_Succ) {
-        if (ftx->ftx_state == S_READY)
+    return QNODE_FTX(node);
+}
+
+
+/*
+ * bucket of a file name in the name index
+ */
+static ULONG hash_name(const char *fname)
+{
+    ULONG hash = 5381;
+
+    while (*fname)
+        hash = hash * 33 + (UBYTE) *fname++;
+    return hash & (NAME_HASH_SIZE - 1);
+}
+
+
+/*
+ * find the file transfer with the given name - if there are several (the same file has
+ * been uploaded again), the one opened last is returned
+ */
+static FileTransfer *find_transfer(const char *fname)
+{
+    FileTransfer *ftx;
+
+    for (ftx = nameidx[hash_name(fname)]; ftx; ftx = ftx->ftx_hashnext) {
+        if (strcmp(ftx->ftx_fname, fname) == 0)
             return ftx;
     }
     return NULL;
@@ -55,20 +315,159 @@ FileTransfer *get_next_file_from_queue()
 
 
 /*
- * find_lock_in_list - find a lock in the list
+ * a file transfer has ended and the client has closed the file => add it to the totals
+ * and to the list of completed transfers, from which it is removed later on
+ */
+static void retire_transfer(FileTransfer *ftx)
+{
+    if (ftx->ftx_retired)
+        return;
+    ftx->ftx_retired = 1;
+    qstats.qs_nbytes_acked += ftx->ftx_stats.ts_nbytes_acked;
+    qstats.qs_nretransmits += ftx->ftx_stats.ts_nretransmits;
+    qstats.qs_ntimeouts    += ftx->ftx_stats.ts_ntimeouts;
+    if (ftx->ftx_state == S_FINISHED) {
+        ++qstats.qs_nfinished;
+        ++nkept_finished;
+        AddTail((struct List *) &finishedq, (struct Node *) &ftx->ftx_qnode);
+    }
+    else {
+        ++qstats.qs_nfailed;
+        ++nkept_failed;
+        AddTail((struct List *) &failedq, (struct Node *) &ftx->ftx_qnode);
+    }
+}
+
+
+/*
+ * remove a completed file transfer from the queue and free it
+ */
+static void remove_transfer(FileTransfer *ftx)
+{
+    FileTransfer **pftx;
+
+    LOG_DEBUG("removing file '%s' from the queue\n", ftx->ftx_fname);
+    for (pftx = &nameidx[hash_name(ftx->ftx_fname)]; *pftx != ftx; pftx = &(*pftx)->ftx_hashnext)
+        ;
+    *pftx = ftx->ftx_hashnext;
+    Remove((struct Node *) ftx);
+    pool_free(&g_ftx_pool, ftx);
+    ++qstats.qs_nremoved;
+}
+
+
+/*
+ * remove the oldest transfers from a list of completed transfers as long as there are
+ * more than keep of them or they have ended more than mins minutes ago (0 = no limit)
+ */
+static void expire_transfers(struct MinList *list, ULONG *nkept, ULONG keep, ULONG mins)
+{
+    struct MinNode   *node, *next;
+    FileTransfer     *ftx;
+    struct DateStamp  now;
+
+    if (mins)
+        DateStamp(&now);
+    for (node = list->mlh_Head; (next = node->mln_Succ); node = next) {
+        ftx = QNODE_FTX(node);
+        if ((ftx == lastsent) || (ftx->ftx_nnetmsgs > 0) || (ftx->ftx_nrefs > 0))
+            continue;
+        if ((*nkept <= keep) &&
+            ((mins == 0) || (DS_TICKS(&now) - DS_TICKS(&ftx->ftx_stats.ts_finished) < mins * 60 * TICKS_PER_SECOND)))
+            break;
+        Remove((struct Node *) node);
+        --*nkept;
+        remove_transfer(ftx);
+    }
+}
+
+
+/*
+ * remove completed transfers from the queue according to the retention policy, so that
+ * memory usage and the time needed for listing the queue don't grow without bounds
+ * Failed transfers are kept longer by default so that they can still be inspected.
+ * Transfers a lock or a directory scan in progress (fib_DiskKey) refers to are skipped,
+ * and so are the transfer handed over to the network task last, the task still updates
+ * its statistics, and transfers whose messages haven't all come back from the network
+ * task yet (their replies may still be queued on our port).
+ */
+static void reclaim_transfers()
+{
+    expire_transfers(&finishedq, &nkept_finished, g_keep_finished, g_keep_finished_mins);
+    expire_transfers(&failedq, &nkept_failed, g_keep_failed, g_keep_failed_mins);
+}
+
+
+/*
+ * allocate a lock and enter it into the lock table (returns NULL if there's no memory
+ * or the table is full)
  */
-LinkedLock *find_lock_in_list(const struct FileLock *flock)
+static LinkedLock *alloc_lock()
 {
     LinkedLock *llock;
 
-    if (IsListEmpty(&g_locks))
+    if (nfreeslots == 0) {
+        LOG_ERROR("too many open locks\n");
+        return NULL;
+    }
+    if ((llock = (LinkedLock *) pool_alloc(&g_lock_pool)) == NULL) {
+        LOG_ERROR("could not allocate memory for LinkedLock structure\n");
         return NULL;
-    for (llock = (LinkedLock *) g_locks.lh_Head;
-         llock != (LinkedLock *) &g_locks.lh_Tail;
-         llock = (LinkedLock *) llock->ll_node.ln_Succ) {
-        if (&llock->ll_flock == flock)
-            return llock;
     }
+    llock->ll_slot = freeslots[--nfreeslots];
+    llock->ll_flock.fl_Key = 0;
+    llock->ll_scanpos      = NULL;
+    locktbl[llock->ll_slot] = llock;
+    return llock;
+}
+
+
+/*
+ * move the position of the directory scan of a root lock to a node in the list of
+ * transfers (the end of the list or NULL = no transfer), so that the transfer it
+ * continues with is not removed
+ */
+static void set_scan_pos(LinkedLock *llock, struct Node *node)
+{
+    if (llock->ll_scanpos)
+        --llock->ll_scanpos->ftx_nrefs;
+    if (node && node->ln_Succ) {
+        llock->ll_scanpos = (FileTransfer *) node;
+        ++llock->ll_scanpos->ftx_nrefs;
+    }
+    else
+        llock->ll_scanpos = NULL;
+}
+
+
+/*
+ * free_lock - remove a lock from the lock table and free it
+ */
+void free_lock(LinkedLock *llock)
+{
+    if (llock->ll_flock.fl_Key)
+        --((FileTransfer *) llock->ll_flock.fl_Key)->ftx_nrefs;
+    set_scan_pos(llock, NULL);
+    locktbl[llock->ll_slot] = NULL;
+    freeslots[nfreeslots++] = llock->ll_slot;
+    pool_free(&g_lock_pool, llock);
+}
+
+
+/*
+ * find_lock - check if a lock passed in by a client is one of ours
+ * We have to read the slot number from the memory the lock points to before we know
+ * the lock is valid, which is harmless as there's no memory protection.
+ */
+LinkedLock *find_lock(const struct FileLock *flock)
+{
+    LinkedLock *llock;
+
+    if (flock == NULL)
+        return NULL;
+    llock = (LinkedLock *) ((UBYTE *) flock - offsetof(LinkedLock, ll_flock));
+    if ((llock->ll_slot < MAX_LOCKS) && (locktbl[llock->ll_slot] == llock))
+        return llock;
     return NULL;
 }
 
@@ -94,23 +493,42 @@ void do_find_output(struct DosPacket *inpkt)
         * ACTION_WRITE packet, otherwise the last packet of a buffer doesn't get 
         * saved by the server because the block number would be reset to 1 in the 
         * middle of a transfer and the server would assume a duplicate packet. */
-    if ((ftx = (FileTransfer *) AllocVec(sizeof(FileTransfer), 0)) != NULL) {
+    if ((ftx = (FileTransfer *) pool_alloc(&g_ftx_pool)) != NULL) {
         ftx->ftx_state  = S_QUEUED;
         ftx->ftx_blknum = 0;                        /* will be set to 1 upon sending the first buffer */
+        ftx->ftx_lastack = 0;
+        ftx->ftx_blksize = TFTP_DEFAULT_BLKSIZE;    /* until the server has acknowledged a larger one */
+        ftx->ftx_windowsize = 1;
+        /* the write request counts as a full block 0, so that data blocks follow it */
+        BLKLEN(ftx, 0) = TFTP_DEFAULT_BLKSIZE;
         ftx->ftx_error  = 0;
-        ftx->ftx_node.ln_Name = ftx->ftx_fname;     /* so that we can use FindName() */
+        ftx->ftx_closed = 0;
+        ftx->ftx_endheld = 0;
+        ftx->ftx_retired = 0;
+        ftx->ftx_nbytes_queued = 0;
+        ftx->ftx_nzcwrites = 0;
+        ftx->ftx_nnetmsgs = 0;
+        ftx->ftx_nrefs    = 0;
+        NewList(&ftx->ftx_writes);
+        ftx->ftx_node.ln_Name = ftx->ftx_fname;
         strncpy(ftx->ftx_fname, nameptr, MAX_PATH_LEN - 1);
         ftx->ftx_fname[MAX_PATH_LEN - 1] = 0;
+        ftx->ftx_seqnum   = nextseqnum++;
+        ftx->ftx_hashnext = nameidx[hash_name(ftx->ftx_fname)];
+        nameidx[hash_name(ftx->ftx_fname)] = ftx;
         NewList(&ftx->ftx_buffers);
+        ftx->ftx_sendbuf = NULL;
+        memset(&ftx->ftx_stats, 0, sizeof(TransferStats));
+        DateStamp(&ftx->ftx_stats.ts_queued);
         AddTail(&g_transfers, (struct Node *) ftx);
         fh->fh_Arg1 = (LONG) ftx;
         fh->fh_Port = (struct MsgPort *) DOSFALSE;  /* tells DOS we're not interactive */
         
-        LOG("INFO: added file '%s' to queue\n", ftx->ftx_fname);
+        LOG_INFO("added file '%s' to queue\n", ftx->ftx_fname);
         return_dos_packet(inpkt, DOSTRUE, 0);
     }
     else {
-        LOG("ERROR: could not allocate memory for FileTransfer structure\n");
+        LOG_ERROR("could not allocate memory for FileTransfer structure\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_NO_FREE_STORE);
     }
 
@@ -118,43 +536,299 @@ void do_find_output(struct DosPacket *inpkt)
 
 
 /*
- * do_write - handle ACTION_WRITE packets
+ * append data written by the client to the chunks of a file transfer
+ * We need to copy the data because we return the packet before the data is sent and
+ * the client is free to reuse / free the buffer once the packet has been returned.
+ * The data is appended to the last chunk and new chunks are added as needed. In zero-copy
+ * mode, this is only used for the data that can not be sent from the client's buffer.
  */
-void do_write(struct DosPacket *inpkt, struct StandardPacket *outpkt)
+static LONG queue_data(FileTransfer *ftx, const UBYTE *src, LONG nbytes)
 {
-    FileTransfer            *ftx;
-    FileBuffer              *fbuf;
+    FileBuffer *fbuf;
+    UBYTE      *end;
+    LONG        n;
 
-    ftx = (FileTransfer *) inpkt->dp_Arg1;
-    /* initialize FileBuffer structure and queue it (one buffer for each ACTION_WRITE packet */
-    if ((fbuf = (FileBuffer *) AllocVec(sizeof(FileBuffer), 0)) != NULL) {
-        /* We need to copy the buffer because we return the packet before the 
-        * buffer is sent and the client is free to reuse / free the buffer once the
-        * packet has been returned. */
-        if ((fbuf->fb_bytes = AllocVec(inpkt->dp_Arg3, 0)) != NULL) {
-            memcpy(fbuf->fb_bytes, (APTR) inpkt->dp_Arg2, inpkt->dp_Arg3);
+    while (nbytes > 0) {
+        fbuf = (FileBuffer *) ftx->ftx_buffers.lh_TailPred;
+        if (IsListEmpty(&ftx->ftx_buffers) || fbuf->fb_pkt
+            || (((UBYTE *) fbuf->fb_curpos) + fbuf->fb_nbytes_to_send == ((UBYTE *) fbuf->fb_bytes) + fbuf->fb_size)) {
+            /* last chunk is full => add a new one */
+            if ((fbuf = (FileBuffer *) pool_alloc(&g_fbuf_pool)) == NULL) {
+                LOG_ERROR("could not allocate memory for FileBuffer structure\n");
+                return DOSFALSE;
+            }
+            if ((fbuf->fb_bytes = pool_alloc(&g_chunk_pool)) == NULL) {
+                LOG_ERROR("could not allocate memory for data buffer\n");
+                pool_free(&g_fbuf_pool, fbuf);
+                return DOSFALSE;
+            }
+            fbuf->fb_size           = g_chunk_pool.p_objsize;
             fbuf->fb_curpos         = fbuf->fb_bytes;
-            fbuf->fb_nbytes_to_send = inpkt->dp_Arg3;
+            fbuf->fb_nbytes_to_send = 0;
+            fbuf->fb_pkt            = NULL;
             AddTail(&(ftx->ftx_buffers), (struct Node *) fbuf);
-            
-            LOG("INFO: added buffer of file '%s' to queue\n", ftx->ftx_fname);
-            return_dos_packet(inpkt, inpkt->dp_Arg3, 0);
         }
+
+        end = ((UBYTE *) fbuf->fb_curpos) + fbuf->fb_nbytes_to_send;
+        n   = ((UBYTE *) fbuf->fb_bytes) + fbuf->fb_size - end;
+        if (n > nbytes)
+            n = nbytes;
+        memcpy(end, src, n);
+        fbuf->fb_nbytes_to_send += n;
+        ftx->ftx_nbytes_queued  += n;
+        g_nbytes_queued         += n;
+        src    += n;
+        nbytes -= n;
+    }
+    return DOSTRUE;
+}
+
+
+/*
+ * queue the full blocks at the start of the data of an ACTION_WRITE packet without
+ * copying them (zero-copy mode) - returns the number of bytes queued this way
+ * This is only possible if the block size has already been negotiated and the data
+ * queued so far ends at a block boundary. The packet is returned in ack_blocks().
+ */
+static LONG queue_client_buffer(FileTransfer *ftx, struct DosPacket *inpkt)
+{
+    FileBuffer *fbuf;
+    LONG        n;
+
+    if (!g_zero_copy
+        || ((ftx->ftx_state != S_DATA_SENT) && (ftx->ftx_state != S_WAITING))
+        || (ftx->ftx_nzcwrites >= MAX_ZC_WRITES)
+        || (ftx->ftx_nbytes_queued % ftx->ftx_blksize != 0))
+        return 0;
+    n = inpkt->dp_Arg3 - inpkt->dp_Arg3 % ftx->ftx_blksize;
+    if (n == 0)
+        return 0;
+    if ((fbuf = (FileBuffer *) pool_alloc(&g_fbuf_pool)) == NULL) {
+        /* not fatal, we just copy the data then */
+        LOG_WARN("could not allocate memory for FileBuffer structure\n");
+        return 0;
+    }
+    fbuf->fb_bytes          = (APTR) inpkt->dp_Arg2;
+    fbuf->fb_size           = n;
+    fbuf->fb_curpos         = fbuf->fb_bytes;
+    fbuf->fb_nbytes_to_send = n;
+    fbuf->fb_pkt            = inpkt;
+    AddTail(&(ftx->ftx_buffers), (struct Node *) fbuf);
+    ++ftx->ftx_nzcwrites;
+    ftx->ftx_nbytes_queued += n;
+    g_nbytes_queued        += n;
+    return n;
+}
+
+
+/*
+ * queue the data of an ACTION_WRITE packet and return the packet, unless the data is sent
+ * from the client's buffer - returns DOSFALSE if there is not enough memory
+ */
+static LONG queue_write(FileTransfer *ftx, struct DosPacket *pkt)
+{
+    LONG nzc;
+
+    /* the rest that is not sent from the client's buffer (if any) is copied */
+    nzc = queue_client_buffer(ftx, pkt);
+    if (queue_data(ftx, ((UBYTE *) pkt->dp_Arg2) + nzc, pkt->dp_Arg3 - nzc) == DOSFALSE) {
+        /* in case of zero-copy, the packet is returned when the transfer has failed */
+        if (nzc == 0)
+            return_dos_packet(pkt, -1, ERROR_NO_FREE_STORE);
+        ftx->ftx_error = ERROR_NO_FREE_STORE;
+        return DOSFALSE;
+    }
+    ftx->ftx_stats.ts_nbytes_written += pkt->dp_Arg3;
+    if (nzc > 0) {
+        LOG_INFO("added %ld bytes of file '%s' to queue (%ld bytes without copying)\n",
+            pkt->dp_Arg3, ftx->ftx_fname, nzc);
+    }
+    else {
+        LOG_INFO("added %ld bytes of file '%s' to queue\n", pkt->dp_Arg3, ftx->ftx_fname);
+        return_dos_packet(pkt, pkt->dp_Arg3, 0);
+    }
+    return DOSTRUE;
+}
+
+
+/*
+ * check if more data of a file transfer may be queued or if the client has to wait
+ * A transfer may always queue data as long as it has less than one block queued, so
+ * that the transfer in progress can't get stuck waiting for its last block, and the
+ * transfer in progress is not subject to the global limit, so that it can't be blocked
+ * by files waiting for it to finish.
+ */
+static BOOL may_queue_data(FileTransfer *ftx)
+{
+    if (ftx->ftx_nbytes_queued < netio_get_max_blksize())
+        return 1;
+    if (ftx->ftx_nbytes_queued >= g_max_transfer_bytes)
+        return 0;
+    if ((g_nbytes_queued >= g_max_queued_bytes)
+        && (ftx->ftx_state != S_WRQ_SENT) && (ftx->ftx_state != S_DATA_SENT) && (ftx->ftx_state != S_WAITING))
+        return 0;
+    return 1;
+}
+
+
+/*
+ * release_held_writes - queue the data of ACTION_WRITE packets that have been held back
+ * because of the memory limits and return the packets (called when data has been freed)
+ * Apart from EV_CLOSED for the transfer in progress if its ACTION_END has been held back
+ * as well (see do_end()), this never posts an event - transfers that become ready are started after
+ * the current transfer has finished, and the current transfer continues with the next
+ * window anyway.
+ */
+void release_held_writes()
+{
+    FileTransfer     *ftx;
+    struct Message   *msg;
+    struct DosPacket *pkt;
+
+    /* no need to look at all the transfers if none of them is waiting */
+    if (nwrites_held == 0)
+        return;
+    for (ftx = (FileTransfer *) g_transfers.lh_Head;
+         ftx != (FileTransfer *) &g_transfers.lh_Tail;
+         ftx = (FileTransfer *) ftx->ftx_node.ln_Succ) {
+        while (!IsListEmpty(&ftx->ftx_writes) && may_queue_data(ftx)) {
+            msg = (struct Message *) RemHead(&ftx->ftx_writes);
+            --nwrites_held;
+            pkt = (struct DosPacket *) msg->mn_Node.ln_Name;
+            LOG_DEBUG("releasing %ld bytes of file '%s' held back\n", pkt->dp_Arg3, ftx->ftx_fname);
+            if (queue_write(ftx, pkt) == DOSTRUE) {
+                if (ftx->ftx_state == S_QUEUED)
+                    make_transfer_ready(ftx);
+            }
+            else {
+                if (is_in_progress(ftx)) {
+                    abort_transfer(ftx, ftx->ftx_error);
+                    break;
+                }
+                fail_waiting_transfer(ftx);
+                free_transfer_data(ftx);
+            }
+        }
+        /* only the transfer in progress needs the event (to send its last block), the
+         * others (S_READY) ignore it, and this keeps the number of events bounded */
+        if (ftx->ftx_endheld && IsListEmpty(&ftx->ftx_writes)) {
+            ftx->ftx_endheld = 0;
+            ftx->ftx_closed  = 1;
+            if (is_in_progress(ftx))
+                post_event(EV_CLOSED, ftx);
+        }
+    }
+}
+
+
+/*
+ * free a chunk of a file transfer - if the chunk is the buffer of a client (zero-copy
+ * mode), the client's packet is returned instead of freeing the buffer
+ */
+static void free_chunk(FileTransfer *ftx, FileBuffer *fbuf, LONG res1, LONG res2)
+{
+    if (fbuf->fb_pkt) {
+        return_dos_packet(fbuf->fb_pkt, res1 == -1 ? -1 : fbuf->fb_pkt->dp_Arg3, res2);
+        --ftx->ftx_nzcwrites;
+    }
+    else
+        pool_free(&g_chunk_pool, fbuf->fb_bytes);
+    pool_free(&g_fbuf_pool, fbuf);
+}
+
+
+/*
+ * free_transfer_data - free all data of a file transfer that has finished or failed
+ * ACTION_WRITE packets that are still being held back are returned with an error.
+ */
+void free_transfer_data(FileTransfer *ftx)
+{
+    FileBuffer              *fbuf;
+    struct Message          *msg;
+
+    while ((fbuf = (FileBuffer *) RemHead(&(ftx->ftx_buffers))))
+        free_chunk(ftx, fbuf, -1, ftx->ftx_error);
+    g_nbytes_queued -= ftx->ftx_nbytes_queued;
+    ftx->ftx_nbytes_queued = 0;
+    while ((msg = (struct Message *) RemHead(&ftx->ftx_writes))) {
+        --nwrites_held;
+        return_dos_packet((struct DosPacket *) msg->mn_Node.ln_Name, -1, ftx->ftx_error);
+    }
+    /* the client has already closed the file if it has been waiting for the writes */
+    if (ftx->ftx_endheld) {
+        ftx->ftx_endheld = 0;
+        ftx->ftx_closed  = 1;
+    }
+    DateStamp(&ftx->ftx_stats.ts_finished);
+    if (ftx->ftx_closed)
+        retire_transfer(ftx);
+}
+
+
+/*
+ * do_write - handle ACTION_WRITE packets
+ */
+void do_write(struct DosPacket *inpkt)
+{
+    FileTransfer            *ftx;
+
+    ftx = (FileTransfer *) inpkt->dp_Arg1;
+    /* transfer has already failed => no point in queueing more data */
+    if (ftx->ftx_state == S_ERROR) {
+        return_dos_packet(inpkt, -1, ftx->ftx_error);
+        return;
+    }
+
+    /* If too much data is queued already, the packet is not returned until enough data
+     * has been acknowledged by the server, which blocks the client in the meantime.
+     * Packets that are already held back keep their order. */
+    if (!IsListEmpty(&ftx->ftx_writes) || !may_queue_data(ftx)) {
+        LOG_DEBUG("holding back %ld bytes of file '%s' (%ld bytes queued)\n",
+            inpkt->dp_Arg3, ftx->ftx_fname, ftx->ftx_nbytes_queued);
+        AddTail(&ftx->ftx_writes, &inpkt->dp_Link->mn_Node);
+        ++nwrites_held;
+        return;
+    }
+
+    if (queue_write(ftx, inpkt) == DOSFALSE) {
+        if (is_in_progress(ftx))
+            abort_transfer(ftx, ftx->ftx_error);
         else {
-            LOG("ERROR: could not allocate memory for data buffer\n");
-            return_dos_packet(inpkt, DOSFALSE, ERROR_NO_FREE_STORE);
-            ftx->ftx_state = S_ERROR;
-            ftx->ftx_error = ERROR_NO_FREE_STORE;
-            send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
+            fail_waiting_transfer(ftx);
+            post_event(EV_FAILED, ftx);
         }
+        return;
     }
-    else {
-        LOG("ERROR: could not allocate memory for FileBuffer structure\n");
-        return_dos_packet(inpkt, DOSFALSE, ERROR_NO_FREE_STORE);
-        ftx->ftx_state = S_ERROR;
-        ftx->ftx_error = ERROR_NO_FREE_STORE;
-        send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
+    /* We don't wait for ACTION_END before we start the transfer, the file is
+     * sent while the client is still writing it. */
+    if (inpkt->dp_Arg3 > 0)
+        post_event(EV_DATA_QUEUED, ftx);
+}
+
+
+/*
+ * do_end - handle ACTION_END packets
+ * The transfer has usually already been started by the first ACTION_WRITE, only the final
+ * (short) block has been held back until now, because as long as the file is open we
+ * don't know if it's really the last one. If ACTION_WRITE packets are still held back,
+ * the transfer is closed only after their data has been queued (see release_held_writes()),
+ * otherwise the partial block in front of them would be sent as the last one.
+ */
+void do_end(struct DosPacket *inpkt)
+{
+    FileTransfer            *ftx;
+
+    ftx = (FileTransfer *) inpkt->dp_Arg1;
+    LOG_INFO("file '%s' has been closed by the client\n", ftx->ftx_fname);
+    return_dos_packet(inpkt, DOSTRUE, 0);
+    if (!IsListEmpty(&ftx->ftx_writes)) {
+        LOG_DEBUG("writes of file '%s' are still held back - closing it when they have been queued\n",
+            ftx->ftx_fname);
+        ftx->ftx_endheld = 1;
+        return;
     }
+    ftx->ftx_closed = 1;
+    post_event(EV_CLOSED, ftx);
 }
 
 
@@ -169,10 +843,10 @@ void do_locate_object(struct DosPacket *inpkt)
     char                     fname[MAX_PATH_LEN], *nameptr;
 
     BCPL_TO_C_STR(fname, inpkt->dp_Arg2);
-    LOG("DEBUG: lock = 0x%08lx, name = %s, mode = %ld\n", inpkt->dp_Arg1, fname, inpkt->dp_Arg3);
+    LOG_DEBUG("lock = 0x%08lx, name = %s, mode = %ld\n", inpkt->dp_Arg1, fname, inpkt->dp_Arg3);
 
     /* initialize FileLock structure */
-    if ((llock = (LinkedLock *) AllocVec(sizeof(LinkedLock), 0)) != NULL) {
+    if ((llock = alloc_lock()) != NULL) {
         flock = &(llock->ll_flock);
         flock->fl_Link = 0;
         flock->fl_Access = inpkt->dp_Arg3;
@@ -182,7 +856,6 @@ void do_locate_object(struct DosPacket *inpkt)
         flock->fl_Volume = C_TO_BCPL_PTR(g_dnode);
     }
     else {
-        LOG("ERROR: could not allocate memory for LinkedLock structure\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_NO_FREE_STORE);
         return;
     }
@@ -193,56 +866,99 @@ void do_locate_object(struct DosPacket *inpkt)
         if (strstr(fname, "//")) {
             /* name is a full URL => lock is being requested for a file transfer 
                 * => return error because file does not yet exist */
-            LOG("DEBUG: lock for file transfer requested\n");
+            LOG_DEBUG("lock for file transfer requested\n");
+            free_lock(llock);
             return_dos_packet(inpkt, DOSFALSE, ERROR_OBJECT_NOT_FOUND);
         }
         else if ((strncmp(fname, "net:", 256) == 0)) {
             /* lock is being requested for a queue listing */
-            LOG("DEBUG: lock for queue listing requested\n");
+            LOG_DEBUG("lock for queue listing requested\n");
             flock->fl_Key = 0;
             return_dos_packet(inpkt, C_TO_BCPL_PTR(flock), 0);
-            AddTail(&g_locks, (struct Node *) llock);
         }
         else {
             /* lock is being requested for a single file in the queue */
-            /* => search for name *without* the device name in list */
+            /* => search for name *without* the device name in the index */
             if (strrchr(fname, ':'))
                 nameptr = strrchr(fname, ':') + 1;
             else
                 nameptr = fname;
-            if ((ftx = (FileTransfer *) FindName(&g_transfers, nameptr)) != NULL) {
-                LOG("DEBUG: lock for file '%s' requested\n", fname);
+            if ((ftx = find_transfer(nameptr)) != NULL) {
+                LOG_DEBUG("lock for file '%s' requested\n", fname);
                 flock->fl_Key = (LONG) ftx;
+                ++ftx->ftx_nrefs;
                 return_dos_packet(inpkt, C_TO_BCPL_PTR(flock), 0);
-                AddTail(&g_locks, (struct Node *) llock);
             }
             else {
-                LOG("ERROR: lock for file '%s' requested but file not found in queue\n", fname);
+                LOG_ERROR("lock for file '%s' requested but file not found in queue\n", fname);
+                free_lock(llock);
                 return_dos_packet(inpkt, DOSFALSE,  ERROR_OBJECT_NOT_FOUND);
             }
         }
     }
     else {
         /* name is relative to an existing lock => not supported because we don't support directories */
-        LOG("ERROR: new lock relative to an existing lock requested\n");
+        LOG_ERROR("new lock relative to an existing lock requested\n");
+        free_lock(llock);
         return_dos_packet(inpkt, DOSFALSE, ERROR_NOT_IMPLEMENTED);
     }
 }
 
 
+/*
+ * fill a FileInfoBlock structure with the values of a file transfer - protection bits
+ * contain the state, the size contains the error code, the number of blocks is the one
+ * of the data written so far, the date is the time the file has been queued and the
+ * comment shows the progress of the transfer
+ */
+static void fill_fib(struct FileInfoBlock *fib, const FileTransfer *ftx)
+{
+    const TransferStats *ts = &ftx->ftx_stats;
+    struct DateStamp     now;
+    ULONG                ticks = 0;
+
+    fib->fib_Protection   = ftx->ftx_state;
+    fib->fib_Size         = ftx->ftx_error;
+    fib->fib_NumBlocks    = (ts->ts_nbytes_written + ftx->ftx_blksize - 1) / ftx->ftx_blksize;
+    /* fib_FileName is a BCPL string => first byte contains length, but for some
+        * reason it has to be null-terminated as well, => maximum length is MAX_FILENAME_LEN - 2,
+        * and we can copy MAX_FILENAME_LEN - 2 characters at most */
+    /* TODO: For some reason, the last character of the file name gets lost on its way
+     *       to the application calling Examine() or ExNext() */
+    fib->fib_FileName[0]  = strlen(ftx->ftx_fname) % MAX_FILENAME_LEN - 1;
+    strncpy(fib->fib_FileName + 1, ftx->ftx_fname, MAX_FILENAME_LEN - 2);
+    fib->fib_FileName[MAX_FILENAME_LEN - 1] = 0;
+    fib->fib_Date         = ts->ts_queued;
+
+    /* same for the comment (fib_Comment has 80 bytes) */
+    if (ts->ts_started.ds_Days) {
+        if (ts->ts_finished.ds_Days)
+            now = ts->ts_finished;
+        else
+            DateStamp(&now);
+        ticks = DS_TICKS(&now) - DS_TICKS(&ts->ts_started);
+    }
+    snprintf(fib->fib_Comment + 1, sizeof(fib->fib_Comment) - 2, "%ld/%ld bytes, %ld B/s, RTT %ld ms, %ld rexmit",
+             ts->ts_nbytes_acked, ts->ts_nbytes_written, BYTES_PER_SEC(ts->ts_nbytes_acked, ticks),
+             ts->ts_nrtt_samples ? ts->ts_rtt_sum / ts->ts_nrtt_samples : 0, ts->ts_nretransmits);
+    fib->fib_Comment[0]   = strlen(fib->fib_Comment + 1);
+}
+
+
 /*
  * do_examine_object - handle ACTION_EXAMINE_OBJECT packets
  */
 void do_examine_object(struct DosPacket *inpkt)
 {
     FileTransfer            *ftx;
+    LinkedLock              *llock;
     struct FileLock         *flock;
     struct FileInfoBlock    *fib;
 
     flock = BCPL_TO_C_PTR(inpkt->dp_Arg1);
-    LOG("DEBUG: lock = 0x%08lx\n", (ULONG) flock);
-    if (!find_lock_in_list(flock)) {
-        LOG("ERROR: unknown lock\n");
+    LOG_DEBUG("lock = 0x%08lx\n", (ULONG) flock);
+    if ((llock = find_lock(flock)) == NULL) {
+        LOG_ERROR("unknown lock\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_INVALID_LOCK);
         return;
     }
@@ -253,38 +969,30 @@ void do_examine_object(struct DosPacket *inpkt)
             * the values for the root directory, *not* for the first entry in the 
             * list of g_transfers (this happens in the first ACTION_EXAMINE_NEXT packet) */
         if (!IsListEmpty(&g_transfers)) {
-            LOG("DEBUG: entries to examine\n");
+            LOG_DEBUG("entries to examine\n");
             fib->fib_DiskKey      = (LONG) g_transfers.lh_Head;
+            set_scan_pos(llock, g_transfers.lh_Head);
             fib->fib_DirEntryType = ST_ROOT;
             fib->fib_EntryType    = ST_ROOT;
             fib->fib_Protection   = FIBF_READ | FIBF_WRITE | FIBF_EXECUTE;
             fib->fib_Size         = 0;
+            fib->fib_NumBlocks    = 0;
             fib->fib_FileName[0]  = 0;    /* BCPL string => first byte contains length */
             fib->fib_Comment[0]   = 0;    /* BCPL string => first byte contains length */
             return_dos_packet(inpkt, DOSTRUE, 0);
         }
         else {
-            LOG("DEBUG: no entries to examine\n");
+            LOG_DEBUG("no entries to examine\n");
+            set_scan_pos(llock, NULL);
             return_dos_packet(inpkt, DOSFALSE, ERROR_NO_MORE_ENTRIES);
         }
     }
     else {
         /* lock refers to a single file => fill FileInfoBlock structure with 
-            * the values from the entry in the list of g_transfers for this file, protection
-            * bits contain the state and the size contains the error code */
+            * the values from the entry in the list of g_transfers for this file */
         ftx = (FileTransfer *) flock->fl_Key;
         fib->fib_DiskKey      = (LONG) ftx;
-        fib->fib_Protection   = ftx->ftx_state;
-        fib->fib_Size         = ftx->ftx_error;
-        /* fib_FileName is a BCPL string => first byte contains length, but for some
-            * reason it has to be null-terminated as well, => maximum length is MAX_FILENAME_LEN - 2,
-            * and we can copy MAX_FILENAME_LEN - 2 characters at most */
-        /* TODO: For some reason, the last character of the file name gets lost on its way
-         *       to the application calling Examine() or ExNext() */
-        fib->fib_FileName[0]  = strlen(ftx->ftx_fname) % MAX_FILENAME_LEN - 1;
-        strncpy(fib->fib_FileName + 1, ftx->ftx_fname, MAX_FILENAME_LEN - 2);
-        fib->fib_FileName[MAX_FILENAME_LEN - 1] = 0;
-        /* TODO: initialize fib_Date */
+        fill_fib(fib, ftx);
         return_dos_packet(inpkt, DOSTRUE, 0);
     }
 }
@@ -296,25 +1004,25 @@ void do_examine_object(struct DosPacket *inpkt)
 void do_examine_next(struct DosPacket *inpkt)
 {
     FileTransfer            *ftx;
+    LinkedLock              *llock;
     struct FileLock         *flock;
     struct FileInfoBlock    *fib;
 
     flock = BCPL_TO_C_PTR(inpkt->dp_Arg1);
-    LOG("DEBUG: lock = 0x%08lx\n", (ULONG) flock);
-    if (!find_lock_in_list(flock)) {
-        LOG("ERROR: unknown lock\n");
+    LOG_DEBUG("lock = 0x%08lx\n", (ULONG) flock);
+    if ((llock = find_lock(flock)) == NULL) {
+        LOG_ERROR("unknown lock\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_INVALID_LOCK);
         return;
     }
     if (flock->fl_Key != 0) {
-        LOG("ERROR: lock does not refer to root directory\n");
+        LOG_ERROR("lock does not refer to root directory\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_INVALID_LOCK);
         return;
     }
 
     /* fill FileInfoBlock structure with the values from the next entry 
-        * in the list of g_transfers and return it, protection bits contain the 
-        * state and the size contains the error code. We assume here that the
+        * in the list of g_transfers and return it. We assume here that the
         * FileInfoBlock passed is the same as in ACTION_EXAMINE_OBJECT. */
     fib = (struct FileInfoBlock *) BCPL_TO_C_PTR(inpkt->dp_Arg2);
     ftx = (FileTransfer *) fib->fib_DiskKey;
@@ -324,156 +1032,355 @@ void do_examine_next(struct DosPacket *inpkt)
         * list structure. I don't understand why, but this is also what
         * Matt Dillon checks for in his code, so it can't be that wrong... */
     if (ftx != (FileTransfer *) &g_transfers.lh_Tail) {
-        LOG("DEBUG: still entries to examine\n");
+        LOG_DEBUG("still entries to examine\n");
         fib->fib_DiskKey      = (LONG) ftx->ftx_node.ln_Succ;
-        fib->fib_Protection   = ftx->ftx_state;
-        fib->fib_Size         = ftx->ftx_error;
-        fib->fib_FileName[0]  = strlen(ftx->ftx_fname) % MAX_FILENAME_LEN - 1;
-        strncpy(fib->fib_FileName + 1, ftx->ftx_fname, MAX_FILENAME_LEN - 2);
-        fib->fib_FileName[MAX_FILENAME_LEN - 1] = 0;
-        /* TODO: initialize fib_Date */
+        set_scan_pos(llock, ftx->ftx_node.ln_Succ);
+        fill_fib(fib, ftx);
         return_dos_packet(inpkt, DOSTRUE, 0);
     }
     else {
-        LOG("DEBUG: no more entries to examine\n");
+        LOG_DEBUG("no more entries to examine\n");
         return_dos_packet(inpkt, DOSFALSE, ERROR_NO_MORE_ENTRIES);
     }
 }
 
 
 /*
- * do_write_return - handle (internal) ACTION_WRITE_RETURN packets
+ * do_get_stats - handle ACTION_GET_STATS packets (see stats.h)
  */
-void do_write_return(struct DosPacket *inpkt, struct DosPacket *iopkt, struct StandardPacket *outpkt)
+void do_get_stats(struct DosPacket *inpkt)
 {
     FileTransfer            *ftx;
-    BYTE                     status;
+    struct FileLock         *flock;
+    const void              *stats;
+    ULONG                    size;
 
-    ftx = (FileTransfer *) inpkt->dp_Arg1;
-        
-    /* get status of write command */
-    /* There is a race condition here: As the timer is still running when we
-     * receive the IO completion message, it could expire before we can stop it */
-    netio_stop_timer();
-    status = netio_get_status();
-    if (status == -1) {
-        LOG("CRITICAL: IO operation has not been completed although IO completion message was received\n");
-        g_busy = 0;
-        g_running = 0;
+    flock = BCPL_TO_C_PTR(inpkt->dp_Arg1);
+    if (flock == NULL) {
+        stats = &g_linkstats;
+        size  = sizeof(LinkStats);
     }
-    else if (status > 0) {
-        LOG("ERROR: sending write request / data to server failed with error %ld\n", status);
-        ftx->ftx_state = S_ERROR;
-        ftx->ftx_error = status;
-        g_busy = 0;
-        send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
+    else if (!find_lock(flock)) {
+        LOG_ERROR("unknown lock\n");
+        return_dos_packet(inpkt, DOSFALSE, ERROR_INVALID_LOCK);
+        return;
     }
+    else if (flock->fl_Key == 0) {
+        qstats.qs_nretained     = nkept_finished + nkept_failed;
+        qstats.qs_nbytes_queued = g_nbytes_queued;
+        stats = &qstats;
+        size  = sizeof(QueueStats);
+    }
+    else {
+        ftx   = (FileTransfer *) flock->fl_Key;
+        ftx->ftx_stats.ts_nbytes_queued = ftx->ftx_nbytes_queued;
+        stats = &ftx->ftx_stats;
+        size  = sizeof(TransferStats);
+    }
+    if ((ULONG) inpkt->dp_Arg3 < size)
+        size = inpkt->dp_Arg3;
+    CopyMem((APTR) stats, (APTR) inpkt->dp_Arg2, size);
+    return_dos_packet(inpkt, DOSTRUE, size);
+}
 
-    /* read answer from server */
-    /* TODO: answer seems to get lost sometimes */
-    LOG("DEBUG: reading answer from server\n");
-    iopkt->dp_Type = ACTION_READ_RETURN;
-    if (recv_tftp_packet() == DOSFALSE) {
-        LOG("ERROR: reading answer from server failed with error %ld\n", g_netio_errno);
-        ftx->ftx_state = S_ERROR;
-        ftx->ftx_error = g_netio_errno;
-        g_busy = 0;
-        send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
+
+/*
+ * get the next block to be sent at the send position of a file transfer (without moving
+ * the send position) - returns DOSFALSE if all blocks have been sent
+ * If the last block of the file is a full one, it is followed by an empty block, otherwise
+ * the server wouldn't know that the file is complete. As long as the client is still
+ * writing the file, a short block at the end of the data is held back because the client
+ * might add more data.
+ */
+static LONG peek_next_block(FileTransfer *ftx, DataBlock *blk)
+{
+    FileBuffer *fbuf = ftx->ftx_sendbuf;
+    UBYTE      *pos = ftx->ftx_sendpos, *end;
+    LONG        n;
+
+    if (fbuf == NULL) {
+        fbuf = (FileBuffer *) ftx->ftx_buffers.lh_Head;
+        pos  = IsListEmpty(&ftx->ftx_buffers) ? NULL : fbuf->fb_curpos;
+    }
+    blk->blk_nsegs  = 0;
+    blk->blk_nbytes = 0;
+    while ((fbuf != (FileBuffer *) &ftx->ftx_buffers.lh_Tail) && (blk->blk_nbytes < ftx->ftx_blksize)) {
+        end = ((UBYTE *) fbuf->fb_curpos) + fbuf->fb_nbytes_to_send;
+        if (pos < end) {
+            if (blk->blk_nsegs == MAX_BLOCK_SEGS)
+                break;
+            n = end - pos;
+            if (n > ftx->ftx_blksize - blk->blk_nbytes)
+                n = ftx->ftx_blksize - blk->blk_nbytes;
+            blk->blk_segs[blk->blk_nsegs].b_addr = pos;
+            blk->blk_segs[blk->blk_nsegs].b_size = n;
+            ++blk->blk_nsegs;
+            blk->blk_nbytes += n;
+            pos             += n;
+        }
+        if (pos >= end) {
+            /* chunk has been sent completely => continue with the next one, but stay at
+             * the end of the last one because the client may still append data to it */
+            if (fbuf->fb_node.ln_Succ == (struct Node *) &ftx->ftx_buffers.lh_Tail)
+                break;
+            fbuf = (FileBuffer *) fbuf->fb_node.ln_Succ;
+            pos  = fbuf->fb_curpos;
+        }
+    }
+    blk->blk_nextbuf = IsListEmpty(&ftx->ftx_buffers) ? NULL : fbuf;
+    blk->blk_nextpos = pos;
+
+    if (blk->blk_nbytes == ftx->ftx_blksize)
+        return DOSTRUE;
+    if (!ftx->ftx_closed)
+        return DOSFALSE;
+    /* file is complete => send short block or empty block (if the last one was full) */
+    if ((blk->blk_nbytes > 0) || (BLKLEN(ftx, ftx->ftx_blknum) == ftx->ftx_blksize))
+        return DOSTRUE;
+    return DOSFALSE;
+}
+
+
+/*
+ * mark the blocks up to blknum as acknowledged and free the buffers that have been
+ * transfered completely, writes that have been held back can continue then
+ */
+static void ack_blocks(FileTransfer *ftx, ULONG nblocks)
+{
+    FileBuffer *fbuf;
+    LONG        nbytes, n;
+
+    while (nblocks-- > 0) {
+        ++ftx->ftx_lastack;
+        nbytes = BLKLEN(ftx, ftx->ftx_lastack);
+        ftx->ftx_stats.ts_nbytes_acked += nbytes;
+        while ((nbytes > 0) && !IsListEmpty(&ftx->ftx_buffers)) {
+            fbuf = (FileBuffer *) ftx->ftx_buffers.lh_Head;
+            n = (nbytes < fbuf->fb_nbytes_to_send) ? nbytes : fbuf->fb_nbytes_to_send;
+            fbuf->fb_curpos          = ((UBYTE *) fbuf->fb_curpos) + n;
+            fbuf->fb_nbytes_to_send -= n;
+            ftx->ftx_nbytes_queued  -= n;
+            g_nbytes_queued         -= n;
+            nbytes                  -= n;
+            if (fbuf->fb_nbytes_to_send == 0) {
+                LOG_DEBUG("buffer has been completely transfered\n");
+                Remove((struct Node *) fbuf);
+                if (fbuf == ftx->ftx_sendbuf)
+                    ftx->ftx_sendbuf = NULL;
+                free_chunk(ftx, fbuf, 0, 0);
+            }
+        }
+    }
+    release_held_writes();
+}
+
+
+/*
+ * send_blocks - hand the blocks that are ready over to the network task, as long as
+ * there are less than ftx_windowsize blocks that have not yet been acknowledged
+ */
+static void send_blocks(FileTransfer *ftx)
+{
+    NetMsg                  *nm;
+    DataBlock                blk;
+
+    while ((ftx->ftx_blknum - ftx->ftx_lastack < ftx->ftx_windowsize) && (peek_next_block(ftx, &blk) == DOSTRUE)) {
+        ++ftx->ftx_blknum;
+        BLKLEN(ftx, ftx->ftx_blknum) = blk.blk_nbytes;
+        ftx->ftx_sendbuf = blk.blk_nextbuf;
+        ftx->ftx_sendpos = blk.blk_nextpos;
+        nm = (NetMsg *) RemHead(&freemsgs);
+        nm->nm_blknum = ftx->ftx_blknum;
+        nm->nm_blk    = blk;
+        LOG_DEBUG("handing block #%ld over to the network task\n", ftx->ftx_blknum);
+        send_net_msg(nm, ftx);
     }
+    if (ftx->ftx_blknum == ftx->ftx_lastack) {
+        /* everything has been acknowledged, but the client has not yet written enough
+         * data for the next block => wait for the next ACTION_WRITE / ACTION_END */
+        LOG_DEBUG("waiting for more data from the client\n");
+        ftx->ftx_state = S_WAITING;
+    }
+    else
+        ftx->ftx_state = S_DATA_SENT;
 }
 
 
 /*
- * do_read_return - handle (internal) ACTION_READ_RETURN packets
+ * do_wrq_return - handle ACTION_NET_WRQ messages returned by the network task
  */
-void do_read_return(struct DosPacket *inpkt, struct StandardPacket *outpkt, Buffer *tftppkt)
+void do_wrq_return(struct DosPacket *inpkt)
 {
     FileTransfer            *ftx;
-    FileBuffer              *fbuf;
-    BYTE                     status;
+    NetMsg                  *nm;
 
     ftx = (FileTransfer *) inpkt->dp_Arg1;
-    fbuf = (FileBuffer *) ftx->ftx_buffers.lh_Head;
-
-    /* get status of read command */
-    /* There is a race condition here: As the timer is still running when we
-     * receive the IO completion message, it could expire before we can stop it */
-    netio_stop_timer();
-    status = netio_get_status();
-    if (status == -1) {
-        LOG("CRITICAL: IO operation has not been completed although IO completion message was received\n");
-        g_busy = 0;
-        g_running = 0;
+    nm  = (NetMsg *) inpkt->dp_Link;
+    --ftx->ftx_nnetmsgs;
+    /* transfer has been aborted => wait for ACTION_NET_ABORT */
+    if (ftx->ftx_state == S_ERROR)
+        return;
+    if (inpkt->dp_Res1 == DOSFALSE) {
+        LOG_ERROR("write request for file '%s' has failed - terminating\n", ftx->ftx_fname);
+        fail_transfer(ftx, inpkt->dp_Res2);
+        return;
     }
-    else if (status > 0) {
-        LOG("ERROR: reading answer from server failed with error %ld\n", status);
-        ftx->ftx_state = S_ERROR;
-        ftx->ftx_error = status;
-        g_busy = 0;
-        send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
+
+    LOG_DEBUG("using block size %ld, window size %ld for file '%s'\n", nm->nm_blksize, nm->nm_windowsize, ftx->ftx_fname);
+    ftx->ftx_blksize    = nm->nm_blksize;
+    ftx->ftx_windowsize = nm->nm_windowsize;
+    /* the write request counts as a full block 0, so that data blocks follow it */
+    BLKLEN(ftx, 0)      = ftx->ftx_blksize;
+    post_event(EV_WRQ_ACCEPTED, ftx);
+}
+
+
+/*
+ * do_data_return - handle ACTION_NET_DATA messages returned by the network task
+ * The blocks are returned in the order of their numbers once they have been acknowledged
+ * by the server. If the transfer fails, all blocks are returned with the error code.
+ */
+void do_data_return(struct DosPacket *inpkt)
+{
+    FileTransfer            *ftx;
+
+    ftx = (FileTransfer *) inpkt->dp_Arg1;
+    --ftx->ftx_nnetmsgs;
+    AddTail(&freemsgs, (struct Node *) inpkt->dp_Link);
+    /* transfer has already been terminated, the other blocks are just collected */
+    if (ftx->ftx_state == S_ERROR)
+        return;
+    if (inpkt->dp_Res1 == DOSFALSE) {
+        LOG_ERROR("transfer of file '%s' has failed - terminating\n", ftx->ftx_fname);
+        fail_transfer(ftx, inpkt->dp_Res2);
+        return;
     }
 
-    /* extract TFTP packet from received data */
-    if (extract_tftp_packet(tftppkt) == DOSFALSE) {
-        LOG("ERROR: reading answer from server failed with error %ld\n", g_netio_errno);
-        ftx->ftx_state = S_ERROR;
-        ftx->ftx_error = g_netio_errno;
+    LOG_DEBUG("block #%ld has been acknowledged\n", ftx->ftx_lastack + 1);
+    /* releasing held writes may fail, the event is then ignored in S_ERROR */
+    ack_blocks(ftx, 1);
+    post_event(EV_BLOCK_ACKED, ftx);
+}
+
+
+/*
+ * do_abort_return - handle the ACTION_NET_ABORT message returned by the network task
+ * The network task doesn't use the data of the transfer anymore.
+ */
+void do_abort_return(struct DosPacket *inpkt)
+{
+    FileTransfer            *ftx;
+
+    ftx = (FileTransfer *) inpkt->dp_Arg1;
+    --ftx->ftx_nnetmsgs;
+    g_busy = 0;
+    post_event(EV_FAILED, ftx);
+}
+
+
+/*
+ * transition functions, called by dispatch_events() for an event of a file transfer
+ * depending on the state of the transfer
+ */
+typedef void (*TransitionFunc)(FileTransfer *ftx);
+
+
+/* S_QUEUED: first data written or empty file closed */
+static void make_ready(FileTransfer *ftx)
+{
+    LOG_INFO("file '%s' is now ready for transfer\n", ftx->ftx_fname);
+    make_transfer_ready(ftx);
+    post_event(EV_SEND_NEXT_FILE, NULL);
+}
+
+
+/* S_DATA_SENT / S_WAITING: block acknowledged => finish or send the next block(s) */
+static void continue_transfer(FileTransfer *ftx)
+{
+    if (ftx->ftx_closed && IsListEmpty(&ftx->ftx_buffers) && (BLKLEN(ftx, ftx->ftx_lastack) < ftx->ftx_blksize)) {
+        LOG_INFO("file has been completely transfered\n");
+        ftx->ftx_state = S_FINISHED;
         g_busy = 0;
-        send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
-    }
-
-#if DEBUG
-    LOG("DEBUG: dump of received packet (%ld bytes):\n", tftppkt->b_size);
-    dump_buffer(tftppkt);
-#endif
-    switch (get_opcode(tftppkt)) {
-        case OP_ACK:
-            if (ftx->ftx_state == S_WRQ_SENT) {
-                LOG("DEBUG: ACK received for sent write request\n");
-                send_internal_packet(outpkt, ACTION_SEND_NEXT_BUFFER, ftx);
-            }
-            else if (ftx->ftx_state == S_DATA_SENT) {
-                if (get_blknum(tftppkt) == ftx->ftx_blknum) {
-                    LOG("DEBUG: ACK received for sent data packet\n");
-                    fbuf->fb_nbytes_to_send -= TFTP_MAX_DATA_SIZE;
-                    if (fbuf->fb_nbytes_to_send > 0) {
-                        send_internal_packet(outpkt, ACTION_CONTINUE_BUFFER, ftx);
-                        LOG("DEBUG: sending next data packet to server\n");
-                    }
-                    else {
-                        LOG("DEBUG: buffer has been completely transfered\n");
-                        send_internal_packet(outpkt, ACTION_BUFFER_FINISHED, ftx);
-                    }
-                }
-                else {
-                    LOG("ERROR: ACK with unexpected block number %ld received - terminating\n", (ULONG) get_blknum(tftppkt));
-                    ftx->ftx_state = S_ERROR;
-                    ftx->ftx_error = ERROR_TFTP_WRONG_BLOCK_NUM;
-                    g_busy = 0;
-                    send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
-                }
-            }
-            else {
-                LOG("CRITICAL: file transfer is in wrong state %ld\n", ftx->ftx_state);
-                g_busy = 0;
-                g_running = 0;
-            }
-            break;
+        post_event(EV_FINISHED, ftx);
+        return;
+    }
+    send_blocks(ftx);
+}
 
-        case OP_ERROR:
-            LOG("ERROR: OP_ERROR received from server\n");
-            ftx->ftx_state = S_ERROR;
-            /* TODO: map TFTP error codes to AmigaDOS or custom error codes */
-            ftx->ftx_error = ERROR_TFTP_GENERIC_ERROR;
-            g_busy = 0;
-            send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
-            break;
 
-        default:
-            LOG("ERROR: unknown opcode received from server\n");
-            ftx->ftx_state = S_ERROR;
-            ftx->ftx_error = ERROR_TFTP_UNKNOWN_OPCODE;
-            g_busy = 0;
-            send_internal_packet(outpkt, ACTION_FILE_FAILED, ftx);
-    } /* end opcode switch */
+/* S_FINISHED / S_ERROR: free the data and start the next transfer */
+static void end_transfer(FileTransfer *ftx)
+{
+    const TransferStats *ts = &ftx->ftx_stats;
+    ULONG                ticks;
+
+    /* list of buffers is empty in case of a finished file (buffers have already been
+     * freed one by one), so only a failed transfer frees memory here which may let
+     * other clients continue */
+    free_transfer_data(ftx);
+    if (ts->ts_started.ds_Days) {
+        ticks = DS_TICKS(&ts->ts_finished) - DS_TICKS(&ts->ts_started);
+        LOG_INFO("file '%s': %ld bytes in %ld.%02ld s (%ld bytes/s), %ld retransmissions, %ld timeouts\n",
+                 ftx->ftx_fname, ts->ts_nbytes_acked, ticks / TICKS_PER_SECOND,
+                 ticks % TICKS_PER_SECOND * 100 / TICKS_PER_SECOND, BYTES_PER_SEC(ts->ts_nbytes_acked, ticks),
+                 ts->ts_nretransmits, ts->ts_ntimeouts);
+    }
+    release_held_writes();
+    post_event(EV_SEND_NEXT_FILE, NULL);
+}
+
+
+/* S_ERROR: file closed by the client => the transfer is complete if it has already ended */
+static void close_error(FileTransfer *ftx)
+{
+    if (ftx->ftx_stats.ts_finished.ds_Days)
+        retire_transfer(ftx);
+}
+
+
+static void start_next_transfer()
+{
+    FileTransfer *ftx;
+
+    if (!g_busy && (ftx = get_next_file_from_queue())) {
+        g_busy = 1;
+        send_write_request(ftx);
+    }
+}
+
+
+/* NULL = event is ignored in this state */
+static const TransitionFunc transitions[NUM_STATES][NUM_EVENTS] = {
+    /*                EV_SEND_NEXT_FILE EV_DATA_QUEUED EV_CLOSED    EV_WRQ_ACCEPTED EV_BLOCK_ACKED     EV_FINISHED   EV_FAILED */
+    /* S_QUEUED    */ {NULL,            make_ready,    make_ready,  NULL,           NULL,              NULL,         NULL},
+    /* S_READY     */ {NULL,            NULL,          NULL,        NULL,           NULL,              NULL,         NULL},
+    /* S_WRQ_SENT  */ {NULL,            NULL,          NULL,        send_blocks,    NULL,              NULL,         NULL},
+    /* S_RRQ_SENT  */ {NULL,            NULL,          NULL,        NULL,           NULL,              NULL,         NULL},
+    /* S_DATA_SENT */ {NULL,            send_blocks,   send_blocks, NULL,           continue_transfer, NULL,         NULL},
+    /* S_ERROR     */ {NULL,            NULL,          close_error, NULL,           NULL,              NULL,         end_transfer},
+    /* S_FINISHED  */ {NULL,            NULL,          NULL,        NULL,           NULL,              end_transfer, NULL},
+    /* S_WAITING   */ {NULL,            send_blocks,   send_blocks, NULL,           continue_transfer, NULL,         NULL}
+};
+
+
+/*
+ * dispatch_events - handle all pending internal events, including the ones posted
+ * while doing so (called before the handler waits for the next message)
+ */
+void dispatch_events()
+{
+    Event          ev;
+    TransitionFunc func;
+
+    while (evhead != evtail) {
+        ev = events[evhead++ % EVENT_QUEUE_SIZE];
+        if (ev.ev_type == EV_SEND_NEXT_FILE) {
+            sendnext_posted = 0;
+            start_next_transfer();
+        }
+        else if ((func = transitions[ev.ev_ftx->ftx_state][ev.ev_type]))
+            func(ev.ev_ftx);
+    }
+    /* only now no event refers to a transfer anymore */
+    reclaim_transfers();
 }
@@ -1,114 +1,228 @@
-#ifndef CWNET_DOS_H
-#define CWNET_DOS_H
-/*
- * dos.h - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
- *         over a serial link (using SLIP)
- *
- * Copyright(C) 2017, 2018 Constantin Wiemer
- */
-
-
-/*
- * included files
- */
-#include <dos/dos.h>
-#include <dos/dosextens.h>
-#include <exec/lists.h>
-#include <exec/types.h>
-#include <proto/exec.h>
-#include <proto/dos.h>
-
-#include "util.h"
-#include "netio.h"
-
-
-/*
- * constants
- */
-#define MAX_PATH_LEN 256        /* for all file names */
-#define MAX_FILENAME_LEN 108    /* for file names in the FileInfoBlock structure */
-
-
-/*
- * custom DOS error codes
- */
-#define ERROR_TFTP_GENERIC_ERROR    1000
-#define ERROR_TFTP_UNKNOWN_OPCODE   1001
-#define ERROR_TFTP_WRONG_BLOCK_NUM  1002
-#define ERROR_IO_NOT_FINISHED       1003
-#define ERROR_IO_TIMEOUT            1004
-
-
-/*
- * internal actions
- */
-#define ACTION_SEND_NEXT_FILE       5000
-#define ACTION_SEND_NEXT_BUFFER     5001
-#define ACTION_CONTINUE_BUFFER      5002
-#define ACTION_FILE_FINISHED        5003
-#define ACTION_FILE_FAILED          5004
-#define ACTION_BUFFER_FINISHED      5005
-#define ACTION_TIMER_EXPIRED        5006
-
-
-/*
- * structures holding all the information of an ongoing file transfer
- */
-typedef struct
-{
-    struct Node fb_node;    /* so that these structures can be put into a list */
-    APTR        fb_bytes;
-    APTR        fb_curpos;
-    LONG        fb_nbytes_to_send;
-} FileBuffer;
-typedef struct 
-{
-    struct Node ftx_node;   /* so that these structures can be put into a list */
-    char        ftx_fname[MAX_PATH_LEN];
-    ULONG       ftx_state;
-    ULONG       ftx_blknum;
-    ULONG       ftx_error;
-    struct List ftx_buffers;
-} FileTransfer;
-
-
-/*
- * file lock that can be put into a list
- * The FileLock structure already contains a field fl_Link that we could use for chaining
- * locks together, but the advantage of the structure below is that we can use the
- * standard list management functions like AddTail(), RemHead(), FindName() and so on.
- */
-typedef struct
-{
-    struct Node     ll_node;
-    UWORD           ll_dummy;   /* to keep the FileLock structure longword-aligned */
-    struct FileLock ll_flock;
-} LinkedLock;
-
-
-/*
- * function prototypes
- */
-void send_internal_packet(struct StandardPacket *pkt, LONG type, APTR arg);
-void return_dos_packet(struct DosPacket *pkt, LONG res1, LONG res2);
-FileTransfer *get_next_file_from_queue();
-LinkedLock *find_lock_in_list(const struct FileLock *flock);
-void do_find_output(struct DosPacket *inpkt);
-void do_write(struct DosPacket *inpkt, struct StandardPacket *outpkt);
-void do_locate_object(struct DosPacket *inpkt);
-void do_examine_object(struct DosPacket *inpkt);
-void do_examine_next(struct DosPacket *inpkt);
-void do_write_return(struct DosPacket *inpkt, struct DosPacket *iopkt, struct StandardPacket *outpkt);
-void do_read_return(struct DosPacket *inpkt, struct StandardPacket *outpkt, Buffer *tftppkt);
-
-
-/*
- * external references
- */
-extern struct MsgPort      *g_port;
-extern struct DeviceNode   *g_dnode;
-extern struct List          g_transfers;
-extern struct List          g_locks;
-extern UBYTE                g_running, g_busy;
-
-#endif /* CWNET_DOS_H */
+#ifndef CWNET_DOS_H
+#define CWNET_DOS_H
+/*
+ * dos.h - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *         over a serial link (using SLIP)
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#include <dos/dos.h>
+#include <dos/dosextens.h>
+#include <exec/lists.h>
+#include <exec/types.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <stddef.h>
+
+#include "util.h"
+#include "netio.h"
+#include "stats.h"
+
+
+/*
+ * constants
+ */
+#define MAX_PATH_LEN 256        /* for all file names */
+#define MAX_FILENAME_LEN 108    /* for file names in the FileInfoBlock structure */
+#define MAX_WINDOW_SIZE 16      /* maximum number of unacknowledged TFTP blocks (RFC 7440) */
+#define DEFAULT_MAX_QUEUED_BYTES   (256 * 1024)   /* default for g_max_queued_bytes */
+#define DEFAULT_MAX_TRANSFER_BYTES (64 * 1024)    /* default for g_max_transfer_bytes */
+#define DEFAULT_ZERO_COPY 0                       /* default for g_zero_copy */
+#define DEFAULT_KEEP_FINISHED      32             /* defaults for the number of completed ... */
+#define DEFAULT_KEEP_FAILED        128            /* ... transfers kept in the queue and ... */
+#define DEFAULT_KEEP_FINISHED_MINS 60             /* ... for how many minutes (0 = no limit) */
+#define DEFAULT_KEEP_FAILED_MINS   (24 * 60)
+#define CHUNK_SIZE 8192         /* minimum size of the chunks the file data is stored in */
+#define MAX_BLOCK_SEGS 2        /* a block spans at most 2 chunks (chunks are at least as large as a block) */
+#define MAX_ZC_WRITES 4         /* maximum number of client buffers in use per transfer (zero-copy mode) */
+#define FTX_POOL_SIZE   16      /* number of preallocated objects in the pools (more are */
+#define FBUF_POOL_SIZE  64      /* allocated individually if needed) */
+#define CHUNK_POOL_SIZE 8
+#define LOCK_POOL_SIZE  16
+#define NAME_HASH_SIZE  64      /* number of buckets in the index of the file names (power of 2) */
+#define MAX_LOCKS       256     /* maximum number of locks that can be open at the same time */
+#define EVENT_QUEUE_SIZE 32     /* size of the queue of internal events (at most 4 are pending, see post_event()) */
+
+
+/*
+ * custom DOS error codes
+ */
+#define ERROR_TFTP_GENERIC_ERROR    1000
+#define ERROR_TFTP_UNKNOWN_OPCODE   1001
+#define ERROR_TFTP_WRONG_BLOCK_NUM  1002
+#define ERROR_IO_NOT_FINISHED       1003
+#define ERROR_IO_TIMEOUT            1004
+#define ERROR_MALFORMED_PACKET      1005
+#define ERROR_TFTP_OPTION_NEGOTIATION 1006
+
+
+/*
+ * internal actions
+ */
+#define ACTION_TIMER_EXPIRED        5006
+#define ACTION_NET_WRQ              5007    /* messages exchanged with the network task */
+#define ACTION_NET_DATA             5008
+#define ACTION_NET_ABORT            5009
+
+
+/*
+ * internal events (see post_event() / dispatch_events())
+ * Except for EV_SEND_NEXT_FILE, an event belongs to a file transfer and is handled by
+ * the transition function for the state the transfer is in when the event is dispatched.
+ */
+#define EV_SEND_NEXT_FILE   0   /* start the next transfer that is ready (no transfer) */
+#define EV_DATA_QUEUED      1   /* client has written data */
+#define EV_CLOSED           2   /* client has closed the file */
+#define EV_WRQ_ACCEPTED     3   /* server has accepted the write request */
+#define EV_BLOCK_ACKED      4   /* server has acknowledged a block */
+#define EV_FINISHED         5   /* all data has been acknowledged */
+#define EV_FAILED           6   /* transfer has failed, the network task doesn't use its data anymore */
+#define NUM_EVENTS          7
+#define NUM_STATES          8   /* S_QUEUED ... S_WAITING */
+
+
+/*
+ * structures holding all the information of an ongoing file transfer
+ * The data written by the client is stored in chunks of fixed size, independent of how
+ * large the individual writes are. So the blocks sent to the server are always full
+ * blocks (except the last one), but a block may span two chunks.
+ * Up to ftx_windowsize blocks are handed over to the network task at a time. The task
+ * sends (and resends) the blocks directly from the chunks, so a chunk is only freed once
+ * all its bytes have been acknowledged.
+ * In zero-copy mode, large writes are not copied. Instead, the client's buffer is used as
+ * a chunk and the packet is only returned once all its bytes have been acknowledged.
+ * Such a chunk always starts at a block boundary and holds only full blocks, so that a
+ * block still spans at most two chunks.
+ */
+typedef struct
+{
+    struct Node fb_node;    /* so that these structures can be put into a list */
+    APTR        fb_bytes;
+    ULONG       fb_size;            /* size of the chunk */
+    APTR        fb_curpos;          /* first byte not yet acknowledged by the server */
+    LONG        fb_nbytes_to_send;  /* number of bytes from fb_curpos to the end of the data */
+    struct DosPacket *fb_pkt;       /* packet of the client if fb_bytes is its buffer, NULL otherwise */
+} FileBuffer;
+typedef struct FileTransfer
+{
+    struct Node ftx_node;   /* so that these structures can be put into a list */
+    struct MinNode ftx_qnode;           /* node in the ready queue (S_READY) or in the list of
+                                           completed transfers (S_FINISHED / S_ERROR) */
+    struct FileTransfer *ftx_hashnext;  /* next transfer in the same bucket of the name index */
+    ULONG       ftx_seqnum;     /* transfers are started in the order they have been opened */
+    char        ftx_fname[MAX_PATH_LEN];
+    ULONG       ftx_state;
+    ULONG       ftx_blknum;     /* number of the last block handed over to the network task */
+    ULONG       ftx_lastack;    /* number of the last block acknowledged by the server */
+    ULONG       ftx_blksize;    /* negotiated block size */
+    ULONG       ftx_windowsize; /* negotiated window size */
+    ULONG       ftx_error;
+    BOOL        ftx_closed;     /* ACTION_END has been received, so no more buffers will be added */
+    BOOL        ftx_endheld;    /* ACTION_END has been received while writes were held back, the
+                                   transfer is closed when their data has been queued */
+    BOOL        ftx_retired;    /* transfer has ended and is in the list of completed transfers */
+    ULONG       ftx_nbytes_queued;  /* number of bytes in ftx_buffers not yet acknowledged */
+    struct List ftx_writes;     /* ACTION_WRITE packets held back because too much data is queued */
+    ULONG       ftx_nzcwrites;  /* number of chunks that are client buffers (zero-copy mode) */
+    ULONG       ftx_nnetmsgs;   /* number of messages sent to the network task and not yet returned */
+    ULONG       ftx_nrefs;      /* number of locks and directory scans referring to the transfer */
+    struct List ftx_buffers;
+    FileBuffer *ftx_sendbuf;    /* buffer and position the next block is taken from */
+    APTR        ftx_sendpos;    /* (NULL = start of the first buffer) */
+    UWORD       ftx_blklens[MAX_WINDOW_SIZE + 1];   /* lengths of the blocks in the window */
+    TransferStats ftx_stats;    /* also updated by the network task (see nettask.c) */
+} FileTransfer;
+#define BLKLEN(ftx, blknum) ((ftx)->ftx_blklens[(blknum) % (MAX_WINDOW_SIZE + 1)])
+
+/* data block assembled from the chunks of a file transfer */
+typedef struct
+{
+    Buffer      blk_segs[MAX_BLOCK_SEGS];
+    ULONG       blk_nsegs;
+    LONG        blk_nbytes;
+    FileBuffer *blk_nextbuf;    /* chunk and position following the block */
+    APTR        blk_nextpos;
+} DataBlock;
+
+/*
+ * message exchanged with the network task (see nettask.c)
+ * Like a DOS packet, the message is returned to the handler's port with the result in
+ * dp_Res1 / dp_Res2. dp_Arg1 points to the FileTransfer structure.
+ */
+typedef struct
+{
+    struct StandardPacket nm_sp;
+    ULONG       nm_blknum;      /* ACTION_NET_DATA: number and data of the block */
+    DataBlock   nm_blk;
+    ULONG       nm_blksize;     /* ACTION_NET_WRQ: negotiated block size and window size */
+    ULONG       nm_windowsize;
+} NetMsg;
+
+
+/*
+ * file lock together with its slot in the lock table (see dos.c)
+ * A lock passed in by a client is valid if the slot it claims to occupy points back to
+ * it, so it can be checked without searching.
+ */
+typedef struct
+{
+    ULONG           ll_slot;
+    struct FileLock ll_flock;
+    FileTransfer   *ll_scanpos;     /* root lock: transfer the directory scan continues with */
+} LinkedLock;
+
+
+/*
+ * function prototypes
+ */
+void post_event(UBYTE type, FileTransfer *ftx);
+void dispatch_events();
+void return_dos_packet(struct DosPacket *pkt, LONG res1, LONG res2);
+void send_write_request(FileTransfer *ftx);
+FileTransfer *get_next_file_from_queue();
+void init_indexes();
+LONG create_pools();
+void delete_pools();
+void init_net_msgs();
+void release_held_writes();
+void free_transfer_data(FileTransfer *ftx);
+LinkedLock *find_lock(const struct FileLock *flock);
+void free_lock(LinkedLock *llock);
+void do_find_output(struct DosPacket *inpkt);
+void do_write(struct DosPacket *inpkt);
+void do_end(struct DosPacket *inpkt);
+void do_locate_object(struct DosPacket *inpkt);
+void do_examine_object(struct DosPacket *inpkt);
+void do_examine_next(struct DosPacket *inpkt);
+void do_wrq_return(struct DosPacket *inpkt);
+void do_data_return(struct DosPacket *inpkt);
+void do_abort_return(struct DosPacket *inpkt);
+void do_get_stats(struct DosPacket *inpkt);
+
+
+/*
+ * external references
+ */
+extern struct MsgPort      *g_port;
+extern struct DeviceNode   *g_dnode;
+extern struct List          g_transfers;
+extern UBYTE                g_running, g_busy;
+extern ULONG                g_nbytes_queued;        /* number of bytes queued in all transfers */
+extern ULONG                g_max_queued_bytes;     /* limits for the number of bytes queued ... */
+extern ULONG                g_max_transfer_bytes;   /* ... in all transfers and per transfer */
+extern UBYTE                g_zero_copy;            /* send large writes from the client's buffer */
+extern ULONG                g_keep_finished;        /* retention of completed transfers (see dos.c) */
+extern ULONG                g_keep_failed;
+extern ULONG                g_keep_finished_mins;
+extern ULONG                g_keep_failed_mins;
+extern Pool                 g_ftx_pool;             /* pools for FileTransfer, FileBuffer, ... */
+extern Pool                 g_fbuf_pool;
+extern Pool                 g_chunk_pool;           /* ... the chunks holding the file data ... */
+extern Pool                 g_lock_pool;            /* ... and LinkedLock structures */
+
+#endif /* CWNET_DOS_H */
@@ -22,6 +22,7 @@
 #include "util.h"
 #include "dos.h"
 #include "netio.h"
+#include "config.h"
 
 
 /*
@@ -36,14 +37,27 @@ static const char *dummy = "bla";
 /*
  * global variables
  */
-struct MsgPort      *g_logport;                    /* for the LOG() macro */
-BPTR                 g_logfh;
-char                 g_logmsg[256];
+struct SignalSemaphore g_logsem;                  /* for the LOG_xxx() macros */
+ULONG                g_loglevel = LOG_MIN_LEVEL;
+ULONG                g_log_ndropped = 0;
+ULONG                g_max_buffer_size = DEFAULT_BUFFER_SIZE;  /* SLIP MTU */
 struct MsgPort      *g_port;
 struct DeviceNode   *g_dnode;
 struct List          g_transfers;                  /* list of all file transfers */
-struct List          g_locks;                      /* list of all open locks */
 UBYTE                g_running, g_busy;            /* handler state */
+ULONG                g_nbytes_queued = 0;
+ULONG                g_max_queued_bytes   = DEFAULT_MAX_QUEUED_BYTES;
+ULONG                g_max_transfer_bytes = DEFAULT_MAX_TRANSFER_BYTES;
+UBYTE                g_zero_copy = DEFAULT_ZERO_COPY;
+ULONG                g_keep_finished      = DEFAULT_KEEP_FINISHED;
+ULONG                g_keep_failed        = DEFAULT_KEEP_FAILED;
+ULONG                g_keep_finished_mins = DEFAULT_KEEP_FINISHED_MINS;
+ULONG                g_keep_failed_mins   = DEFAULT_KEEP_FAILED_MINS;
+ULONG                g_ser_unit    = DEFAULT_SER_UNIT;
+ULONG                g_ser_baud    = DEFAULT_SER_BAUD;
+ULONG                g_ser_rbuflen = DEFAULT_SER_RBUFLEN;
+UBYTE                g_ser_flags   = DEFAULT_SER_FLAGS;
+Pool                 g_ftx_pool, g_fbuf_pool, g_chunk_pool, g_lock_pool;
 
 
 /*
@@ -53,13 +67,9 @@ UBYTE                g_running, g_busy;            /* handler state */
 void entry()
 {
     struct Message          *msg;
-    struct DosPacket        *inpkt, iopkt1, iopkt2;
-    struct StandardPacket    outpkt;
+    struct DosPacket        *inpkt;
     LinkedLock              *llock;
     struct FileLock         *flock;
-    FileTransfer            *ftx;
-    FileBuffer              *fbuf;
-    Buffer                  *tftppkt;
 
 
     /* wait for startup packet */
@@ -81,142 +91,144 @@ void entry()
      * before these calls have finished, which would result in undefined behaviour. 
      * However, as we are started when the mount command is issued, this is unlikely.
      */
-    /* initialize logging */
-    if ((g_logport = CreateMsgPort()) == NULL)
-        goto ERROR_NO_PORT;
-//    if ((g_logfh = Open("WORK:cwnet.log", MODE_NEWFILE)) == 0)
-    if ((g_logfh = Open("CON:0/0/800/200/CWNET Console", MODE_NEWFILE)) == 0)
+    /* start the log task (see util.c) */
+//    if (log_start("WORK:cwnet.log") == DOSFALSE)
+    if (log_start("CON:0/0/800/200/CWNET Console") == DOSFALSE)
         goto ERROR_NO_LOGGING;
 
-    /* initialize the network IO module */
-    if (netio_init(&iopkt1, &iopkt2) == DOSFALSE) {
-        LOG("CRITICAL: could not initialize the network IO module\n");
-        goto ERROR_NO_NETIO;
+    /* read the options from the mountlist / config file, they are needed for everything below */
+    if (read_config(g_dnode) == DOSFALSE) {
+        LOG_CRITICAL("could not read the configuration\n");
+        goto ERROR_NO_CONFIG;
     }
 
-    /* allocate a buffer for received TFTP packets */
-    if ((tftppkt = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("CRITICAL: could not allocate memory for TFTP packet\n");
-        goto ERROR_NO_MEMORY;
+    /* preallocate memory for the structures used by the handler */
+    if (create_pools() == DOSFALSE) {
+        LOG_CRITICAL("could not allocate memory for the pools\n");
+        goto ERROR_NO_POOLS;
     }
 
-    /* initialize lists of file transfers and locks */
+    /* start the network task, which initializes the network IO module */
+    if (nettask_start() == DOSFALSE) {
+        LOG_CRITICAL("could not start the network task\n");
+        goto ERROR_NO_NETTASK;
+    }
+
+    /* initialize list of file transfers and the indexes (ready queue, names, locks, completed transfers) */
     NewList(&g_transfers);
-    NewList(&g_locks);
-    LOG("INFO: initialization complete - waiting for requests\n");
+    init_indexes();
+    LOG_INFO("initialization complete - waiting for requests\n");
     
-    /* initialize internal DOS packets */
-    outpkt.sp_Msg.mn_ReplyPort    = g_port;
-    outpkt.sp_Pkt.dp_Port         = g_port;
-    outpkt.sp_Msg.mn_Node.ln_Name = (char *) &(outpkt.sp_Pkt);
-    outpkt.sp_Pkt.dp_Link         = &(outpkt.sp_Msg);
-    iopkt1.dp_Type                = 0;
-    iopkt2.dp_Type                = ACTION_TIMER_EXPIRED;
+    /* initialize messages for the network task */
+    init_net_msgs();
 
 
     /*
      * main message loop
      * We receive and handle 2 types of messages here:
      * - DOS packets coming from the OS
-     * - internal DOS packets sent by ourselves for certain events
+     * - messages returned by the network task (see nettask.c)
      *
-     * We use internal packets instead of a state variable, because otherwise we
-     * could get blocked in WaitPort() forever.
+     * Handling a message may post internal events (see dos.c), which change the state
+     * of a file transfer via the transition table. All pending events are dispatched
+     * before we wait for the next message, so we can't get blocked in WaitPort() while
+     * there is still something to do.
      *
      * state machine of a file transfer:
                                              |---------<--------|  /-- S_FINISHED
      * S_QUEUED --> S_READY --> S_WRQ_SENT --|--> S_DATA_SENT --|--
      *                                                             \-- S_ERROR
+     *
+     * The network task sends the write request (ACTION_NET_WRQ) and the blocks
+     * (ACTION_NET_DATA), handles the answers from the server and retransmits on timeouts.
+     * In S_DATA_SENT, up to ftx_windowsize blocks are handed over to it, and another one
+     * follows whenever a block has been acknowledged. The transfer starts with the first
+     * ACTION_WRITE. If the client writes slower than we can send, the transfer goes to
+     * S_WAITING until the next ACTION_WRITE / ACTION_END arrives.
      */
     g_running = 1;
     g_busy    = 0;
     while(g_running) {
+        dispatch_events();
         WaitPort(g_port);
         msg   = GetMsg(g_port);
         inpkt = (struct DosPacket *) msg->mn_Node.ln_Name;
-        LOG("DEBUG: received DOS packet of type %ld\n", inpkt->dp_Type);
+        LOG_DEBUG("received DOS packet of type %ld\n", inpkt->dp_Type);
 
         switch (inpkt->dp_Type) {
             /*
              * regular actions
              */
             case ACTION_IS_FILESYSTEM:
-                LOG("INFO: packet type = ACTION_IS_FILESYSTEM\n");
+                LOG_INFO("packet type = ACTION_IS_FILESYSTEM\n");
                 return_dos_packet(inpkt, DOSTRUE, 0);
                 break;
 
 
             case ACTION_FINDOUTPUT:
-                LOG("INFO: packet type = ACTION_FINDOUTPUT\n");
+                LOG_INFO("packet type = ACTION_FINDOUTPUT\n");
                 do_find_output(inpkt);
                 break;
 
 
             case ACTION_WRITE:
-                LOG("INFO: packet type = ACTION_WRITE\n");
-                do_write(inpkt, &outpkt);
+                LOG_INFO("packet type = ACTION_WRITE\n");
+                do_write(inpkt);
                 break;
 
 
             case ACTION_END:
-                LOG("INFO: packet type = ACTION_END\n");
-                ftx = (FileTransfer *) inpkt->dp_Arg1;
-                LOG("INFO: file '%s' is now ready for transfer\n", ftx->ftx_fname);
-                return_dos_packet(inpkt, DOSTRUE, 0);
-                
-                /* We only now inform ourselves that a file has been added and is ready 
-                    * for transfer in order to prevent a race condition between buffers being
-                    * added and being sent. Otherwise it could happen that we transfer bufffers
-                    * faster than we receive them and would therefore assume the file has been
-                    * transfered completely somewhere in the middle of the file. */
-                ftx->ftx_state = S_READY;
-                send_internal_packet(&outpkt, ACTION_SEND_NEXT_FILE, NULL);
+                LOG_INFO("packet type = ACTION_END\n");
+                do_end(inpkt);
                 break;
 
 
             case ACTION_LOCATE_OBJECT:
-                LOG("INFO: packet type = ACTION_LOCATE_OBJECT\n");
+                LOG_INFO("packet type = ACTION_LOCATE_OBJECT\n");
                 do_locate_object(inpkt);
                 break;
 
 
             case ACTION_FREE_LOCK:
-                LOG("INFO: packet type = ACTION_FREE_LOCK\n");
+                LOG_INFO("packet type = ACTION_FREE_LOCK\n");
                 flock = BCPL_TO_C_PTR(inpkt->dp_Arg1);
-                LOG("DEBUG: lock = 0x%08lx\n", (ULONG) flock);
+                LOG_DEBUG("lock = 0x%08lx\n", (ULONG) flock);
                 if (flock == NULL)
                     return_dos_packet(inpkt, DOSTRUE, 0);
-                else if ((llock = find_lock_in_list(flock))) {
-                    Remove((struct Node *) llock);
-                    FreeVec(llock);
+                else if ((llock = find_lock(flock))) {
+                    free_lock(llock);
                     return_dos_packet(inpkt, DOSTRUE, 0);
                 }
                 else {
-                    LOG("ERROR: unknown lock\n");
+                    LOG_ERROR("unknown lock\n");
                     return_dos_packet(inpkt, DOSFALSE, ERROR_INVALID_LOCK);
                 }
                 break;
 
 
             case ACTION_EXAMINE_OBJECT:
-                LOG("INFO: packet type = ACTION_EXAMINE_OBJECT\n");
+                LOG_INFO("packet type = ACTION_EXAMINE_OBJECT\n");
                 do_examine_object(inpkt);
                 break;
 
 
             case ACTION_EXAMINE_NEXT:
-                LOG("INFO: packet type = ACTION_EXAMINE_NEXT\n");
+                LOG_INFO("packet type = ACTION_EXAMINE_NEXT\n");
                 do_examine_next(inpkt);
                 break;
 
 
-            case ACTION_DIE:
-                LOG("INFO: packet type = ACTION_DIE\n");
-                LOG("INFO: ACTION_DIE packet received - shutting down\n");
+            case ACTION_GET_STATS:
+                LOG_DEBUG("packet type = ACTION_GET_STATS\n");
+                do_get_stats(inpkt);
+                break;
 
-                /* abort ongoing IO operation */
-                netio_abort();
 
+            case ACTION_DIE:
+                LOG_INFO("packet type = ACTION_DIE\n");
+                LOG_INFO("ACTION_DIE packet received - shutting down\n");
+
+                /* the network task is stopped after the loop */
                 /* tell DOS not to send us any more packets */
                 g_dnode->dn_Task = NULL;
 
@@ -226,146 +238,39 @@ void entry()
 
 
             /*
-             * internal actions
+             * messages returned by the network task
              */
-            case ACTION_SEND_NEXT_FILE:
-                LOG("DEBUG: received internal packet of type ACTION_SEND_NEXT_FILE\n");
-                if (!g_busy) {
-                    if ((ftx = get_next_file_from_queue())) {
-                        g_busy = 1;
-                        /* store pointer to current FileTransfer structure in DOS packet so
-                            * that we can retrieve it in ACTION_WRITE_RETURN below */
-                        iopkt1.dp_Type = ACTION_WRITE_RETURN;
-                        iopkt1.dp_Arg1 = (LONG) ftx;
-                        if (send_tftp_req_packet(OP_WRQ, ftx->ftx_fname) == DOSTRUE) {
-                            LOG("DEBUG: sent write request for file '%s' to server\n", ftx->ftx_fname);
-                            ftx->ftx_state = S_WRQ_SENT;
-                        }
-                        else {
-                            LOG("ERROR: sending write request for file '%s' to server failed\n", ftx->ftx_fname);
-                            ftx->ftx_state = S_ERROR;
-                            ftx->ftx_error = g_netio_errno;
-                            g_busy = 0;
-                            send_internal_packet(&outpkt, ACTION_FILE_FAILED, ftx);
-                        }
-                    }
-                }
-                break;
-
-
-            case ACTION_SEND_NEXT_BUFFER:
-                LOG("DEBUG: received internal packet of type ACTION_SEND_NEXT_BUFFER\n");
-                ftx  = (FileTransfer *) inpkt->dp_Arg1;
-                if (!IsListEmpty(&(ftx->ftx_buffers))) {
-                    fbuf = (FileBuffer *) ftx->ftx_buffers.lh_Head;
-                    ++ftx->ftx_blknum;
-                    iopkt1.dp_Type = ACTION_WRITE_RETURN;
-                    if (send_tftp_data_packet(ftx->ftx_blknum, fbuf->fb_curpos, fbuf->fb_nbytes_to_send) == DOSTRUE) {
-                        LOG("DEBUG: sent data packet #%ld to server\n", ftx->ftx_blknum);
-                        ftx->ftx_state = S_DATA_SENT;
-                    }
-                    else {
-                        LOG("ERROR: sending data packet #%ld to server failed\n", ftx->ftx_blknum);
-                        ftx->ftx_state = S_ERROR;
-                        ftx->ftx_error = g_netio_errno;
-                        g_busy = 0;
-                        send_internal_packet(&outpkt, ACTION_FILE_FAILED, ftx);
-                    }
-                }
-                else {
-                    LOG("INFO: file has been completely transfered\n");
-                    ftx->ftx_state = S_FINISHED;
-                    g_busy = 0;
-                    send_internal_packet(&outpkt, ACTION_FILE_FINISHED, ftx);
-                }
-                break;
-
-
-            case ACTION_CONTINUE_BUFFER:
-                LOG("DEBUG: received internal packet of type ACTION_CONTINUE_BUFFER\n");
-                ftx  = (FileTransfer *) inpkt->dp_Arg1;
-                fbuf = (FileBuffer *) ftx->ftx_buffers.lh_Head;
-                fbuf->fb_curpos = ((UBYTE *) fbuf->fb_curpos) + TFTP_MAX_DATA_SIZE;
-                ++ftx->ftx_blknum;
-                iopkt1.dp_Type = ACTION_WRITE_RETURN;
-                if (send_tftp_data_packet(ftx->ftx_blknum, fbuf->fb_curpos, fbuf->fb_nbytes_to_send) == DOSTRUE) {
-                    LOG("DEBUG: sent data packet #%ld to server\n", ftx->ftx_blknum);
-                    ftx->ftx_state = S_DATA_SENT;
-                }
-                else {
-                    LOG("ERROR: sending data packet #%ld to server failed\n", ftx->ftx_blknum);
-                    ftx->ftx_state = S_ERROR;
-                    ftx->ftx_error = g_netio_errno;
-                    g_busy = 0;
-                    send_internal_packet(&outpkt, ACTION_FILE_FAILED, ftx);
-                }
-                break;
-
-
-            case ACTION_FILE_FINISHED:
-            case ACTION_FILE_FAILED:
-                LOG("DEBUG: received internal packet of type ACTION_FILE_FINISHED / ACTION_FILE_FAILED\n");
-                ftx = (FileTransfer *) inpkt->dp_Arg1;
-                /* list of buffers is empty in case of a finished file (buffers have
-                    * already been freed one by one), so the loop will be skipped */
-                while ((fbuf = (FileBuffer *) RemHead(&(ftx->ftx_buffers)))) {
-                    FreeVec(fbuf->fb_bytes);
-                    FreeVec(fbuf);
-                }
-                send_internal_packet(&outpkt, ACTION_SEND_NEXT_FILE, NULL);
-                break;
-
-
-            case ACTION_BUFFER_FINISHED:
-                LOG("DEBUG: received internal packet of type ACTION_BUFFER_FINISHED\n");
-                ftx  = (FileTransfer *) inpkt->dp_Arg1;
-                fbuf = (FileBuffer *) RemHead(&(ftx->ftx_buffers));
-                FreeVec(fbuf->fb_bytes);
-                FreeVec(fbuf);
-                send_internal_packet(&outpkt, ACTION_SEND_NEXT_BUFFER, ftx);
+            case ACTION_NET_WRQ:
+                LOG_DEBUG("write request returned by the network task\n");
+                do_wrq_return(inpkt);
                 break;
 
 
-            case ACTION_WRITE_RETURN:
-                LOG("DEBUG: received internal packet of type ACTION_WRITE_RETURN (IO completion message)\n");
-                do_write_return(inpkt, &iopkt1, &outpkt);
+            case ACTION_NET_DATA:
+                LOG_DEBUG("block returned by the network task\n");
+                do_data_return(inpkt);
                 break;
 
 
-            case ACTION_READ_RETURN:
-                LOG("DEBUG: received internal packet of type ACTION_READ_RETURN (IO completion message)\n");
-                do_read_return(inpkt, &outpkt, tftppkt);
-                break;
-
-
-            case ACTION_TIMER_EXPIRED:
-                LOG("DEBUG: received internal packet of type ACTION_TIMER_EXPIRED\n");
-                LOG("ERROR: timeout occured during IO operation\n");
-                
-                /* abort current operation (if it's still running) */
-                netio_abort();
-
-                ftx->ftx_state = S_ERROR;
-                ftx->ftx_error = ERROR_IO_TIMEOUT;
-                g_busy = 0;
-                send_internal_packet(&outpkt, ACTION_FILE_FAILED, ftx);
+            case ACTION_NET_ABORT:
+                LOG_DEBUG("network task has aborted the transfer\n");
+                do_abort_return(inpkt);
                 break;
 
 
             default:
-                LOG("ERROR: packet type is unknown\n");
+                LOG_ERROR("packet type is unknown\n");
                 return_dos_packet(inpkt, DOSFALSE, ERROR_ACTION_NOT_KNOWN);
         }   /* end action switch */
     }   /* end while */
 
 
     Delay(150);
-    delete_buffer(tftppkt);
-ERROR_NO_MEMORY:
-    netio_exit();
-ERROR_NO_NETIO:
-    Close(g_logfh);
+    nettask_stop();
+ERROR_NO_NETTASK:
+    delete_pools();
+ERROR_NO_POOLS:
+ERROR_NO_CONFIG:
+    log_stop();
 ERROR_NO_LOGGING:
-    DeleteMsgPort(g_logport);
-ERROR_NO_PORT:
 }
@@ -10,6 +10,7 @@
  * included files
  */
 #include <dos/dos.h>
+#include <dos/rdargs.h>
 #include <exec/memory.h>
 #include <exec/types.h>
 #include <proto/dos.h>
@@ -17,8 +18,23 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "stats.h"
+
 
 # define MAX_PATH_LEN 256
+# define MAX_WATCHED 64                 /* number of transfers tracked in watch mode */
+# define DEFAULT_INTERVAL 2             /* seconds between two updates in watch mode */
+
+/* usage: listq [<file>] [WATCH [INTERVAL=<seconds>]] */
+# define TEMPLATE "FILE,WATCH/S,INTERVAL/K/N"
+# define ARG_FILE     0
+# define ARG_WATCH    1
+# define ARG_INTERVAL 2
+# define NUM_ARGS     3
+
+/* indices into state_tbl of the states in which a transfer should make progress (see netio.h) */
+# define S_WRQ_SENT  2
+# define S_DATA_SENT 4
 
 
 static char *state_tbl[] = 
@@ -30,21 +46,277 @@ static char *state_tbl[] =
     "S_DATA_SENT",
     "S_ERROR",
     "S_FINISHED",
+    "S_WAITING",
 };
 
 
+/* a transfer's progress as of the last update in watch mode, transfers are identified
+ * by their name and the time they were queued (names can be reused) */
+typedef struct {
+    char             s_fname[MAX_PATH_LEN];
+    struct DateStamp s_queued;
+    ULONG            s_nbytes_acked;
+} Sample;
+
+
+/*
+ * query the statistics of a file transfer (flock = lock on the file), of the queue
+ * (flock = lock on the root directory) or of the link (flock = 0) from the handler
+ * owning lock
+ */
+static LONG get_stats(BPTR lock, BPTR flock, APTR stats, ULONG size)
+{
+    return DoPkt(((struct FileLock *) BADDR(lock))->fl_Task, ACTION_GET_STATS, flock, (LONG) stats, size, 0, 0);
+}
+
+
+/*
+ * query the statistics of the file transfer an entry returned by ExNext() refers to (the
+ * statistics can only be queried with a lock on the file), ts is cleared if that fails
+ */
+static void get_entry_stats(BPTR lock, const struct FileInfoBlock *fib, TransferStats *ts)
+{
+    BPTR flock;
+    char path[MAX_PATH_LEN];
+
+    strncpy(path, "net:", MAX_PATH_LEN - 1);
+    strncat(path, fib->fib_FileName, MAX_PATH_LEN - 5);
+    memset(ts, 0, sizeof(TransferStats));
+    if ((flock = Lock(path, ACCESS_READ))) {
+        get_stats(lock, flock, ts, sizeof(TransferStats));
+        UnLock(flock);
+    }
+}
+
+
+static void print_transfer_stats(const TransferStats *ts)
+{
+    struct DateStamp now;
+    ULONG            ticks = 0;
+
+    if (ts->ts_started.ds_Days) {
+        if (ts->ts_finished.ds_Days)
+            now = ts->ts_finished;
+        else
+            DateStamp(&now);
+        ticks = DS_TICKS(&now) - DS_TICKS(&ts->ts_started);
+    }
+    printf("\n%ld bytes written, %ld bytes acknowledged in %ld.%02ld s (%ld bytes/s)\n",
+           ts->ts_nbytes_written, ts->ts_nbytes_acked, ticks / TICKS_PER_SECOND,
+           ticks % TICKS_PER_SECOND * 100 / TICKS_PER_SECOND, BYTES_PER_SEC(ts->ts_nbytes_acked, ticks));
+    printf("%ld packets sent, %ld retransmissions, %ld timeouts\n",
+           ts->ts_npackets, ts->ts_nretransmits, ts->ts_ntimeouts);
+    printf("RTT: %ld samples, average %ld ms, smoothed %ld ms\n", ts->ts_nrtt_samples,
+           ts->ts_nrtt_samples ? ts->ts_rtt_sum / ts->ts_nrtt_samples : 0, ts->ts_srtt / 1000);
+    printf("%ld bytes sent over the link, %ld of them added by SLIP\n", ts->ts_nbytes_wire, ts->ts_nbytes_slip);
+}
+
+
+static void print_queue_stats(const QueueStats *qs)
+{
+    printf("%ld transfers finished, %ld failed (%ld still listed), %ld bytes, %ld retransmissions, %ld timeouts\n",
+           qs->qs_nfinished, qs->qs_nfailed, qs->qs_nretained, qs->qs_nbytes_acked, qs->qs_nretransmits,
+           qs->qs_ntimeouts);
+}
+
+
+static void print_link_stats(const LinkStats *ls)
+{
+    printf("\nLINK           FRAMES      BYTES    PAYLOAD\n");
+    printf("sent       %10ld %10ld %10ld\n", ls->ls_nframes_out, ls->ls_nbytes_out, ls->ls_npayload_out);
+    printf("received   %10ld %10ld %10ld\n", ls->ls_nframes_in, ls->ls_nbytes_in, ls->ls_npayload_in);
+    printf("%ld retransmissions, %ld timeouts, %ld frames dropped (%ld bad checksums), %ld overruns, %ld read errors\n",
+           ls->ls_nretransmits, ls->ls_ntimeouts, ls->ls_ndropped, ls->ls_nbadsums, ls->ls_noverruns,
+           ls->ls_nrxerrors);
+}
+
+
+/*
+ * print a number of seconds as h:mm:ss
+ */
+static void print_duration(ULONG secs)
+{
+    printf("%3ld:%02ld:%02ld", secs / 3600, secs / 60 % 60, secs % 60);
+}
+
+
+/*
+ * print one line for a transfer in watch mode - the current rate is computed from the
+ * progress since the last update (prev, may be NULL), the ETA refers to the data that
+ * has been written so far (we don't know how large the file will be in the end)
+ */
+static void print_watch_line(const struct FileInfoBlock *fib, const TransferStats *ts, const Sample *prev,
+                             ULONG ticks)
+{
+    ULONG pct, rate, remaining;
+
+    if (ts->ts_nbytes_written == 0)
+        pct = 0;
+    else if (ts->ts_nbytes_written < 100)
+        pct = ts->ts_nbytes_acked * 100 / ts->ts_nbytes_written;
+    else
+        pct = ts->ts_nbytes_acked / (ts->ts_nbytes_written / 100);
+    if (pct > 100)
+        pct = 100;
+    rate = (prev && (ts->ts_nbytes_acked >= prev->s_nbytes_acked)) ?
+           BYTES_PER_SEC(ts->ts_nbytes_acked - prev->s_nbytes_acked, ticks) : 0;
+    remaining = ts->ts_nbytes_written - ts->ts_nbytes_acked;
+
+    printf("%-20.20s %-11s %10ld %10ld %3ld%% %8ld %6ld ", fib->fib_FileName, state_tbl[fib->fib_Protection],
+           ts->ts_nbytes_acked, ts->ts_nbytes_written, pct, rate,
+           ts->ts_nrtt_samples ? ts->ts_rtt_sum / ts->ts_nrtt_samples : 0);
+    if ((fib->fib_Protection != S_WRQ_SENT) && (fib->fib_Protection != S_DATA_SENT))
+        printf("        -\n");
+    else if (rate > 0) {
+        print_duration(remaining / rate);
+        printf("\n");
+    }
+    else if (prev)
+        printf("  STALLED\n");
+    else
+        printf("        ?\n");
+}
+
+
+/*
+ * print the totals of the link in watch mode, utilization is the share of the serial
+ * line's capacity (10 bits per byte with 8N1) used for sending since the last update
+ */
+static void print_watch_link(const LinkStats *ls, const LinkStats *prev, ULONG ticks)
+{
+    ULONG rate_out = 0, rate_in = 0, util = 0;
+
+    if (prev) {
+        rate_out = BYTES_PER_SEC(ls->ls_nbytes_out - prev->ls_nbytes_out, ticks);
+        rate_in  = BYTES_PER_SEC(ls->ls_nbytes_in - prev->ls_nbytes_in, ticks);
+        if (ls->ls_baud)
+            util = rate_out * 10 * 100 / ls->ls_baud;
+    }
+    printf("\nLINK (%ld baud): out %ld bytes/s (%ld%%), in %ld bytes/s\n", ls->ls_baud, rate_out, util, rate_in);
+    printf("total: %ld / %ld bytes sent / received, %ld / %ld payload, %ld frames\n", ls->ls_nbytes_out,
+           ls->ls_nbytes_in, ls->ls_npayload_out, ls->ls_npayload_in, ls->ls_nframes_out);
+    printf("%ld retransmissions, %ld timeouts, %ld frames dropped (%ld bad checksums), %ld overruns, %ld read errors\n",
+           ls->ls_nretransmits, ls->ls_ntimeouts, ls->ls_ndropped, ls->ls_nbadsums, ls->ls_noverruns,
+           ls->ls_nrxerrors);
+}
+
+
+/*
+ * watch mode - poll the handler every interval seconds and redraw the list of transfers
+ * together with the link totals until the user presses CTRL-C
+ */
+static void watch(struct FileInfoBlock *fib, ULONG interval)
+{
+    static Sample    samples[2][MAX_WATCHED];
+    Sample          *prev = samples[0], *cur = samples[1], *tmp, *ps;
+    ULONG            nprev = 0, ncur, ticks = 0, i, n;
+    struct DateStamp then, now;
+    LinkStats        ls[2];
+    UBYTE            lsvalid = 0;
+    TransferStats    ts;
+    QueueStats       qs;
+    BPTR             lock;
+
+    DateStamp(&then);
+    while (1) {
+        if ((lock = Lock("net:", ACCESS_READ)) == 0) {
+            printf("could not obtain lock for root directory\n");
+            return;
+        }
+        if (!Examine(lock, fib)) {
+            printf("error returned by Examine(): %ld\n", IoErr());
+            UnLock(lock);
+            return;
+        }
+        DateStamp(&now);
+        ticks = DS_TICKS(&now) - DS_TICKS(&then);
+        then  = now;
+
+        /* form feed clears the console window */
+        memset(&qs, 0, sizeof(qs));
+        get_stats(lock, lock, &qs, sizeof(qs));
+        printf("\f%ld bytes queued in total, updated every %ld s (CTRL-C to stop)\n", qs.qs_nbytes_queued,
+               interval);
+        print_queue_stats(&qs);
+        printf("\n");
+        printf("FILE                 STATE            ACKED    WRITTEN    %%    BYTES/S    RTT       ETA\n");
+        ncur = 0;
+        while (ExNext(lock, fib)) {
+            get_entry_stats(lock, fib, &ts);
+            for (i = 0, ps = NULL; i < nprev; ++i) {
+                if ((strcmp(prev[i].s_fname, fib->fib_FileName) == 0) &&
+                    (CompareDates(&prev[i].s_queued, &fib->fib_Date) == 0)) {
+                    ps = &prev[i];
+                    break;
+                }
+            }
+            print_watch_line(fib, &ts, ps, ticks);
+
+            if (ncur < MAX_WATCHED) {
+                strncpy(cur[ncur].s_fname, fib->fib_FileName, MAX_PATH_LEN - 1);
+                cur[ncur].s_fname[MAX_PATH_LEN - 1] = 0;
+                cur[ncur].s_queued       = fib->fib_Date;
+                cur[ncur].s_nbytes_acked = ts.ts_nbytes_acked;
+                ++ncur;
+            }
+        }
+        if (IoErr() != ERROR_NO_MORE_ENTRIES)
+            printf("error returned by ExNext(): %ld\n", IoErr());
+        if (get_stats(lock, 0, &ls[1], sizeof(LinkStats))) {
+            print_watch_link(&ls[1], lsvalid ? &ls[0] : NULL, ticks);
+            ls[0]   = ls[1];
+            lsvalid = 1;
+        }
+        UnLock(lock);
+
+        tmp   = prev;
+        prev  = cur;
+        cur   = tmp;
+        nprev = ncur;
+
+        /* wait in small steps so that CTRL-C is handled quickly */
+        for (n = 0; n < interval * 5; ++n) {
+            if (CheckSignal(SIGBREAKF_CTRL_C)) {
+                printf("*** BREAK\n");
+                return;
+            }
+            Delay(TICKS_PER_SECOND / 5);
+        }
+    }
+}
+
+
 int main(int argc, char **argv)
 {
     BPTR                     lock;
     struct FileInfoBlock    *fib;
+    struct RDArgs           *rdargs;
+    LONG                     args[NUM_ARGS];
+    ULONG                    interval;
     char                     path[MAX_PATH_LEN];
+    TransferStats            ts;
+    QueueStats               qs;
+    LinkStats                ls;
 
+    memset(args, 0, sizeof(args));
+    if ((rdargs = ReadArgs(TEMPLATE, args, NULL)) == NULL) {
+        printf("usage: listq [<file>] [WATCH [INTERVAL=<seconds>]]\n");
+        return RETURN_ERROR;
+    }
     if ((fib = AllocVec(sizeof(struct FileInfoBlock), MEMF_CLEAR)) == NULL) {
         printf("could not allocate memory for FileInfoBlock\n");
         goto ENOMEM;
     }
 
-    if (argc == 1) {
+    if (args[ARG_WATCH]) {
+        interval = args[ARG_INTERVAL] ? *((LONG *) args[ARG_INTERVAL]) : DEFAULT_INTERVAL;
+        if (interval == 0)
+            interval = 1;
+        watch(fib, interval);
+        goto ENOLOCK;
+    }
+
+    if (args[ARG_FILE] == 0) {
         if ((lock = Lock("net:", ACCESS_READ)) == 0) {
             printf("could not obtain lock for root directory\n");
             goto ENOLOCK;
@@ -54,18 +326,26 @@ int main(int argc, char **argv)
                 printf("error returned by Examine(): %ld\n", IoErr());
             goto ENOEXAM;
         }
-        printf("FILE                             STATE        ERROR\n");
+        if (get_stats(lock, lock, &qs, sizeof(qs))) {
+            printf("%ld bytes queued in total\n", qs.qs_nbytes_queued);
+            print_queue_stats(&qs);
+        }
+        printf("FILE                             STATE        ERROR     QUEUED\n");
         while (ExNext(lock, fib)) {
-            printf("%-30s   %-10s   %ld\n", fib->fib_FileName, state_tbl[fib->fib_Protection], fib->fib_Size);
+            get_entry_stats(lock, fib, &ts);
+            printf("%-30s   %-10s   %-6ld   %ld\n", fib->fib_FileName, state_tbl[fib->fib_Protection], fib->fib_Size,
+                   ts.ts_nbytes_queued);
         }
         if (IoErr() != ERROR_NO_MORE_ENTRIES)
             printf("error returned by ExNext(): %ld\n", IoErr());
+        if (get_stats(lock, 0, &ls, sizeof(ls)))
+            print_link_stats(&ls);
     }
-    else if (argc == 2) {
+    else {
         strncpy(path, "net:", MAX_PATH_LEN - 1);
-        strncat(path, argv[1], MAX_PATH_LEN - strlen(argv[1]) - 5);     /* 5 = 'net:' + null byte */
+        strncat(path, (char *) args[ARG_FILE], MAX_PATH_LEN - 5);     /* 5 = 'net:' + null byte */
         if ((lock = Lock(path, ACCESS_READ)) == 0) {
-            printf("could not obtain lock for file '%s'\n", argv[1]);
+            printf("could not obtain lock for file '%s'\n", (char *) args[ARG_FILE]);
             goto ENOLOCK;
         }
         if (!Examine(lock, fib)) {
@@ -73,8 +353,14 @@ int main(int argc, char **argv)
                 printf("error returned by Examine(): %ld\n", IoErr());
             goto ENOEXAM;
         }
-        printf("FILE                             STATE        ERROR\n");
-        printf("%-30s   %-10s   %ld\n", fib->fib_FileName, state_tbl[fib->fib_Protection], fib->fib_Size);
+        if (!get_stats(lock, lock, &ts, sizeof(ts))) {
+            printf("error returned by ACTION_GET_STATS: %ld\n", IoErr());
+            goto ENOEXAM;
+        }
+        printf("FILE                             STATE        ERROR     QUEUED\n");
+        printf("%-30s   %-10s   %-6ld   %ld\n", fib->fib_FileName, state_tbl[fib->fib_Protection], fib->fib_Size,
+               ts.ts_nbytes_queued);
+        print_transfer_stats(&ts);
     }
 
 ENOEXAM:
@@ -82,5 +368,6 @@ ENOEXAM:
 ENOLOCK:
     FreeVec(fib);
 ENOMEM:
+    FreeArgs(rdargs);
     return RETURN_OK;
 }
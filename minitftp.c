@@ -21,6 +21,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "codec.h"
+
 
 
 /*
@@ -28,29 +30,7 @@
  */
 #define MAX_PKT_SIZE 1024
 
-/*
- * TFTP
- */
-/* packet types */
-#define    OP_RRQ    1            /* read request */
-#define    OP_WRQ    2            /* write request */
-#define    OP_DATA   3            /* data packet */
-#define    OP_ACK    4            /* acknowledgement */
-#define    OP_ERROR  5            /* error code */
-
-/* error codes */
-#define    EUNDEF      0        /* not defined */
-#define    ENOTFOUND   1        /* file not found */
-#define    EACCESS     2        /* access violation */
-#define    ENOSPACE    3        /* disk full or allocation exceeded */
-#define    EBADOP      4        /* illegal TFTP operation */
-#define    EBADID      5        /* unknown transfer ID */
-#define    EEXISTS     6        /* file already exists */
-#define    ENOUSER     7        /* no such user */
-#define    EOPTNEG     8        /* option negotiation failed */
-
-#define TFTP_MAX_DATA_SIZE 512
-#define TFTP_MAX_BLK_NUM 65535
+#define TFTP_MAX_DATA_SIZE TFTP_DEFAULT_BLKSIZE
 
 
 /*
@@ -71,38 +51,27 @@ char *get_basename(const char *fname)
 
 int send_req_packet(int sockfd, const struct addrinfo *addr, int opcode, const char *fname)
 {
-    uint8_t pktbuf[MAX_PKT_SIZE], *pos;
+    uint8_t pktbuf[MAX_PKT_SIZE];
     int pktsize;
 
-    pos = pktbuf;
-    *((uint16_t *) pos) = htons(opcode);        /* opcode */
-    pos += 2;
     /* length of the file name has been checked before, so the packet buffer is
      * guaranteed to be large enough */
-    /* TODO: Maybe it's better to check the length here */
-    strcpy((char *) pos, fname);                /* file name */
-    pos += strlen(fname) + 1;
-    strcpy((char *) pos, "NETASCII");           /* mode */
-    pktsize = strlen(fname) + 12;
+    pktsize = tftp_build_request(pktbuf, MAX_PKT_SIZE, opcode, fname, 0, 0);
     return sendto(sockfd, pktbuf, pktsize, 0, addr->ai_addr, addr->ai_addrlen);
 }
 
 
 int send_data_packet(int sockfd, const struct addrinfo *addr, const uint8_t *data, uint16_t blknum, uint16_t datalen)
 {
-    uint8_t pktbuf[MAX_PKT_SIZE], *pos;
+    uint8_t pktbuf[MAX_PKT_SIZE];
     int pktsize;
 
-    pos = pktbuf;
-    *((uint16_t *) pos) = htons(OP_DATA);       /* opcode */
-    pos += 2;
-    *((uint16_t *) pos) = htons(blknum);        /* block number */
-    pos += 2;
+    tftp_put_header(pktbuf, OP_DATA, blknum);
     if (datalen > TFTP_MAX_DATA_SIZE)
         /* TODO: set errno accordingly or use some other mechanism to report errors */
         return -1;
-    memcpy(pos, data, datalen);
-    pktsize = datalen + 4;
+    memcpy(pktbuf + TFTP_HDR_LEN, data, datalen);
+    pktsize = datalen + TFTP_HDR_LEN;
     return sendto(sockfd, pktbuf, pktsize, 0, addr->ai_addr, addr->ai_addrlen);
 }
 
@@ -113,18 +82,6 @@ int recv_packet(int sockfd, struct addrinfo *addr, uint8_t *pkt)
 }
 
 
-int get_opcode(uint8_t *pkt)
-{
-    return ntohs(*((uint16_t *) pkt));
-}
-
-
-int get_blknum(uint8_t *pkt)
-{
-    return ntohs(*((uint16_t *) (pkt + 2)));
-}
-
-
 /*
  * main function
  */
@@ -135,6 +92,10 @@ int main(int argc, char **argv)
     char *fname, *bname;
     uint8_t pkt[MAX_PKT_SIZE];
 
+    if (argc != 4) {
+        printf("usage: minitftp <server> <port> <file>\n");
+        return 1;
+    }
     fname = argv[3];
     bname = get_basename(argv[3]);
     if (strlen(bname) > MAX_PKT_SIZE - 12) {
@@ -163,7 +124,7 @@ int main(int argc, char **argv)
                 /* wait for ACK / ERROR packet */
                 if (recv_packet(sockfd, addr, pkt) != -1) {
                     printf("DEBUG: received packet from server\n");
-                    switch (get_opcode(pkt)) {
+                    switch (tftp_get_opcode(pkt)) {
                         case OP_ACK:
                             printf("DEBUG: received OP_ACK from server - starting file transfer\n");
                             /* send file block by block */
@@ -185,9 +146,9 @@ int main(int argc, char **argv)
                                     perror("ERROR: failed to receive packet from server");
                                     error = 1;
                                 }
-                                switch (get_opcode(pkt)) {
+                                switch (tftp_get_opcode(pkt)) {
                                     case OP_ACK:
-                                        if (get_blknum(pkt) == blknum) {
+                                        if (tftp_get_blknum(pkt) == blknum) {
                                             printf("DEBUG: ACK received for sent packet - sending next packet\n");
                                         }
                                         else {
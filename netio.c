@@ -10,623 +10,591 @@
 
 
 ULONG g_netio_errno = 0;
-static struct IOExtSer *sreq;
+LinkStats g_linkstats;
+struct Device *TimerBase;           /* for GetSysTime() */
+static struct IOExtSer *wreq;       /* request for writes */
+static struct IOExtSer *rreq[2];    /* requests for reads, one of them is always pending */
+static struct IOExtSer *qreq;       /* request for querying the device */
 static struct IOExtTime *treq;
+static BOOL    txbusy;              /* a write is in progress */
+static BOOL    tmbusy;              /* the timer is running */
+static Buffer *pktbuf;              /* headers of the outgoing packet (IP, UDP, TFTP) */
+static Buffer *txframe;             /* SLIP frame that is currently being sent */
+static Buffer *rxchunk[2];          /* raw data read from the serial device by each read request */
+static struct IOExtSer *rxcur;      /* read request whose data is currently being decoded ... */
+static ULONG   rxpos;               /* ... and position of the first byte not yet decoded */
+static Buffer *rxpkt;               /* datagram that is currently being decoded */
+static SlipDecoder rxdec;
+static TransferStats *txstats;      /* statistics of the transfer in progress (or NULL) */
+static UdpIpTemplate hdrtmpl;       /* IP and UDP headers of all outgoing packets */
+
+/* TODO: supply the IP addresses as arguments */
+static const UBYTE srcaddr[4] = {127, 0, 0, 1};
+static const UBYTE dstaddr[4] = {127, 0, 0, 99};
 
 
 /*
- * initialize this module
+ * allocate / free the buffers for outgoing and incoming packets, they are allocated
+ * only once and then reused for every packet
  */
-LONG netio_init(const struct DosPacket *iopkt1, const struct DosPacket *iopkt2)
+static LONG alloc_buffers()
 {
-    /* initialize serial device */
-    if ((sreq = (struct IOExtSer *) CreateExtIO(g_port, sizeof(struct IOExtSer))) != NULL) {
-        /* add DOS packet to IO request so that IO completion messages can be handled as internal packets */
-        sreq->IOSer.io_Message.mn_Node.ln_Name = (char *) iopkt1;
-        if ((treq = (struct IOExtTime *) CreateExtIO(g_port, sizeof(struct IOExtTime)))) {
-            /* add DOS packet to IO request so that IO completion messages can be handled as internal packets */
-            treq->tr_node.io_Message.mn_Node.ln_Name = (char *) iopkt2;
-            if (OpenDevice("serial.device", 0l, (struct IORequest *) sreq, 0l) == 0) {
-                /* configure device to terminate read requests on SLIP end-of-frame-markers and disable flow control */
-                /* 
-                 * TODO: configure device for maximum speed:
-                sreq->io_SerFlags     |= SERF_XDISABLED | SERF_RAD_BOOGIE;
-                sreq->io_Baud          = 292000l;
-                 */
-                sreq->io_SerFlags     |= SERF_XDISABLED;
-                sreq->IOSer.io_Command = SDCMD_SETPARAMS;
-                memset(&sreq->io_TermArray, SLIP_END, 8);
-                if (DoIO((struct IORequest *) sreq) == 0) {
-                    if (OpenDevice("timer.device", UNIT_VBLANK, (struct IORequest *) treq, 0l) == 0) {
-                        LOG("INFO: network IO module initialized\n");
-                        return DOSTRUE;
-                    }
-                    else {
-                        LOG("CRITICAL: could not open timer device\n");
-                        CloseDevice((struct IORequest *) sreq);
-                        DeleteExtIO((struct IORequest *) treq);
-                        DeleteExtIO((struct IORequest *) sreq);
-                        return DOSFALSE;
-                    }
-                }
-                else {
-                    LOG("CRITICAL: could not configure serial device\n");
-                    CloseDevice((struct IORequest *) sreq);
-                    DeleteExtIO((struct IORequest *) treq);
-                    DeleteExtIO((struct IORequest *) sreq);
-                    return DOSFALSE;
-                }
-            }
-            else {
-                LOG("CRITICAL: could not open serial device\n");
-                DeleteExtIO((struct IORequest *) treq);
-                DeleteExtIO((struct IORequest *) sreq);
-                return DOSFALSE;
-            }
-        }
-        else {
-            LOG("CRITICAL: could not create request for timer device\n");
-            DeleteExtIO((struct IORequest *) sreq);
-            return DOSFALSE;
-        }
+    if ((pktbuf = create_buffer(g_max_buffer_size)) == NULL)
+        return DOSFALSE;
+    if ((txframe = create_buffer(MAX_FRAME_SIZE)) == NULL) {
+        delete_buffer(pktbuf);
+        return DOSFALSE;
     }
-    else {
-        LOG("CRITICAL: could not create request for serial device\n");
+    if ((rxchunk[0] = create_buffer(RX_CHUNK_SIZE)) == NULL) {
+        delete_buffer(txframe);
+        delete_buffer(pktbuf);
         return DOSFALSE;
     }
+    if ((rxchunk[1] = create_buffer(RX_CHUNK_SIZE)) == NULL) {
+        delete_buffer(rxchunk[0]);
+        delete_buffer(txframe);
+        delete_buffer(pktbuf);
+        return DOSFALSE;
+    }
+    if ((rxpkt = create_buffer(g_max_buffer_size)) == NULL) {
+        delete_buffer(rxchunk[1]);
+        delete_buffer(rxchunk[0]);
+        delete_buffer(txframe);
+        delete_buffer(pktbuf);
+        return DOSFALSE;
+    }
+    rxcur = NULL;
+    rxpos = 0;
+    slip_decoder_init(&rxdec, rxpkt->b_addr, g_max_buffer_size);
+    return DOSTRUE;
 }
 
 
-/*
- * free all ressources
- */
-void netio_exit()
+static void free_buffers()
 {
-    CloseDevice((struct IORequest *) treq);
-    CloseDevice((struct IORequest *) sreq);
-    DeleteExtIO((struct IORequest *) treq);
-    DeleteExtIO((struct IORequest *) sreq);
+    delete_buffer(rxpkt);
+    delete_buffer(rxchunk[1]);
+    delete_buffer(rxchunk[0]);
+    delete_buffer(txframe);
+    delete_buffer(pktbuf);
 }
 
 
 /*
- * get status of last IO operation 
- * 
- * returns:
- * 0 if last operation was successful
- * the error code from the serial device (values > 0) if an error occurred
- * -1 if the status could not be determined, g_netio_errno is set in this case
+ * count an error while reading from the serial device - overruns mean that the baud
+ * rate is too high for the machine or the read buffer is too small
  */
-BYTE netio_get_status()
+static void count_serial_error(BYTE error)
 {
-    /* check if IO operation has actually finished */
-    if (!CheckIO((struct IORequest *) sreq)) {
-        LOG("ERROR: IO operation has not yet finished\n");
-        g_netio_errno = ERROR_IO_NOT_FINISHED;
-        return -1;
+    if ((error == SerErr_BufOverflow) || (error == SerErr_LineErr)) {
+        ++g_linkstats.ls_noverruns;
+        LOG_WARN("serial overrun (error %ld, %ld overruns so far)\n", (LONG) error, g_linkstats.ls_noverruns);
     }
-    return WaitIO((struct IORequest *) sreq);
+    else
+        ++g_linkstats.ls_nrxerrors;
 }
 
 
-/*
- * stop the running IO timer
- */
-void netio_stop_timer()
+void netio_log_serial_stats()
 {
-    /* We ignore any errors that might occur */
-    AbortIO((struct IORequest *) treq);
-    WaitIO((struct IORequest *) treq);
+    LOG_INFO("serial device: %ld reads (%ld bytes per read on average), %ld overruns, %ld other read errors\n",
+             g_linkstats.ls_nreads, g_linkstats.ls_nreads ? g_linkstats.ls_nbytes_in / g_linkstats.ls_nreads : 0,
+             g_linkstats.ls_noverruns, g_linkstats.ls_nrxerrors);
+    LOG_INFO("serial link: %ld / %ld frames, %ld / %ld bytes (%ld / %ld bytes payload) sent / received\n",
+             g_linkstats.ls_nframes_out, g_linkstats.ls_nframes_in, g_linkstats.ls_nbytes_out,
+             g_linkstats.ls_nbytes_in, g_linkstats.ls_npayload_out, g_linkstats.ls_npayload_in);
 }
 
 
 /*
- * abort the current IO operation (called when a timeout occurs)
+ * set the statistics of the transfer the packets sent from now on belong to
  */
-void netio_abort()
+void netio_set_transfer_stats(TransferStats *stats)
 {
-    /* We ignore any errors that might occur */
-    AbortIO((struct IORequest *) sreq);
-    WaitIO((struct IORequest *) sreq);
+    txstats = stats;
 }
 
 
 /*
- * copy data between two buffers and SLIP-encode them on the way
+ * start a read request
+ * The requests are served by the device in the order in which they were sent, so the
+ * data arrives in the right order as long as the requests are handled in the order in
+ * which they complete. To make sure that a request doesn't wait for data that is never
+ * sent, a read asks for the bytes already waiting in the device's buffer (but at least
+ * one), minus the ones the other request still needs if it hasn't completed yet. If its
+ * io_Actual isn't up to date, we just read less than we could.
  */
-static LONG slip_encode_buffer(Buffer *dbuf, const Buffer *sbuf)
+static void start_read(struct IOExtSer *req)
 {
-    const UBYTE *src = sbuf->b_addr;
-    UBYTE *dst       = dbuf->b_addr;
-    int nbytes, nbytes_tot = 0;
-    /*
-     * The limit for nbytes_tot has to be length of the destination buffer - 1
-     * because due to the escaping mechanism in SLIP, we can get two bytes in
-     * one pass of the loop.
-     */
-    for (nbytes = 0;
-        nbytes < sbuf->b_size && nbytes_tot < MAX_BUFFER_SIZE - 1; 
-		nbytes++, nbytes_tot++, src++, dst++) {
-        if (*src == SLIP_END) {
-            *dst = SLIP_ESC;
-            ++dst;
-            ++nbytes_tot;
-            *dst = SLIP_ESCAPED_END;
-        }
-        else if (*src == SLIP_ESC) {
-            *dst = SLIP_ESC;
-            ++dst;
-            ++nbytes_tot;
-            *dst = SLIP_ESCAPED_ESC;
-        }
-        else {
-            *dst = *src;
-        }
-    }
-    dbuf->b_size = nbytes_tot;
-    if (nbytes < sbuf->b_size) {
-        LOG("ERROR: could not copy all bytes to the destination\n");
-        g_netio_errno = ERROR_BUFFER_OVERFLOW;
-        return DOSFALSE;
-    }
-    g_netio_errno = 0;
-    return DOSTRUE;
+    struct IOExtSer *other = (req == rreq[0]) ? rreq[1] : rreq[0];
+    ULONG            nbytes = 0, nother;
+
+    qreq->IOSer.io_Command = SDCMD_QUERY;
+    if (DoIO((struct IORequest *) qreq) == 0) {
+        nbytes = qreq->IOSer.io_Actual;
+        if (qreq->io_Status & IO_STATF_OVERRUN)
+            count_serial_error(SerErr_LineErr);
+    }
+    if (!CheckIO((struct IORequest *) other)) {
+        nother  = other->IOSer.io_Length - other->IOSer.io_Actual;
+        nbytes  = (nbytes > nother) ? nbytes - nother : 0;
+    }
+    if (nbytes < 1)
+        nbytes = 1;
+    else if (nbytes > RX_CHUNK_SIZE)
+        nbytes = RX_CHUNK_SIZE;
+    req->IOSer.io_Command = CMD_READ;
+    req->IOSer.io_Length  = nbytes;
+    req->IOSer.io_Data    = (APTR) rxchunk[(req == rreq[0]) ? 0 : 1]->b_addr;
+    SendIO((struct IORequest *) req);
 }
 
 
 /*
- * copy data between two buffers and SLIP-decode them on the way
+ * initialize this module (called by the network task, the IO completion messages are
+ * sent to its port)
+ * We use separate requests for reading and writing, so that we can receive while we're
+ * sending (the serial device is full-duplex). Two read requests are used alternately, so
+ * that there is always a read pending while we're handling the data of the other one.
  */
-static LONG slip_decode_buffer(Buffer *dbuf, const Buffer *sbuf)
+LONG netio_init(struct MsgPort *port, const struct DosPacket *iopkt1, const struct DosPacket *iopkt2,
+                const struct DosPacket *iopkt3)
 {
-    const UBYTE *src = sbuf->b_addr;
-    UBYTE *dst       = dbuf->b_addr;
-    int nbytes;
-    g_netio_errno = ERROR_BUFFER_OVERFLOW;
-    for (nbytes = 0;
-        nbytes < sbuf->b_size && nbytes < MAX_BUFFER_SIZE; 
-		nbytes++, src++, dst++) {
-        if (*src == SLIP_ESC) {
-            ++src;
-            if (*src == SLIP_ESCAPED_END)
-                *dst = SLIP_END;
-            else if (*src == SLIP_ESCAPED_ESC)
-                *dst = SLIP_ESC;
-            else {
-                LOG("ERROR: invalid escape sequence found in SLIP frame: 0x%02lx\n", (ULONG) *src);
-                g_netio_errno = ERROR_BAD_NUMBER;
-                break;
-            }
-        }
-        else
-            *dst = *src;
-    }
-    dbuf->b_size = nbytes;
-    if (nbytes < sbuf->b_size) {
-        LOG("ERROR: could not copy all bytes to the destination\n");
-        return DOSFALSE;
-    }
-    g_netio_errno = 0;
+    /* initialize serial device */
+    if ((wreq = (struct IOExtSer *) CreateExtIO(port, sizeof(struct IOExtSer))) == NULL) {
+        LOG_CRITICAL("could not create request for serial device\n");
+        goto ERROR_NO_WREQ;
+    }
+    if ((rreq[0] = (struct IOExtSer *) CreateExtIO(port, sizeof(struct IOExtSer))) == NULL
+        || (rreq[1] = (struct IOExtSer *) CreateExtIO(port, sizeof(struct IOExtSer))) == NULL
+        || (qreq = (struct IOExtSer *) CreateExtIO(port, sizeof(struct IOExtSer))) == NULL) {
+        LOG_CRITICAL("could not create request for serial device\n");
+        goto ERROR_NO_RREQ;
+    }
+    if ((treq = (struct IOExtTime *) CreateExtIO(port, sizeof(struct IOExtTime))) == NULL) {
+        LOG_CRITICAL("could not create request for timer device\n");
+        goto ERROR_NO_TREQ;
+    }
+    if (OpenDevice("serial.device", g_ser_unit, (struct IORequest *) wreq, 0l) != 0) {
+        LOG_CRITICAL("could not open serial device (unit %ld)\n", g_ser_unit);
+        goto ERROR_NO_SERIAL;
+    }
+    /* disable XON/XOFF, SLIP frames are assembled from whatever we read (see
+     * start_read()), so EOF mode is not needed - the other parameters are only changed
+     * if they have been configured (see config.c) */
+    wreq->io_SerFlags     |= SERF_XDISABLED | g_ser_flags;
+    if (g_ser_baud)
+        wreq->io_Baud      = g_ser_baud;
+    if (g_ser_rbuflen)
+        wreq->io_RBufLen   = g_ser_rbuflen;
+    wreq->IOSer.io_Command = SDCMD_SETPARAMS;
+    if (DoIO((struct IORequest *) wreq) != 0) {
+        LOG_CRITICAL("could not configure serial device\n");
+        goto ERROR_NO_PARAMS;
+    }
+    /* the other requests are copies of the one used to open the device */
+    CopyMem(wreq, rreq[0], sizeof(struct IOExtSer));
+    CopyMem(wreq, rreq[1], sizeof(struct IOExtSer));
+    CopyMem(wreq, qreq, sizeof(struct IOExtSer));
+    /* add DOS packets to IO requests so that IO completion messages can be handled as internal packets */
+    wreq->IOSer.io_Message.mn_Node.ln_Name    = (char *) iopkt1;
+    treq->tr_node.io_Message.mn_Node.ln_Name  = (char *) iopkt2;
+    rreq[0]->IOSer.io_Message.mn_Node.ln_Name = (char *) iopkt3;
+    rreq[1]->IOSer.io_Message.mn_Node.ln_Name = (char *) iopkt3;
+    /* UNIT_MICROHZ because timeouts are derived from measured round-trip times */
+    if (OpenDevice("timer.device", UNIT_MICROHZ, (struct IORequest *) treq, 0l) != 0) {
+        LOG_CRITICAL("could not open timer device\n");
+        goto ERROR_NO_TIMER;
+    }
+    TimerBase = treq->tr_node.io_Device;
+    if (alloc_buffers() == DOSFALSE) {
+        LOG_CRITICAL("could not allocate buffers for network IO\n");
+        goto ERROR_NO_BUFFERS;
+    }
+
+    /* start reading right away, so that we don't miss anything */
+    txbusy    = 0;
+    tmbusy    = 0;
+    txstats   = NULL;
+    udpip_init_template(&hdrtmpl, srcaddr, dstaddr, 4711, 69);
+    memset(&g_linkstats, 0, sizeof(LinkStats));
+    g_linkstats.ls_baud = wreq->io_Baud;
+    start_read(rreq[0]);
+    start_read(rreq[1]);
+    LOG_INFO("network IO module initialized (%ld baud)\n", wreq->io_Baud);
     return DOSTRUE;
+
+ERROR_NO_BUFFERS:
+    CloseDevice((struct IORequest *) treq);
+ERROR_NO_TIMER:
+ERROR_NO_PARAMS:
+    CloseDevice((struct IORequest *) wreq);
+ERROR_NO_SERIAL:
+    DeleteExtIO((struct IORequest *) treq);
+ERROR_NO_TREQ:
+ERROR_NO_RREQ:
+    /* DeleteExtIO() accepts NULL */
+    DeleteExtIO((struct IORequest *) qreq);
+    DeleteExtIO((struct IORequest *) rreq[1]);
+    DeleteExtIO((struct IORequest *) rreq[0]);
+    DeleteExtIO((struct IORequest *) wreq);
+ERROR_NO_WREQ:
+    return DOSFALSE;
 }
 
 
 /*
- * calculate IP / ICMP checksum (taken from the code for in_cksum() floating on the net)
+ * free all ressources
  */
-static USHORT calc_checksum(const UBYTE * bytes, ULONG len)
+void netio_exit()
 {
-    ULONG sum, i;
-    USHORT * p;
-
-    sum = 0;
-    p = (USHORT *) bytes;
-
-    for (i = len; i > 1; i -= 2)                /* sum all 16-bit words */
-        sum += *p++;
-
-    if (i == 1)                                 /* add an odd byte if necessary */
-        sum += (USHORT) *((UBYTE *) p);
-
-    sum = (sum >> 16) + (sum & 0x0000ffff);     /* fold in upper 16 bits */
-    sum += (sum >> 16);                         /* add carry bits */
-    return ~((USHORT) sum);                     /* return 1-complement truncated to 16 bits */
+    AbortIO((struct IORequest *) rreq[0]);
+    WaitIO((struct IORequest *) rreq[0]);
+    AbortIO((struct IORequest *) rreq[1]);
+    WaitIO((struct IORequest *) rreq[1]);
+    netio_log_serial_stats();
+    free_buffers();
+    CloseDevice((struct IORequest *) treq);
+    CloseDevice((struct IORequest *) wreq);
+    DeleteExtIO((struct IORequest *) treq);
+    DeleteExtIO((struct IORequest *) qreq);
+    DeleteExtIO((struct IORequest *) rreq[1]);
+    DeleteExtIO((struct IORequest *) rreq[0]);
+    DeleteExtIO((struct IORequest *) wreq);
 }
 
 
 /*
- * UDP routines
+ * get status of last write operation
+ * 
+ * returns:
+ * 0 if last operation was successful
+ * the error code from the serial device (values > 0) if an error occurred
+ * -1 if the status could not be determined, g_netio_errno is set in this case
  */
-static Buffer *create_udp_packet(const Buffer *data)
+BYTE netio_get_status()
 {
-    Buffer *pkt;
-    UDPHeader hdr;
-
-    if ((UDP_HDR_LEN + data->b_size) > MAX_BUFFER_SIZE) {
-        LOG("ERROR: UDP packet would exceed maximum buffer size\n");
-        g_netio_errno = ERROR_BUFFER_OVERFLOW;
-        return NULL;
-    }
-
-    /* create buffer large enough to hold the UDP header and the data */
-    if ((pkt = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for UDP packet\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return NULL;
+    /* check if IO operation has actually finished */
+    if (!CheckIO((struct IORequest *) wreq)) {
+        LOG_ERROR("IO operation has not yet finished\n");
+        g_netio_errno = ERROR_IO_NOT_FINISHED;
+        return -1;
     }
-
-    /* build UPD header (without checksum) and copy it to buffer */
-    memset(&hdr, 0, UDP_HDR_LEN);
-    hdr.uh_sport = htons(4711);
-    hdr.uh_dport = htons(69);
-    hdr.uh_ulen  = htons(UDP_HDR_LEN + data->b_size);
-    memcpy(pkt->b_addr, &hdr, sizeof(UDPHeader));
-
-    /* copy data */
-    memcpy(pkt->b_addr + sizeof(UDPHeader), data->b_addr, data->b_size);
-    pkt->b_size = UDP_HDR_LEN + data->b_size;
-    g_netio_errno = 0;
-    return pkt;
+    txbusy = 0;
+    return WaitIO((struct IORequest *) wreq);
 }
 
 
-static Buffer *get_data_from_udp_packet(const Buffer *pkt)
+/*
+ * check if a write is in progress
+ */
+BOOL netio_is_writing()
 {
-    Buffer *data;
+    return txbusy;
+}
 
-    if ((data = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for UDP data\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return NULL;
-    }
-    memcpy(data->b_addr, pkt->b_addr + sizeof(UDPHeader), pkt->b_size - sizeof(UDPHeader));
-    data->b_size = pkt->b_size - sizeof(UDPHeader);
-    g_netio_errno = 0;
-    return data;
 
+/*
+ * (re)start the IO timer (timeout in microseconds), an ACTION_TIMER_EXPIRED packet is
+ * received when it expires
+ */
+void netio_start_timer(ULONG timeout)
+{
+    netio_stop_timer();
+    treq->tr_node.io_Command = TR_ADDREQUEST;
+    treq->tr_time.tv_secs    = timeout / 1000000;
+    treq->tr_time.tv_micro   = timeout % 1000000;
+    SendIO((struct IORequest *) treq);
+    tmbusy = 1;
 }
 
 
 /*
- * IP routines
+ * stop the running IO timer
  */
-static Buffer *create_ip_packet(const Buffer *data)
+void netio_stop_timer()
 {
-    Buffer *pkt;
-    IPHeader hdr;
-
-    if ((IP_HDR_LEN + data->b_size) > MAX_BUFFER_SIZE) {
-        LOG("ERROR: IP packet would exceed maximum buffer size\n");
-        g_netio_errno = ERROR_BUFFER_OVERFLOW;
-        return NULL;
+    /* We ignore any errors that might occur */
+    if (tmbusy) {
+        AbortIO((struct IORequest *) treq);
+        WaitIO((struct IORequest *) treq);
+        tmbusy = 0;
     }
+}
 
-    /* create buffer large enough to hold the IP header and the data */
-    if ((pkt = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for IP packet\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return NULL;
-    }
 
-    /* build IP header and copy it to buffer */
-    /* TODO: supply destination IP address as argument */
-    memset(&hdr, 0, IP_HDR_LEN);
-    hdr.ip_v   = 4;                                   /* version */
-    hdr.ip_hl  = IP_HDR_LEN / 4;                      /* header length in 32-bit words */
-    hdr.ip_len = htons(IP_HDR_LEN + data->b_size);    /* length of datagram in octets */
-    hdr.ip_ttl = 255;                                 /* time-to-live */
-    hdr.ip_p   = IPPROTO_UDP;                         /* transport layer protocol */
-    hdr.ip_src[0] = 127;                              /* source address */
-    hdr.ip_src[1] = 0;
-    hdr.ip_src[2] = 0;
-    hdr.ip_src[3] = 1;
-    hdr.ip_dst[0] = 127;                              /* destination address */
-    hdr.ip_dst[1] = 0;
-    hdr.ip_dst[2] = 0;
-    hdr.ip_dst[3] = 99;
-    hdr.ip_sum = calc_checksum((UBYTE *) &hdr, IP_HDR_LEN);
-    memcpy(pkt->b_addr, &hdr, sizeof(IPHeader));
-    
-    /* copy data */
-    memcpy(pkt->b_addr + sizeof(IPHeader), data->b_addr, data->b_size);
-    pkt->b_size = IP_HDR_LEN + data->b_size;
-    g_netio_errno = 0;
-    return pkt;
+/*
+ * tell this module that the timer has expired (the ACTION_TIMER_EXPIRED packet has
+ * already been removed from the port, so the request must not be aborted anymore)
+ */
+void netio_timer_expired()
+{
+    tmbusy = 0;
 }
 
 
-static Buffer *get_data_from_ip_packet(const Buffer *pkt)
+/*
+ * abort the current write operation and the timer (called when a timeout occurs or a
+ * transfer has been terminated), the reads keep on running
+ */
+void netio_abort()
 {
-    Buffer *data;
-
-    if ((data = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for IP data\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return NULL;
+    /* We ignore any errors that might occur */
+    if (txbusy) {
+        AbortIO((struct IORequest *) wreq);
+        WaitIO((struct IORequest *) wreq);
+        txbusy = 0;
     }
-    memcpy(data->b_addr, pkt->b_addr + sizeof(IPHeader), pkt->b_size - sizeof(IPHeader));
-    data->b_size = pkt->b_size - sizeof(IPHeader);
-    g_netio_errno = 0;
-    return data;
-
+    netio_stop_timer();
 }
 
 
 /*
- * SLIP routines
+ * get current system time in microseconds (wraps around after about 71 minutes, so only
+ * use it for measuring intervals)
  */
-static Buffer *create_slip_frame(const Buffer *data)
+ULONG netio_get_time()
 {
-    Buffer *frame;
-
-    /* create buffer large enough to hold the IP header and the data */
-    if ((frame = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for SLIP frame\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return NULL;
-    }
+    struct timeval tv;
 
-    if (slip_encode_buffer(frame, data) == DOSFALSE) {
-        LOG("ERROR: could not copy all data to the SLIP frame\n");
-        /* g_netio_errno has already been set by slip_encode_buffer() */
-        return NULL;
-    }
-    
-    /* add SLIP end-of-frame marker */
-    if (frame->b_size < MAX_BUFFER_SIZE) {
-        *(frame->b_addr + frame->b_size) = SLIP_END;
-        ++frame->b_size;
-    }
-    else {
-        LOG("ERROR: could not add SLIP end-of-frame marker\n");
-        g_netio_errno = ERROR_BUFFER_OVERFLOW;
-        return NULL;
-    }
-    g_netio_errno = 0;
-    return frame;
+    GetSysTime(&tv);
+    return tv.tv_secs * 1000000 + tv.tv_micro;
 }
 
 
-static LONG send_slip_frame(const Buffer *frame, BOOL async)
+/*
+ * SLIP routines
+ */
+static LONG send_slip_frame(const Buffer *frame)
 {
-    BYTE error;
-
-    sreq->io_SerFlags     &= ~SERF_EOFMODE;      /* clear EOF mode */
-    sreq->IOSer.io_Command = CMD_WRITE;
-    sreq->IOSer.io_Length  = frame->b_size;
-    sreq->IOSer.io_Data    = (APTR) frame->b_addr;
-    if (async) {
-        SendIO((struct IORequest *) sreq);
-        treq->tr_node.io_Command = TR_ADDREQUEST;
-        treq->tr_time.tv_secs    = NETIO_TIMEOUT;
-        treq->tr_time.tv_micro   = 0;
-        SendIO((struct IORequest *) treq);
-        g_netio_errno = 0;
-        return DOSTRUE;
-    }
-    else {
-        error = DoIO((struct IORequest *) sreq);
-        g_netio_errno = error;
-        if (error == 0)
-            return DOSTRUE;
-        else
-            return DOSFALSE;
-    }
+    /* writes should never take longer than NETIO_TIMEOUT */
+    wreq->IOSer.io_Command = CMD_WRITE;
+    wreq->IOSer.io_Length  = frame->b_size;
+    wreq->IOSer.io_Data    = (APTR) frame->b_addr;
+    SendIO((struct IORequest *) wreq);
+    txbusy = 1;
+    netio_start_timer(NETIO_TIMEOUT * 1000000);
+    g_netio_errno = 0;
+    return DOSTRUE;
 }
 
 
-static LONG recv_slip_frame(Buffer *frame, BOOL async)
+/*
+ * take over the data of a read request that has completed (called for every
+ * ACTION_READ_RETURN), the data is then decoded by extract_tftp_packet()
+ * We don't know how many bytes the next frame will have, so we just read whatever is
+ * available (see start_read()). The frames are assembled from this raw data by the SLIP
+ * decoder, so it doesn't matter if a read contains only part of a frame or several frames.
+ */
+LONG netio_read_completed(struct Message *msg)
 {
     BYTE error;
 
-    /* TODO: It would be better if the whole network stack ran in its own task,
-     *       then we could handle timeouts internally instead of in the main loop */
-    sreq->io_SerFlags     |= SERF_EOFMODE;       /* set EOF mode */
-    sreq->IOSer.io_Command = CMD_READ;
-    sreq->IOSer.io_Length  = MAX_BUFFER_SIZE;
-    sreq->IOSer.io_Data    = (APTR) frame->b_addr;
-    if (async) {
-        SendIO((struct IORequest *) sreq);
-        treq->tr_node.io_Command = TR_ADDREQUEST;
-        treq->tr_time.tv_secs    = NETIO_TIMEOUT;
-        treq->tr_time.tv_micro   = 0;
-        SendIO((struct IORequest *) treq);
-        g_netio_errno = 0;
-        return DOSTRUE;
-    }
-    else {
-        error = DoIO((struct IORequest *) sreq);
+    rxcur = (struct IOExtSer *) msg;
+    rxpos = 0;
+    if ((error = rxcur->IOSer.io_Error) != 0) {
+        /* data is discarded, lost packets are retransmitted anyway */
+        LOG_ERROR("reading from serial device failed with error %ld\n", (LONG) error);
+        count_serial_error(error);
+        start_read(rxcur);
+        rxcur = NULL;
         g_netio_errno = error;
-        if (error == 0) {
+        return DOSFALSE;
+    }
 #if DEBUG
-            LOG("DEBUG: dump of received SLIP frame (%ld bytes):\n", frame->b_size);
-            dump_buffer(frame);
-#endif
-            frame->b_size = sreq->IOSer.io_Actual;
-            return DOSTRUE;
-        }
-        else
-            return DOSFALSE;
+    LOG_DEBUG("dump of received data (%ld bytes):\n", rxcur->IOSer.io_Actual);
+    {
+        Buffer data = {rxcur->IOSer.io_Data, rxcur->IOSer.io_Actual};
+        dump_buffer(&data);
     }
+#endif
+    ++g_linkstats.ls_nreads;
+    g_linkstats.ls_nbytes_in += rxcur->IOSer.io_Actual;
+    g_netio_errno = 0;
+    return DOSTRUE;
 }
 
 
 /*
  * TFTP routines
  */
-static LONG send_tftp_packet(Buffer *pkt, BOOL async)
+static LONG send_tftp_packet(ULONG tftplen, const Buffer *segs, ULONG nsegs)
 {
-    Buffer *curbuf, *prevbuf;
+    ULONG  datalen = tftplen;               /* length of the UDP payload */
+    ULONG  datasum, segsum, i;
+    UBYTE *payload, *pos;
+    LONG   nbytes;
+    Buffer frame;
 
     /*
-     * Creating a new buffer for each protocol layer (UDP, IP, SLIP) and copying the buffer
-     * from the layer above each time would probably not have been very efficient back in the
-     * days of the Amiga, but nowadays it doesn't matter and allows for a cleaner design.
-     * As each function creates a new buffer and returns a pointer to it, we can delete the
-     * previous buffer once the new has been created (and ignore the memory leak when an error occurs).
+     * The TFTP header has already been written to pktbuf behind the space that is reserved
+     * for the IP and UDP headers. The payload (the data of a DATA packet) is not copied
+     * into pktbuf but SLIP-encoded directly from where it is into the frame. This way, the
+     * payload is copied only once and we don't need to allocate any memory per packet.
+     * The payload can consist of several segments, so that a block can span the buffers
+     * the file data is stored in. The UDP checksum is calculated while encoding the
+     * payload, so it is read only once as well. As the checksum is part of the headers,
+     * the payload is encoded first, leaving room for the worst case of the encoded headers
+     * at the beginning of the frame, and the headers, encoded from the template (see
+     * codec.c), are put directly in front of it afterwards.
      */
-    curbuf  = pkt;
-    prevbuf = curbuf;
-    if ((curbuf = create_udp_packet(prevbuf)) == NULL) {
-        LOG("ERROR: could not create UDP packet\n");
-        /* g_netio_errno has already been set by create_udp_packet() */
+    for (i = 0; i < nsegs; ++i)
+        datalen += segs[i].b_size;
+    if ((NETIO_HEADROOM + datalen) > g_max_buffer_size) {
+        LOG_ERROR("IP packet would exceed maximum buffer size\n");
+        g_netio_errno = ERROR_BUFFER_OVERFLOW;
         return DOSFALSE;
     }
-    delete_buffer(prevbuf);
-    prevbuf = curbuf;
-    if ((curbuf = create_ip_packet(prevbuf)) == NULL) {
-        LOG("ERROR: could not create IP packet\n");
-        /* g_netio_errno has already been set by create_ip_packet() */
+    /* SLIP-encode payload and headers and add the end-of-frame marker
+     * (the frame buffer is large enough even if every single byte needs to be escaped) */
+    payload = pos = txframe->b_addr + 2 * NETIO_HEADROOM;
+    segsum  = 0;
+    if ((nbytes = slip_encode_sum(pos, txframe->b_addr + MAX_FRAME_SIZE - 1 - pos,
+                                  pktbuf->b_addr + NETIO_HEADROOM, tftplen, &segsum)) == -1) {
+        LOG_ERROR("could not copy TFTP header to the SLIP frame\n");
+        g_netio_errno = ERROR_BUFFER_OVERFLOW;
         return DOSFALSE;
     }
-    delete_buffer(prevbuf);
-    prevbuf = curbuf;
-    if ((curbuf = create_slip_frame(prevbuf)) == NULL) {
-        LOG("ERROR: could not create SLIP frame\n");
-        /* g_netio_errno has already been set by create_slip_frame() */
+    pos    += nbytes;
+    datasum = inet_sum_add(0, segsum, 0);
+    datalen = tftplen;
+    for (i = 0; i < nsegs; ++i) {
+        segsum = 0;
+        if ((nbytes = slip_encode_sum(pos, txframe->b_addr + MAX_FRAME_SIZE - 1 - pos,
+                                      segs[i].b_addr, segs[i].b_size, &segsum)) == -1) {
+            LOG_ERROR("could not copy payload to the SLIP frame\n");
+            g_netio_errno = ERROR_BUFFER_OVERFLOW;
+            return DOSFALSE;
+        }
+        pos     += nbytes;
+        datasum  = inet_sum_add(datasum, segsum, datalen);
+        datalen += segs[i].b_size;
+    }
+    *pos++ = SLIP_END;
+
+    frame.b_addr = udpip_prepend_headers(&hdrtmpl, payload, datalen, datasum);
+    frame.b_size = pos - frame.b_addr;
+
+    if (send_slip_frame(&frame) == DOSFALSE) {
+        LOG_ERROR("error occurred while sending SLIP frame: %ld\n", g_netio_errno);
         return DOSFALSE;
     }
-    delete_buffer(prevbuf);
-    if (send_slip_frame(curbuf, async) == DOSFALSE) {
-        LOG("ERROR: error occurred while sending SLIP frame: %ld\n", g_netio_errno);
+    ++g_linkstats.ls_nframes_out;
+    g_linkstats.ls_nbytes_out   += frame.b_size;
+    g_linkstats.ls_npayload_out += datalen;
+    if (txstats) {
+        txstats->ts_nbytes_wire += frame.b_size;
+        txstats->ts_nbytes_slip += frame.b_size - NETIO_HEADROOM - datalen;
     }
-    delete_buffer(curbuf);
-    if (g_netio_errno == 0)
-        return DOSTRUE;
-    else
-        return DOSFALSE;
-
+    return DOSTRUE;
 }
 
 
-LONG send_tftp_req_packet(USHORT opcode, const char *fname)
+/*
+ * get the largest block size that fits into an IP datagram of g_max_buffer_size bytes
+ */
+ULONG netio_get_max_blksize()
 {
-    Buffer *pkt;
-    UBYTE *pos;
-
-    /*
-     * length of packet = 2 bytes for the opcode
-     *                  + length of the file name
-     *                  + terminating NUL byte
-     *                  + 8 bytes for the mode "NETASCII"
-     *                  + terminating NUL byte
-     */
-    if ((strlen(fname) + 12) > MAX_BUFFER_SIZE) {
-        LOG("ERROR: TFTP packet would exceed maximum buffer size\n");
-        g_netio_errno = ERROR_BUFFER_OVERFLOW;
-        return DOSFALSE;
-    }
-
-    /* create buffer large enough to hold the TFTP packet */
-    if ((pkt = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for TFTP packet\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return DOSFALSE;
-    }
+    ULONG blksize = g_max_buffer_size - NETIO_HEADROOM - TFTP_HDR_LEN;
 
-    pos = pkt->b_addr;
-    *((USHORT *) pos) = htons(opcode);        /* opcode */
-    pos += 2;
-    strcpy((char *) pos, fname);              /* file name */
-    pos += strlen(fname) + 1;
-    strcpy((char *) pos, "NETASCII");         /* mode */
-    pkt->b_size = strlen(fname) + 12;
-    
-    return send_tftp_packet(pkt, 1);     /* send asynchronously */
+    if (blksize > TFTP_MAX_BLKSIZE)
+        blksize = TFTP_MAX_BLKSIZE;
+    return blksize;
 }
 
 
-LONG send_tftp_data_packet(USHORT blknum, const UBYTE *bytes, LONG nbytes)
+LONG send_tftp_req_packet(USHORT opcode, const char *fname, ULONG blksize, ULONG windowsize)
 {
-    Buffer *pkt;
-    UBYTE *pos;
+    ULONG pktlen;
 
-    if ((pkt = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for TFTP packet\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
+    if ((pktlen = tftp_build_request(pktbuf->b_addr + NETIO_HEADROOM, g_max_buffer_size - NETIO_HEADROOM,
+                                     opcode, fname, blksize, windowsize)) == 0) {
+        LOG_ERROR("TFTP packet would exceed maximum buffer size\n");
+        g_netio_errno = ERROR_BUFFER_OVERFLOW;
         return DOSFALSE;
     }
-    pos = pkt->b_addr;
-    *((USHORT *) pos) = htons(OP_DATA);       /* opcode */
-    pos += 2;
-    *((USHORT *) pos) = htons(blknum);        /* block number */
-    pos += 2;
-    /* As we are called in a loop, if there are still more than TFTP_MAX_DATA_SIZE bytes
-     * in the buffer, we only send TFTP_MAX_DATA_SIZE bytes, otherwise the complete buffer */
-    if (nbytes > TFTP_MAX_DATA_SIZE)
-        nbytes = TFTP_MAX_DATA_SIZE;
-    memcpy(pos, bytes, nbytes);
-    pkt->b_size = nbytes + 4;
-
-    return send_tftp_packet(pkt, 1);     /* send asynchronously */
+    return send_tftp_packet(pktlen, NULL, 0);
 }
 
 
-LONG recv_tftp_packet()
+/*
+ * send a DATA packet, the block consists of nsegs segments (which may be 0 for an empty block)
+ */
+LONG send_tftp_data_packet(USHORT blknum, const Buffer *segs, ULONG nsegs)
 {
-    Buffer *buf;
-
-    if ((buf = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for SLIP frame\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return DOSFALSE;
-    }
-    return recv_slip_frame(buf, 1 /* receive asynchronously */);
+    tftp_put_header(pktbuf->b_addr + NETIO_HEADROOM, OP_DATA, blknum);
+    return send_tftp_packet(TFTP_HDR_LEN, segs, nsegs);
 }
 
 
+/*
+ * extract the next TFTP packet from the data taken over by netio_read_completed()
+ * The raw data is fed to the SLIP decoder until a datagram is complete, datagrams with
+ * invalid IP / UDP headers are dropped. pkt is set up as a view into the decoder's buffer
+ * (no data is copied), so it is only valid until this function is called again.
+ *
+ * returns:
+ * DOSTRUE if a packet has been extracted
+ * DOSFALSE if all data has been consumed (the read request is restarted then, so the
+ * caller has to call this function until it returns DOSFALSE)
+ */
 LONG extract_tftp_packet(Buffer *pkt)
 {
-    Buffer data, *prevbuf, *curbuf;
-
-    /* reconstruct the buffer that was allocated in recv_tftp_packet(), of course this
-     * only works when the function is called after a server reply has been read 
-     * (the IO operation initiated by recv_tftp_packet() has completed) */
-    data.b_addr = sreq->IOSer.io_Data;      /* data read from the server */
-    data.b_size = sreq->IOSer.io_Actual;    /* number of bytes read */
-    prevbuf = &data;
-    if ((curbuf = create_buffer(MAX_BUFFER_SIZE)) == NULL) {
-        LOG("ERROR: could not create buffer for IP packet\n");
-        g_netio_errno = ERROR_NO_FREE_STORE;
-        return DOSFALSE;
-    }
-    if (slip_decode_buffer(curbuf, prevbuf) == DOSFALSE) {
-        LOG("ERROR: error occured while decoding SLIP frame\n");
-        /* g_netio_errno has already been set by slip_decode_buffer() */
-        return DOSFALSE;
-    }
-    /* We call FreeVec() directly instead of delete_buffer() because of the reconstructed buffer */
-    FreeVec(prevbuf->b_addr - sizeof(Buffer));
-    prevbuf = curbuf;
-    if ((curbuf = get_data_from_ip_packet(prevbuf)) == NULL) {
-        LOG("ERROR: error occurred while extracting data from IP packet\n");
-        /* g_netio_errno has already been set by get_data_from_ip_packet() */
-        return DOSFALSE;
-    }
-    delete_buffer(prevbuf);
-    prevbuf = curbuf;
-    if ((curbuf = get_data_from_udp_packet(prevbuf)) == NULL) {
-        LOG("ERROR: error occurred while extracting data from UDP packet\n");
-        /* g_netio_errno has already been set by get_data_from_udp_packet() */
+    ULONG len, nconsumed, offset;
+    LONG  length;
+
+    if (rxcur == NULL)
         return DOSFALSE;
+    while (rxpos < rxcur->IOSer.io_Actual) {
+        len = slip_decoder_feed(&rxdec, ((UBYTE *) rxcur->IOSer.io_Data) + rxpos, rxcur->IOSer.io_Actual - rxpos,
+                                &nconsumed);
+        rxpos += nconsumed;
+        if (len == 0)
+            break;
+
+        ++g_linkstats.ls_nframes_in;
+        if ((length = udpip_parse(rxpkt->b_addr, len, &offset)) < 0) {
+            LOG_ERROR("dropping invalid datagram: %s\n", udpip_error_string(length));
+            if ((length == UDPIP_EIPSUM) || (length == UDPIP_EUDPSUM))
+                ++g_linkstats.ls_nbadsums;
+            ++g_linkstats.ls_ndropped;
+            continue;
+        }
+        /* we need at least the opcode and the block number / error code */
+        if (length < TFTP_HDR_LEN) {
+            LOG_ERROR("dropping TFTP packet that is too short (%ld bytes)\n", length);
+            ++g_linkstats.ls_ndropped;
+            continue;
+        }
+        g_linkstats.ls_npayload_in += length;
+        pkt->b_addr = rxpkt->b_addr + offset;
+        pkt->b_size = length;
+        g_netio_errno = 0;
+        return DOSTRUE;
     }
-
-    memcpy(pkt->b_addr, curbuf->b_addr, curbuf->b_size);
-    pkt->b_size = curbuf->b_size;
-    delete_buffer(prevbuf);
-    delete_buffer(curbuf);
+    start_read(rxcur);
+    rxcur = NULL;
     g_netio_errno = 0;
-    return DOSTRUE;
+    return DOSFALSE;
 }
 
 
 USHORT get_opcode(const Buffer *pkt)
 {
-    return ntohs(*((USHORT *) pkt->b_addr));
+    return tftp_get_opcode(pkt->b_addr);
 }
 
 
 USHORT get_blknum(const Buffer *pkt)
 {
-    return ntohs(*((USHORT *) (pkt->b_addr + 2)));
+    return tftp_get_blknum(pkt->b_addr);
+}
+
+
+/*
+ * get the value of a numeric option from an OACK packet
+ */
+LONG get_option(const Buffer *pkt, const char *name, ULONG *value)
+{
+    return tftp_get_option(pkt->b_addr, pkt->b_size, name, value) ? DOSTRUE : DOSFALSE;
 }
@@ -12,86 +12,21 @@
  * included files
  */
 #include <devices/serial.h>
+#include <devices/timer.h>
 #include <dos/dos.h>
 #include <dos/dosasl.h>
+#include <dos/dostags.h>
 #include <exec/io.h>
 #include <exec/types.h>
 #include <proto/alib.h>
+#include <proto/dos.h>
 #include <proto/exec.h>
+#include <proto/timer.h>
 
+#include "codec.h"
 #include "util.h"
 #include "dos.h"
-
-
-/*
- * SLIP protocol
- */
-#define SLIP_END                0xc0
-#define SLIP_ESCAPED_END        0xdc
-#define SLIP_ESC                0xdb
-#define SLIP_ESCAPED_ESC        0xdd
-
-/* IP and UDP protocol headers, adapted from FreeBSD */
-/*
- * IP
- */
-/* TODO: Do we really need to consider byte order? */
-typedef struct {
-#if BYTE_ORDER == LITTLE_ENDIAN
-    UBYTE  ip_hl:4,        /* header length */
-           ip_v:4;         /* version */
-#endif
-#if BYTE_ORDER == BIG_ENDIAN
-    UBYTE  ip_v:4,         /* version */
-           ip_hl:4;        /* header length */
-#endif
-    UBYTE  ip_tos;         /* type of service */
-    USHORT ip_len;         /* total length */
-    USHORT ip_id;          /* identification */
-    USHORT ip_off;         /* fragment offset field */
-    UBYTE  ip_ttl;         /* time to live */
-    UBYTE  ip_p;           /* protocol */
-    USHORT ip_sum;         /* checksum */
-    UBYTE  ip_src[4];      /* source address */
-    UBYTE  ip_dst[4];      /* destination address */
-} IPHeader;
-#define IP_HDR_LEN (sizeof(IPHeader))
-
-/*
- * UDP
- */
-typedef struct {
-    USHORT uh_sport;       /* source port */
-    USHORT uh_dport;       /* destination port */
-    USHORT uh_ulen;        /* datagram length */
-    USHORT uh_sum;         /* UDP checksum */
-} UDPHeader;
-#define IPPROTO_UDP 17
-#define UDP_HDR_LEN (sizeof(UDPHeader))
-
-/*
- * TFTP
- */
-#define TFTP_MAX_DATA_SIZE 512
-#define TFTP_MAX_BLK_NUM 65535
-
-/* packet types */
-#define    OP_RRQ    1            /* read request */
-#define    OP_WRQ    2            /* write request */
-#define    OP_DATA   3            /* data packet */
-#define    OP_ACK    4            /* acknowledgement */
-#define    OP_ERROR  5            /* error code */
-
-/* error codes */
-#define    EUNDEF      0        /* not defined */
-#define    ENOTFOUND   1        /* file not found */
-#define    EACCESS     2        /* access violation */
-#define    ENOSPACE    3        /* disk full or allocation exceeded */
-#define    EBADOP      4        /* illegal TFTP operation */
-#define    EBADID      5        /* unknown transfer ID */
-#define    EEXISTS     6        /* file already exists */
-#define    ENOUSER     7        /* no such user */
-#define    EOPTNEG     8        /* option negotiation failed */
+#include "stats.h"
 
 
 /*
@@ -104,32 +39,70 @@ typedef struct {
 #define S_DATA_SENT    4
 #define S_ERROR        5
 #define S_FINISHED     6
+#define S_WAITING      7        /* all buffered data has been sent, waiting for more from the client */
+
+
+/*
+ * buffer sizes
+ * In front of the TFTP packet we need room for the IP and UDP headers, and a SLIP frame
+ * can get twice as long as the IP packet (if every byte needs to be escaped) plus
+ * the end-of-frame marker.
+ */
+#define NETIO_HEADROOM UDPIP_HDR_LEN
+#define MAX_FRAME_SIZE (2 * g_max_buffer_size + 1)
+#define RX_CHUNK_SIZE  MAX_FRAME_SIZE   /* raw data read from the serial device by one request */
 
 
 #define IOExtTime timerequest   /* just to make the code look a bit nicer... */
-#define NETIO_TIMEOUT 10        /* timeout for reads and writes in seconds */
+#define NETIO_TIMEOUT 10        /* timeout for writes in seconds */
+#define INITIAL_RTO 3000000     /* retransmission timeout before the first RTT sample (in us) */
+#define MIN_RTO     200000      /* limits for the retransmission timeout (in us) */
+#define MAX_RTO     60000000
+#define MAX_RETRIES 6           /* number of retransmissions before a transfer fails */
+#define NETTASK_STACK_SIZE 8192
+#define DEFAULT_SER_UNIT    0   /* defaults for g_ser_unit, ... */
+#define DEFAULT_SER_BAUD    0   /* 0 = keep the value from the Serial preferences */
+#define DEFAULT_SER_RBUFLEN 0
+#define DEFAULT_SER_FLAGS   0
 
 
 /*
  * function prototypes
  */
-LONG netio_init(const struct DosPacket *iopkt1, const struct DosPacket *iopkt2);
+LONG nettask_start();
+void nettask_stop();
+LONG netio_init(struct MsgPort *port, const struct DosPacket *iopkt1, const struct DosPacket *iopkt2,
+                const struct DosPacket *iopkt3);
 void netio_exit();
+void netio_log_serial_stats();
+void netio_set_transfer_stats(TransferStats *stats);
 BYTE netio_get_status();
+BOOL netio_is_writing();
+void netio_start_timer(ULONG timeout);
 void netio_stop_timer();
+void netio_timer_expired();
 void netio_abort();
-LONG send_tftp_req_packet(USHORT opcode, const char *fname);
-LONG send_tftp_data_packet(USHORT blknum, const UBYTE *bytes, LONG nbytes);
-LONG recv_tftp_packet();
+ULONG netio_get_time();
+ULONG netio_get_max_blksize();
+LONG send_tftp_req_packet(USHORT opcode, const char *fname, ULONG blksize, ULONG windowsize);
+LONG send_tftp_data_packet(USHORT blknum, const Buffer *segs, ULONG nsegs);
+LONG netio_read_completed(struct Message *msg);
 LONG extract_tftp_packet(Buffer *pkt);
 USHORT get_opcode(const Buffer *pkt);
 USHORT get_blknum(const Buffer *pkt);
+LONG get_option(const Buffer *pkt, const char *name, ULONG *value);
 
 
 /*
  * external references
  */
 extern struct MsgPort   *g_port;
+extern struct MsgPort   *g_netport;        /* port of the network task */
 extern ULONG             g_netio_errno;    /* network IO error code */
+extern LinkStats         g_linkstats;      /* updated by the network task only */
+extern ULONG             g_ser_unit;       /* serial device parameters (see config.c) */
+extern ULONG             g_ser_baud;
+extern ULONG             g_ser_rbuflen;
+extern UBYTE             g_ser_flags;      /* SERF_RAD_BOOGIE / SERF_7WIRE */
 
 #endif /* CWNET_NETIO_H */
@@ -0,0 +1,586 @@
+/*
+ * nettask.c - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *             over a serial link (using SLIP)
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+#include "netio.h"
+
+
+/*
+ * The network task owns the serial and the timer device and runs the TFTP protocol for
+ * the transfer in progress, so that servicing the serial link and the timer is never
+ * delayed by DOS packets (it also runs at a higher priority than the handler). The
+ * handler talks to it only via messages (see NetMsg in dos.h), which are returned once
+ * they have been dealt with:
+ * - ACTION_NET_WRQ starts a new transfer, it is returned when the server has answered
+ *   the write request (with the negotiated block and window size)
+ * - ACTION_NET_DATA hands over a block, it is returned when the server has acknowledged
+ *   the block (blocks are returned in the order of their numbers)
+ * - ACTION_NET_ABORT terminates the transfer in progress
+ * If the transfer fails, all messages held by the task are returned with DOSFALSE and the
+ * error code in dp_Res2. If the task doesn't hold any message at this time, the error is
+ * reported with the next one.
+ * The only data shared otherwise are the statistics (see stats.h), which the task updates
+ * directly in the FileTransfer structure and in g_linkstats (they are only read by the
+ * handler).
+ */
+struct MsgPort         *g_netport = NULL;
+static struct Process  *nettask;
+static struct Task     *parent;         /* handler process, signalled when the task has started / stopped */
+
+/* state of the transfer in progress */
+static ULONG        state;              /* S_READY, S_WRQ_SENT, S_DATA_SENT or S_ERROR */
+static LONG         error;              /* error code if state is S_ERROR */
+static NetMsg      *wrqmsg;             /* write request that has not yet been answered */
+static struct List  blocks;             /* blocks not yet acknowledged (in the order of their numbers) */
+static NetMsg      *nextblk;            /* next block to be sent */
+static ULONG        blknum;             /* number of the last block sent */
+static ULONG        maxblknum;          /* highest block number sent so far (blocks may be resent) */
+static ULONG        lastack;            /* number of the last block acknowledged by the server */
+static ULONG        windowsize;
+static ULONG        srtt, rttvar;       /* smoothed round-trip time and its variation (in us, 0 = no sample yet) */
+static ULONG        rto;                /* retransmission timeout (in us) */
+static ULONG        read_start;         /* time we started waiting for the answer from the server */
+static ULONG        nretries;           /* number of retransmissions of the current window */
+static TransferStats *stats;            /* statistics of the transfer */
+
+#define END_OF_BLOCKS ((NetMsg *) &blocks.lh_Tail)
+
+
+static void reply_net_msg(NetMsg *nm, LONG res1, LONG res2)
+{
+    nm->nm_sp.sp_Pkt.dp_Res1 = res1;
+    nm->nm_sp.sp_Pkt.dp_Res2 = res2;
+    ReplyMsg(&(nm->nm_sp.sp_Msg));
+}
+
+
+/*
+ * terminate the transfer in progress and return all messages we hold
+ */
+static void fail_transfer(LONG err)
+{
+    NetMsg *nm;
+
+    netio_abort();
+    if (wrqmsg) {
+        reply_net_msg(wrqmsg, DOSFALSE, err);
+        wrqmsg = NULL;
+    }
+    while ((nm = (NetMsg *) RemHead(&blocks)))
+        reply_net_msg(nm, DOSFALSE, err);
+    nextblk = END_OF_BLOCKS;
+    state   = S_ERROR;
+    error   = err;
+}
+
+
+/*
+ * go back to the block following the last acknowledged one, the next block sent is
+ * this one
+ */
+static void rewind_window()
+{
+    if (blknum != lastack)
+        LOG_DEBUG("server has not received all blocks - resending from block #%ld\n", lastack + 1);
+    blknum  = lastack;
+    nextblk = (NetMsg *) blocks.lh_Head;
+}
+
+
+/*
+ * check if we're waiting for an answer from the server
+ */
+static BOOL is_waiting_for_answer()
+{
+    return (state == S_WRQ_SENT) || ((state == S_DATA_SENT) && (blknum != lastack));
+}
+
+
+/*
+ * count a packet that has been sent
+ */
+static void count_packet(BOOL retransmitted)
+{
+    ++stats->ts_npackets;
+    if (retransmitted) {
+        ++stats->ts_nretransmits;
+        ++g_linkstats.ls_nretransmits;
+    }
+}
+
+
+/*
+ * send the write request or the next block of the window, unless a write is still in
+ * progress - returns 1 if a packet has been sent
+ */
+static BOOL send_next_packet()
+{
+    NetMsg *nm;
+
+    if (netio_is_writing())
+        return 0;
+    if ((state == S_READY) && wrqmsg) {
+        if (send_tftp_req_packet(OP_WRQ, (const char *) wrqmsg->nm_sp.sp_Pkt.dp_Arg2,
+                                 netio_get_max_blksize(), MAX_WINDOW_SIZE) == DOSFALSE) {
+            LOG_ERROR("sending write request to server failed\n");
+            fail_transfer(g_netio_errno);
+            return 0;
+        }
+        LOG_DEBUG("sent write request for file '%s' to server\n", (const char *) wrqmsg->nm_sp.sp_Pkt.dp_Arg2);
+        state = S_WRQ_SENT;
+        count_packet(nretries > 0);
+        return 1;
+    }
+    if ((state == S_DATA_SENT) && (nextblk != END_OF_BLOCKS) && (nextblk->nm_blknum - lastack <= windowsize)) {
+        nm = nextblk;
+        if (send_tftp_data_packet(nm->nm_blknum, nm->nm_blk.blk_segs, nm->nm_blk.blk_nsegs) == DOSFALSE) {
+            LOG_ERROR("sending data packet #%ld to server failed\n", nm->nm_blknum);
+            fail_transfer(g_netio_errno);
+            return 0;
+        }
+        LOG_DEBUG("sent data packet #%ld to server\n", nm->nm_blknum);
+        count_packet(nm->nm_blknum <= maxblknum);
+        blknum = nm->nm_blknum;
+        if (blknum > maxblknum)
+            maxblknum = blknum;
+        nextblk = (NetMsg *) nm->nm_sp.sp_Msg.mn_Node.ln_Succ;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * keep on sending, or wait for the answer from the server if there is nothing to send
+ */
+static void continue_sending()
+{
+    if (!send_next_packet() && is_waiting_for_answer()) {
+        LOG_DEBUG("waiting for answer from server\n");
+        read_start = netio_get_time();
+        netio_start_timer(rto);
+    }
+}
+
+
+/*
+ * update the round-trip time estimation and the retransmission timeout after an answer
+ * has been received from the server (RFC 6298)
+ * Following Karn's algorithm, answers to retransmitted packets are not used because we
+ * can't tell which transmission they belong to. The backed-off timeout is kept until
+ * there is a valid sample again.
+ */
+static void update_rto()
+{
+    ULONG rtt, delta;
+
+    if (nretries > 0) {
+        nretries = 0;
+        return;
+    }
+    /* an answer that arrives while we're still sending can't be used either */
+    if (netio_is_writing())
+        return;
+
+    rtt = netio_get_time() - read_start;
+    if (srtt == 0) {
+        srtt   = rtt;
+        rttvar = rtt / 2;
+    }
+    else {
+        delta  = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+        rttvar = (3 * rttvar + delta) / 4;
+        srtt   = (7 * srtt + rtt) / 8;
+    }
+    ++stats->ts_nrtt_samples;
+    stats->ts_rtt_sum += rtt / 1000;
+    stats->ts_srtt     = srtt;
+    rto = srtt + 4 * rttvar;
+    if (rto < MIN_RTO)
+        rto = MIN_RTO;
+    else if (rto > MAX_RTO)
+        rto = MAX_RTO;
+    LOG_DEBUG("RTT = %ld ms, SRTT = %ld ms, RTO = %ld ms\n", rtt / 1000, srtt / 1000, rto / 1000);
+}
+
+
+/*
+ * the server has answered the write request => start sending the blocks
+ */
+static void accept_write_request(ULONG blksize, ULONG wsize)
+{
+    update_rto();
+    wrqmsg->nm_blksize    = blksize;
+    wrqmsg->nm_windowsize = wsize;
+    reply_net_msg(wrqmsg, DOSTRUE, 0);
+    wrqmsg     = NULL;
+    windowsize = wsize;
+    state      = S_DATA_SENT;
+    rewind_window();
+}
+
+
+/*
+ * return the acknowledged blocks to the handler
+ */
+static void ack_blocks(ULONG nblocks)
+{
+    NetMsg *nm;
+
+    while (nblocks-- > 0) {
+        nm = (NetMsg *) RemHead(&blocks);
+        lastack = nm->nm_blknum;
+        reply_net_msg(nm, DOSTRUE, 0);
+    }
+}
+
+
+/*
+ * handle a packet received from the server - returns 1 if we can continue sending
+ */
+static BOOL handle_answer(const Buffer *tftppkt)
+{
+    ULONG nacked, blksize, wsize;
+
+    switch (get_opcode(tftppkt)) {
+        case OP_ACK:
+            if (state == S_WRQ_SENT) {
+                /* server does not support options (RFC 2347) => use default block size */
+                LOG_DEBUG("ACK received for sent write request\n");
+                accept_write_request(TFTP_DEFAULT_BLKSIZE, 1);
+                return 1;
+            }
+            else if (state == S_DATA_SENT) {
+                /* ACKs are cumulative, so an ACK for any block in the window acknowledges
+                 * all blocks up to it (block numbers wrap around after 65535) */
+                nacked = (USHORT) (get_blknum(tftppkt) - (USHORT) lastack);
+                if ((nacked == 0) || (nacked >= 0x8000)) {
+                    /* Duplicate or old ACKs (e.g. for a window we retransmitted although
+                     * it had arrived) are ignored, otherwise every duplicate would
+                     * trigger another retransmission (Sorcerer's Apprentice Syndrome). Lost
+                     * blocks are retransmitted when the timeout expires. */
+                    LOG_DEBUG("ignoring duplicate ACK for data packet #%ld\n", (ULONG) get_blknum(tftppkt));
+                    return 0;
+                }
+                else if (nacked <= maxblknum - lastack) {
+                    /* the next window starts after the acknowledged block, even if we
+                     * have already sent more blocks (RFC 7440) - blocks sent before we
+                     * went back may be acknowledged as well */
+                    LOG_DEBUG("ACK received for data packet #%ld\n", lastack + nacked);
+                    update_rto();
+                    ack_blocks(nacked);
+                    rewind_window();
+                    return 1;
+                }
+                else {
+                    LOG_ERROR("ACK with unexpected block number %ld received - terminating\n", (ULONG) get_blknum(tftppkt));
+                    fail_transfer(ERROR_TFTP_WRONG_BLOCK_NUM);
+                    return 0;
+                }
+            }
+            else {
+                LOG_DEBUG("ignoring ACK for data packet #%ld\n", (ULONG) get_blknum(tftppkt));
+                return 0;
+            }
+
+        case OP_OACK:
+            if (state == S_WRQ_SENT) {
+                /* server may only lower the values we requested, if it doesn't
+                 * acknowledge an option at all, the default value is used */
+                if (get_option(tftppkt, "blksize", &blksize) == DOSFALSE)
+                    blksize = TFTP_DEFAULT_BLKSIZE;
+                if (get_option(tftppkt, "windowsize", &wsize) == DOSFALSE)
+                    wsize = 1;
+                if ((blksize < TFTP_MIN_BLKSIZE) || (blksize > netio_get_max_blksize())
+                    || (wsize < 1) || (wsize > MAX_WINDOW_SIZE)) {
+                    LOG_ERROR("server acknowledged invalid block size %ld / window size %ld - terminating\n",
+                        blksize, wsize);
+                    fail_transfer(ERROR_TFTP_OPTION_NEGOTIATION);
+                    return 0;
+                }
+                LOG_DEBUG("OACK received for sent write request - using block size %ld, window size %ld\n",
+                    blksize, wsize);
+                accept_write_request(blksize, wsize);
+                return 1;
+            }
+            else {
+                /* answer to a retransmitted write request => ignore it */
+                LOG_DEBUG("ignoring duplicate OACK\n");
+                return 0;
+            }
+
+        case OP_ERROR:
+            LOG_ERROR("OP_ERROR received from server\n");
+            /* TODO: map TFTP error codes to AmigaDOS or custom error codes */
+            fail_transfer(ERROR_TFTP_GENERIC_ERROR);
+            return 0;
+
+        default:
+            LOG_ERROR("unknown opcode received from server\n");
+            fail_transfer(ERROR_TFTP_UNKNOWN_OPCODE);
+            return 0;
+    } /* end opcode switch */
+}
+
+
+/*
+ * start a new transfer (ACTION_NET_WRQ)
+ */
+static void start_transfer(NetMsg *nm)
+{
+    LOG_DEBUG("starting transfer of file '%s'\n", (const char *) nm->nm_sp.sp_Pkt.dp_Arg2);
+    wrqmsg     = nm;
+    stats      = &((FileTransfer *) nm->nm_sp.sp_Pkt.dp_Arg1)->ftx_stats;
+    netio_set_transfer_stats(stats);
+    state      = S_READY;
+    error      = 0;
+    blknum     = 0;
+    maxblknum  = 0;
+    lastack    = 0;
+    windowsize = 1;
+    srtt       = 0;
+    rttvar     = 0;
+    rto        = INITIAL_RTO;
+    nretries   = 0;
+    nextblk    = END_OF_BLOCKS;
+    /* if a write of the last transfer is still in progress, the write request is sent
+     * once it has completed */
+    continue_sending();
+}
+
+
+/*
+ * add a block to the window (ACTION_NET_DATA)
+ */
+static void add_block(NetMsg *nm)
+{
+    if (state != S_DATA_SENT) {
+        /* transfer has already failed (or has never been started) */
+        reply_net_msg(nm, DOSFALSE, error ? error : ERROR_ACTION_NOT_KNOWN);
+        return;
+    }
+    AddTail(&blocks, (struct Node *) nm);
+    if (nextblk == END_OF_BLOCKS)
+        nextblk = nm;
+    /* if we're waiting for the answer, the block is sent right away if it's part of the
+     * window (the timer is restarted after it has been sent) */
+    if (!netio_is_writing() && (nextblk == nm))
+        continue_sending();
+}
+
+
+/*
+ * handle the completion of a write
+ */
+static void do_write_return()
+{
+    BYTE status;
+
+    /* There is a race condition here: As the timer is still running when we
+     * receive the IO completion message, it could expire before we can stop it */
+    netio_stop_timer();
+    status = netio_get_status();
+    if (status == -1) {
+        LOG_CRITICAL("IO operation has not been completed although IO completion message was received\n");
+        fail_transfer(g_netio_errno);
+        return;
+    }
+    else if (status > 0) {
+        LOG_ERROR("sending write request / data to server failed with error %ld\n", status);
+        fail_transfer(status);
+        return;
+    }
+    /* Keep on sending as long as the window is not full. The server may have answered
+     * while we were sending, so all blocks may have been acknowledged already. */
+    continue_sending();
+}
+
+
+/*
+ * handle the completion of a read
+ * The data may contain any number of packets (or only part of one), and it may arrive
+ * while we're still sending.
+ */
+static void do_read_return(struct Message *msg)
+{
+    Buffer  tftppkt;            /* view of the received TFTP packet */
+    BOOL    progress = 0;
+
+    if (netio_read_completed(msg) == DOSFALSE)
+        return;
+
+    /* extract TFTP packets from received data (tftppkt is only a view into the receive
+     * buffer) - if a packet is not yet complete, the rest is decoded with the next read */
+    while (extract_tftp_packet(&tftppkt) == DOSTRUE) {
+#if DEBUG
+        LOG_DEBUG("dump of received packet (%ld bytes):\n", tftppkt.b_size);
+        dump_buffer(&tftppkt);
+#endif
+        if ((state != S_WRQ_SENT) && (state != S_DATA_SENT)) {
+            LOG_DEBUG("ignoring packet received while no transfer is in progress\n");
+            continue;
+        }
+        if (handle_answer(&tftppkt))
+            progress = 1;
+    }
+    /* if we're still sending, we continue when the write has completed */
+    if (progress && !netio_is_writing()) {
+        netio_stop_timer();
+        continue_sending();
+    }
+}
+
+
+/*
+ * handle the expiry of the timer
+ * If the server doesn't answer in time, we assume that the last packet or window (or the
+ * answer) got lost and retransmit it with an exponentially increasing timeout. Only if
+ * this fails MAX_RETRIES times or if a write to the serial device hangs, the transfer
+ * fails.
+ */
+static void do_timer_expired()
+{
+    netio_timer_expired();
+    if (!netio_is_writing() && !is_waiting_for_answer())
+        return;
+    ++stats->ts_ntimeouts;
+    ++g_linkstats.ls_ntimeouts;
+    if (netio_is_writing() || (nretries >= MAX_RETRIES)) {
+        LOG_ERROR("timeout occured during IO operation\n");
+        fail_transfer(ERROR_IO_TIMEOUT);
+        return;
+    }
+
+    ++nretries;
+    rto *= 2;
+    if (rto > MAX_RTO)
+        rto = MAX_RTO;
+    LOG_INFO("no answer from server - retransmitting (attempt %ld, timeout now %ld ms)\n", nretries, rto / 1000);
+    if (state == S_WRQ_SENT)
+        state = S_READY;
+    else
+        rewind_window();
+    continue_sending();
+}
+
+
+/*
+ * main function of the network task
+ */
+static void net_task()
+{
+    struct MsgPort          *port;
+    struct Message          *msg;
+    struct DosPacket        *pkt, iopkt1, iopkt2, iopkt3;
+    ULONG                    signals;
+
+    if ((port = CreateMsgPort()) == NULL) {
+        LOG_CRITICAL("could not create message port for the network task\n");
+        goto ERROR_NO_PORT;
+    }
+    iopkt1.dp_Type = ACTION_WRITE_RETURN;
+    iopkt2.dp_Type = ACTION_TIMER_EXPIRED;
+    iopkt3.dp_Type = ACTION_READ_RETURN;
+    if (netio_init(port, &iopkt1, &iopkt2, &iopkt3) == DOSFALSE) {
+        LOG_CRITICAL("could not initialize the network IO module\n");
+        goto ERROR_NO_NETIO;
+    }
+    NewList(&blocks);
+    wrqmsg  = NULL;
+    nextblk = END_OF_BLOCKS;
+    state   = S_READY;
+    error   = 0;
+
+    /* tell the handler that we're running */
+    g_netport = port;
+    Signal(parent, SIGBREAKF_CTRL_F);
+
+    /*
+     * Both the IO completion messages and the messages from the handler are received at
+     * our port. IO requests point to a DOS packet with the type of the completion in
+     * ln_Name, messages from the handler are DOS packets themselves.
+     */
+    while (1) {
+        signals = Wait((1L << port->mp_SigBit) | SIGBREAKF_CTRL_C);
+        if (signals & SIGBREAKF_CTRL_C)
+            break;
+        while ((msg = GetMsg(port))) {
+            pkt = (struct DosPacket *) msg->mn_Node.ln_Name;
+            switch (pkt->dp_Type) {
+                case ACTION_WRITE_RETURN:
+                    do_write_return();
+                    break;
+
+                case ACTION_READ_RETURN:
+                    do_read_return(msg);
+                    break;
+
+                case ACTION_TIMER_EXPIRED:
+                    do_timer_expired();
+                    break;
+
+                case ACTION_NET_WRQ:
+                    start_transfer((NetMsg *) msg);
+                    break;
+
+                case ACTION_NET_DATA:
+                    add_block((NetMsg *) msg);
+                    break;
+
+                case ACTION_NET_ABORT:
+                    LOG_DEBUG("transfer has been aborted by the handler\n");
+                    fail_transfer(pkt->dp_Arg2);
+                    reply_net_msg((NetMsg *) msg, DOSTRUE, 0);
+                    break;
+
+                default:
+                    LOG_ERROR("network task received message of unknown type %ld\n", pkt->dp_Type);
+            }
+        }
+    }
+
+    /* abort ongoing IO operation (the reads are stopped in netio_exit()) */
+    netio_abort();
+    netio_exit();
+    g_netport = NULL;
+ERROR_NO_NETIO:
+    DeleteMsgPort(port);
+ERROR_NO_PORT:
+    /* The handler may unload our code as soon as it has been signalled, so we must not
+     * be rescheduled in between. The task ends with Forbid() still in effect. */
+    Forbid();
+    Signal(parent, SIGBREAKF_CTRL_F);
+}
+
+
+/*
+ * start the network task and wait until it has initialized the network IO module
+ */
+LONG nettask_start()
+{
+    parent = FindTask(NULL);
+    if ((nettask = CreateNewProcTags(NP_Entry, (ULONG) net_task,
+                                     NP_Name, (ULONG) "CWNet network task",
+                                     NP_Priority, parent->tc_Node.ln_Pri + 1,
+                                     NP_StackSize, NETTASK_STACK_SIZE,
+                                     TAG_DONE)) == NULL) {
+        LOG_CRITICAL("could not create the network task\n");
+        return DOSFALSE;
+    }
+    Wait(SIGBREAKF_CTRL_F);
+    return (g_netport != NULL) ? DOSTRUE : DOSFALSE;
+}
+
+
+/*
+ * stop the network task (messages it still holds are not returned anymore)
+ */
+void nettask_stop()
+{
+    Signal((struct Task *) nettask, SIGBREAKF_CTRL_C);
+    Wait(SIGBREAKF_CTRL_F);
+}
@@ -0,0 +1,104 @@
+#ifndef CWNET_STATS_H
+#define CWNET_STATS_H
+/*
+ * stats.h - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *           over a serial link (using SLIP)
+ *
+ * Statistics of the file transfers and the serial link, shared by the handler and the
+ * tools that query it (listq)
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#include <dos/dos.h>
+#include <exec/types.h>
+
+
+/*
+ * custom action for querying the statistics
+ * dp_Arg1 = lock (BPTR) that selects the statistics:
+ *           lock on a file          => TransferStats of its transfer
+ *           lock on the root dir    => QueueStats of the queue
+ *           0                       => LinkStats of the serial link
+ * dp_Arg2 = buffer for the structure
+ * dp_Arg3 = size of this buffer (only that many bytes are copied, so that older tools
+ *           still work if fields are added at the end)
+ */
+#define ACTION_GET_STATS 5010
+
+
+/*
+ * statistics of a file transfer
+ * The counters are updated by the handler and the network task while the transfer is in
+ * progress, the time stamps are zero as long as the event hasn't happened.
+ */
+typedef struct {
+    struct DateStamp ts_queued;         /* file has been opened by the client */
+    struct DateStamp ts_started;        /* write request has been sent */
+    struct DateStamp ts_finished;       /* transfer has finished or failed */
+    ULONG   ts_nbytes_written;          /* bytes written by the client */
+    ULONG   ts_nbytes_acked;            /* bytes acknowledged by the server */
+    ULONG   ts_npackets;                /* packets sent (write requests and blocks) ... */
+    ULONG   ts_nretransmits;            /* ... thereof retransmissions */
+    ULONG   ts_ntimeouts;               /* number of times the server didn't answer in time */
+    ULONG   ts_nrtt_samples;            /* number and sum of the round-trip time samples */
+    ULONG   ts_rtt_sum;                 /* (in ms) */
+    ULONG   ts_srtt;                    /* current smoothed round-trip time (in us) */
+    ULONG   ts_nbytes_wire;             /* bytes sent over the serial link (SLIP frames) ... */
+    ULONG   ts_nbytes_slip;             /* ... thereof added by the SLIP encoding */
+    ULONG   ts_nbytes_queued;           /* bytes held by the handler and not yet acknowledged */
+} TransferStats;
+
+
+/*
+ * statistics of the queue (since the handler has been started) - completed transfers
+ * are removed from the queue after a while (see dos.c), their statistics are only
+ * kept as part of the totals below
+ */
+typedef struct {
+    ULONG   qs_nfinished;               /* transfers finished / failed */
+    ULONG   qs_nfailed;
+    ULONG   qs_nretained;               /* completed transfers still in the queue ... */
+    ULONG   qs_nremoved;                /* ... and the ones that have been removed */
+    ULONG   qs_nbytes_acked;            /* totals of all completed transfers */
+    ULONG   qs_nretransmits;
+    ULONG   qs_ntimeouts;
+    ULONG   qs_nbytes_queued;           /* bytes held by the handler in all transfers */
+} QueueStats;
+
+
+/*
+ * statistics of the serial link (since the handler has been started)
+ */
+typedef struct {
+    ULONG   ls_nframes_out;             /* SLIP frames sent / received */
+    ULONG   ls_nframes_in;
+    ULONG   ls_nbytes_out;              /* bytes written to / read from the serial device */
+    ULONG   ls_nbytes_in;
+    ULONG   ls_npayload_out;            /* bytes of UDP payload (the TFTP packets) in the frames */
+    ULONG   ls_npayload_in;
+    ULONG   ls_nretransmits;            /* packets sent more than once */
+    ULONG   ls_ntimeouts;               /* number of times the server didn't answer in time */
+    ULONG   ls_ndropped;                /* received frames dropped because they were invalid */
+    ULONG   ls_noverruns;               /* overruns reported by the serial device */
+    ULONG   ls_nrxerrors;               /* other errors while reading */
+    ULONG   ls_baud;                    /* baud rate of the serial device */
+    ULONG   ls_nbadsums;                /* received frames dropped because of a wrong checksum */
+    ULONG   ls_nreads;                  /* successful read requests (ls_nbytes_in / ls_nreads is
+                                           the average number of bytes per read) */
+} LinkStats;
+
+
+/* number of ticks since some point in time, the difference of two values is correct
+ * as long as the time stamps are less than about 994 days apart */
+#define DS_TICKS(ds) ((((ULONG) (ds)->ds_Days * 1440 + (ds)->ds_Minute) * 60 * TICKS_PER_SECOND) + (ds)->ds_Tick)
+
+/* average number of bytes per second transferred in the given number of ticks */
+#define BYTES_PER_SEC(nbytes, ticks) \
+    ((ticks) ? (nbytes) / (ticks) * TICKS_PER_SECOND + (nbytes) % (ticks) * TICKS_PER_SECOND / (ticks) : 0)
+
+#endif /* CWNET_STATS_H */
@@ -0,0 +1,416 @@
+/*
+ * test_codec.c - part of CWNet, an AmigaDOS handler that allows uploading files to a TFTP server
+ *                over a serial link (using SLIP)
+ *                unit tests for the protocol core in codec.c, runs on the Unix side
+ *                ("make test")
+ *
+ * Copyright(C) 2017, 2018 Constantin Wiemer
+ */
+
+
+/*
+ * included files
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+
+/*
+ * global constants
+ */
+#define MAX_DGRAM_SIZE 1500             /* size of the datagrams built by the tests */
+
+
+/*
+ * helper functions
+ */
+static ULONG ntests = 0, nfailed = 0;
+
+#define CHECK(cond, ...) do {                                   \
+    ++ntests;                                                   \
+    if (!(cond)) {                                              \
+        ++nfailed;                                              \
+        printf("FAILED (%s:%d): ", __FILE__, __LINE__);         \
+        printf(__VA_ARGS__);                                    \
+        printf("\n");                                           \
+    }                                                           \
+} while (0)
+
+
+static const UBYTE srcaddr[4] = {192, 168, 0, 219};    /* contains SLIP_END and SLIP_ESC */
+static const UBYTE dstaddr[4] = {10, 0, 0, 1};
+
+
+/* Internet checksum over bytes in network byte order, independent of codec.c */
+static USHORT ref_cksum(const UBYTE *bytes, ULONG len, ULONG sum)
+{
+    ULONG i;
+
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (bytes[i] << 8) | bytes[i + 1];
+    if (len & 1)
+        sum += bytes[len - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (USHORT) ~sum;
+}
+
+
+/* put the IP checksum into an IP header that has been modified */
+static void fix_ipsum(UBYTE *dgram)
+{
+    PUT_WORD(dgram + IPH_SUM, 0);
+    PUT_WORD(dgram + IPH_SUM, ref_cksum(dgram, IP_HDR_LEN, 0));
+}
+
+
+/* build the (unencoded) headers for a datagram field by field */
+static void ref_headers(UBYTE *hdrs, USHORT id, const UBYTE *payload, ULONG len)
+{
+    UBYTE *udphdr = hdrs + IP_HDR_LEN;
+    ULONG  pseudo;
+    USHORT udpsum;
+
+    memset(hdrs, 0, UDPIP_HDR_LEN);
+    hdrs[IPH_VHL] = 0x45;
+    PUT_WORD(hdrs + IPH_LEN, UDPIP_HDR_LEN + len);
+    PUT_WORD(hdrs + IPH_ID, id);
+    hdrs[IPH_TTL] = 255;
+    hdrs[IPH_P]   = IP_PROTO_UDP;
+    memcpy(hdrs + IPH_SRC, srcaddr, 4);
+    memcpy(hdrs + IPH_DST, dstaddr, 4);
+    fix_ipsum(hdrs);
+
+    PUT_WORD(udphdr + UH_SPORT, 4711);
+    PUT_WORD(udphdr + UH_DPORT, 69);
+    PUT_WORD(udphdr + UH_ULEN, UDP_HDR_LEN + len);
+    pseudo = (srcaddr[0] << 8 | srcaddr[1]) + (srcaddr[2] << 8 | srcaddr[3])
+           + (dstaddr[0] << 8 | dstaddr[1]) + (dstaddr[2] << 8 | dstaddr[3])
+           + IP_PROTO_UDP + UDP_HDR_LEN + len;
+    /* the payload follows the UDP header, whose length is even */
+    pseudo += (USHORT) ~ref_cksum(udphdr, UDP_HDR_LEN, 0);
+    udpsum  = ref_cksum(payload, len, pseudo);
+    PUT_WORD(udphdr + UH_SUM, udpsum ? udpsum : 0xffff);
+}
+
+
+/* build a valid datagram with the given payload the way netio.c does it and decode it
+ * again, returns the length of the datagram */
+static ULONG make_dgram(UdpIpTemplate *tmpl, UBYTE *dgram, const UBYTE *payload, ULONG len)
+{
+    static UBYTE frame[2 * MAX_DGRAM_SIZE + 1];
+    UBYTE       *start;
+    ULONG        sum = 0;
+    LONG         n;
+
+    n = slip_encode_sum(frame + 2 * UDPIP_HDR_LEN, sizeof(frame) - 2 * UDPIP_HDR_LEN, payload, len, &sum);
+    start = udpip_prepend_headers(tmpl, frame + 2 * UDPIP_HDR_LEN, len, inet_sum_add(0, sum, 0));
+    return slip_decode(dgram, MAX_DGRAM_SIZE, start, frame + 2 * UDPIP_HDR_LEN + n - start);
+}
+
+
+/*
+ * tests
+ */
+static void test_udpip_encode_headers()
+{
+    UdpIpTemplate tmpl;
+    UBYTE         payload[600], hdrs[UDPIP_HDR_LEN], ref[2 * UDPIP_HDR_LEN], enc[2 * UDPIP_HDR_LEN], *end;
+    ULONG         i, j, len, sum;
+    LONG          reflen;
+
+    udpip_init_template(&tmpl, srcaddr, dstaddr, 4711, 69);
+    srand(4711);
+    for (i = 0; i < 70000; ++i) {
+        /* the IDs run through all values, so that every byte value shows up in the ID field */
+        len = rand() % sizeof(payload);
+        for (j = 0; j < len; ++j)
+            payload[j] = rand();
+        ref_headers(hdrs, (USHORT) i, payload, len);
+        reflen = slip_encode(ref, sizeof(ref), hdrs, UDPIP_HDR_LEN);
+        sum    = inet_sum(payload, len, 0);
+        end    = udpip_encode_headers(&tmpl, enc, len, sum);
+        if ((end - enc != reflen) || (memcmp(enc, ref, reflen) != 0)) {
+            CHECK(0, "headers differ from reference for ID %lu, %lu bytes of payload", (unsigned long) i, (unsigned long) len);
+            return;
+        }
+    }
+    CHECK(1, "headers match reference");
+}
+
+
+static void test_udpip_parse()
+{
+    static const UBYTE payload[] = {0, OP_ACK, 0, 1};
+    UdpIpTemplate tmpl;
+    UBYTE         dgram[MAX_DGRAM_SIZE], bad[MAX_DGRAM_SIZE];
+    ULONG         len, offset;
+    LONG          res;
+
+    udpip_init_template(&tmpl, srcaddr, dstaddr, 4711, 69);
+    len = make_dgram(&tmpl, dgram, payload, sizeof(payload));
+    res = udpip_parse(dgram, len, &offset);
+    CHECK(res == sizeof(payload), "valid datagram: result %ld", (long) res);
+    CHECK(offset == UDPIP_HDR_LEN, "valid datagram: offset %lu", (unsigned long) offset);
+    CHECK(memcmp(dgram + offset, payload, sizeof(payload)) == 0, "valid datagram: payload differs");
+
+    /* short datagram */
+    res = udpip_parse(dgram, IP_HDR_LEN - 1, &offset);
+    CHECK(res == UDPIP_ESHORT, "short datagram: result %ld", (long) res);
+    res = udpip_parse(dgram, 0, &offset);
+    CHECK(res == UDPIP_ESHORT, "empty datagram: result %ld", (long) res);
+
+    /* bad IP header */
+    memcpy(bad, dgram, len);
+    bad[IPH_VHL] = 0x65;
+    fix_ipsum(bad);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EHEADER, "IP version 6: result %ld", (long) res);
+    memcpy(bad, dgram, len);
+    bad[IPH_VHL] = 0x44;
+    fix_ipsum(bad);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EHEADER, "IP header length 16: result %ld", (long) res);
+    res = udpip_parse(dgram, len - 1, &offset);
+    CHECK(res == UDPIP_EHEADER, "truncated datagram: result %ld", (long) res);
+    memcpy(bad, dgram, len);
+    PUT_WORD(bad + IPH_LEN, IP_HDR_LEN + UDP_HDR_LEN - 1);
+    fix_ipsum(bad);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EHEADER, "IP length too small for UDP header: result %ld", (long) res);
+
+    /* bad IP checksum */
+    memcpy(bad, dgram, len);
+    --bad[IPH_TTL];
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EIPSUM, "IP header modified: result %ld", (long) res);
+
+    /* wrong protocol */
+    memcpy(bad, dgram, len);
+    bad[IPH_P] = 6;
+    fix_ipsum(bad);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EPROTO, "TCP datagram: result %ld", (long) res);
+
+    /* bad UDP header */
+    memcpy(bad, dgram, len);
+    PUT_WORD(bad + IP_HDR_LEN + UH_ULEN, UDP_HDR_LEN - 1);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EUDPHDR, "UDP length too small: result %ld", (long) res);
+    memcpy(bad, dgram, len);
+    PUT_WORD(bad + IP_HDR_LEN + UH_ULEN, len - IP_HDR_LEN + 1);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EUDPHDR, "UDP length exceeds IP length: result %ld", (long) res);
+
+    /* bad UDP checksum */
+    memcpy(bad, dgram, len);
+    bad[len - 1] ^= 0x01;
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EUDPSUM, "payload modified: result %ld", (long) res);
+    memcpy(bad, dgram, len);
+    ++bad[IPH_SRC + 3];
+    fix_ipsum(bad);
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == UDPIP_EUDPSUM, "source address (pseudo header) modified: result %ld", (long) res);
+
+    /* no UDP checksum at all is fine */
+    bad[IP_HDR_LEN + UH_SUM] = bad[IP_HDR_LEN + UH_SUM + 1] = 0;
+    res = udpip_parse(bad, len, &offset);
+    CHECK(res == sizeof(payload), "datagram without UDP checksum: result %ld", (long) res);
+}
+
+
+static void test_tftp_build_request()
+{
+    static const UBYTE full[] = "\0\2foo.txt\0NETASCII\0blksize\0" "1428\0windowsize\0" "8";
+    static const UBYTE plain[] = "\0\2foo.txt\0NETASCII";
+    UBYTE              buf[128];
+    ULONG              len;
+
+    len = tftp_build_request(buf, sizeof(buf), OP_WRQ, "foo.txt", 1428, 8);
+    CHECK((len == sizeof(full)) && (memcmp(buf, full, len) == 0), "request with options: length %lu", (unsigned long) len);
+    len = tftp_build_request(buf, sizeof(buf), OP_WRQ, "foo.txt", 0, 0);
+    CHECK((len == sizeof(plain)) && (memcmp(buf, plain, len) == 0), "request without options: length %lu", (unsigned long) len);
+    len = tftp_build_request(buf, sizeof(full), OP_WRQ, "foo.txt", 1428, 8);
+    CHECK(len == sizeof(full), "request that just fits: length %lu", (unsigned long) len);
+    len = tftp_build_request(buf, sizeof(full) - 1, OP_WRQ, "foo.txt", 1428, 8);
+    CHECK(len == 0, "request that doesn't fit: length %lu", (unsigned long) len);
+    len = tftp_build_request(buf, sizeof(buf), OP_WRQ, "foo.txt", 4294967295UL, 0);
+    CHECK((len > 10) && (memcmp(buf + len - 11, "4294967295", 11) == 0), "largest option value");
+}
+
+
+/* build an OACK packet from pairs of strings (the last string isn't terminated if
+ * unterminated is set) and look up an option in it */
+static LONG get_option(const char **strs, ULONG nstrs, int unterminated, const char *name, ULONG *value)
+{
+    UBYTE pkt[128];
+    ULONG len = 2, i;
+
+    PUT_WORD(pkt, OP_OACK);
+    for (i = 0; i < nstrs; ++i) {
+        strcpy((char *) pkt + len, strs[i]);
+        len += strlen(strs[i]) + 1;
+    }
+    if (unterminated)
+        --len;
+    return tftp_get_option(pkt, len, name, value);
+}
+
+
+static void test_tftp_get_option()
+{
+    static const char *both[]     = {"blksize", "1428", "windowsize", "8"};
+    static const char *upper[]    = {"BLKSIZE", "512"};
+    static const char *notnum[]   = {"blksize", "12a"};
+    static const char *empty[]    = {"blksize", "", "windowsize", "4"};
+    static const char *toolarge[] = {"blksize", "4294967808"};
+    static const char *largest[]  = {"blksize", "4294967295"};
+    static const char *prefix[]   = {"blk", "512", "blksizes", "512"};
+    static const char *noval[]    = {"windowsize", "8", "blksize"};
+    ULONG              value;
+    UBYTE              pkt[4];
+
+    value = 0;
+    CHECK(get_option(both, 4, 0, "blksize", &value) && (value == 1428), "blksize: value %lu", (unsigned long) value);
+    CHECK(get_option(both, 4, 0, "windowsize", &value) && (value == 8), "windowsize: value %lu", (unsigned long) value);
+    CHECK(get_option(upper, 2, 0, "blksize", &value) && (value == 512), "upper case name: value %lu", (unsigned long) value);
+    CHECK(get_option(largest, 2, 0, "blksize", &value) && (value == 4294967295UL), "largest value: %lu", (unsigned long) value);
+    CHECK(!get_option(both, 2, 0, "windowsize", &value), "missing option found");
+    CHECK(!get_option(prefix, 4, 0, "blksize", &value), "option with similar name found");
+    CHECK(!get_option(notnum, 2, 0, "blksize", &value), "value that is not a number accepted");
+    CHECK(!get_option(empty, 4, 0, "blksize", &value), "empty value accepted");
+    CHECK(get_option(empty, 4, 0, "windowsize", &value) && (value == 4), "option after empty value: value %lu", (unsigned long) value);
+    CHECK(!get_option(toolarge, 2, 0, "blksize", &value), "value that overflows accepted");
+    CHECK(!get_option(both, 4, 1, "windowsize", &value), "unterminated value accepted");
+    CHECK(get_option(both, 4, 1, "blksize", &value) && (value == 1428), "option before unterminated one: value %lu", (unsigned long) value);
+    CHECK(!get_option(noval, 3, 0, "blksize", &value), "option without value accepted");
+    CHECK(!get_option(noval, 3, 1, "blksize", &value), "unterminated option name accepted");
+    CHECK(!get_option(both, 0, 0, "blksize", &value), "option found in empty OACK");
+
+    tftp_put_header(pkt, OP_DATA, 0xc0db);
+    CHECK((tftp_get_opcode(pkt) == OP_DATA) && (tftp_get_blknum(pkt) == 0xc0db), "TFTP header");
+}
+
+
+/*
+ * feed a stream of SLIP data to a decoder in chunks of at most chunklen bytes (but split
+ * at split first) and store the decoded frames one after another in out, their lengths
+ * go to lens - returns the number of frames
+ */
+static ULONG decode_stream(SlipDecoder *dec, const UBYTE *src, ULONG nbytes, ULONG split, ULONG chunklen,
+                           UBYTE *out, ULONG *lens)
+{
+    ULONG pos = 0, end, len, nconsumed, nframes = 0, outpos = 0;
+
+    while (pos < nbytes) {
+        end = (pos < split) ? split : pos + chunklen;
+        if (end > nbytes)
+            end = nbytes;
+        while (pos < end) {
+            len  = slip_decoder_feed(dec, src + pos, end - pos, &nconsumed);
+            pos += nconsumed;
+            if (len > 0) {
+                memcpy(out + outpos, dec->sd_buf, len);
+                outpos += len;
+                lens[nframes++] = len;
+            }
+        }
+    }
+    return nframes;
+}
+
+
+static void test_slip_decoder()
+{
+    static const UBYTE f1[] = {0x01, SLIP_END, 0x02, SLIP_ESC, SLIP_ESC, 0x03};
+    static const UBYTE f2[] = {SLIP_ESC};
+    static const UBYTE f3[] = {0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17};
+    static const UBYTE *frames[] = {f1, f2, f3};
+    static const ULONG framelens[] = {sizeof(f1), sizeof(f2), sizeof(f3)};
+    SlipDecoder dec;
+    UBYTE       stream[256], buf[64], out[256], expected[256];
+    ULONG       lens[16], nbytes, nexpected, nframes, i, split, chunklen;
+    LONG        n;
+
+    /* frames back to back (with an empty frame in between and a leading SLIP_END) */
+    nbytes = nexpected = 0;
+    stream[nbytes++] = SLIP_END;
+    for (i = 0; i < 3; ++i) {
+        n = slip_encode(stream + nbytes, sizeof(stream) - nbytes, frames[i], framelens[i]);
+        nbytes += n;
+        stream[nbytes++] = SLIP_END;
+        if (i == 0)
+            stream[nbytes++] = SLIP_END;
+        memcpy(expected + nexpected, frames[i], framelens[i]);
+        nexpected += framelens[i];
+    }
+
+    /* split at every byte and fed in chunks of any size */
+    for (split = 0; split <= nbytes; ++split) {
+        for (chunklen = 1; chunklen <= nbytes; ++chunklen) {
+            slip_decoder_init(&dec, buf, sizeof(buf));
+            nframes = decode_stream(&dec, stream, nbytes, split, chunklen, out, lens);
+            if ((nframes != 3) || (lens[0] != framelens[0]) || (lens[1] != framelens[1]) ||
+                (lens[2] != framelens[2]) || (memcmp(out, expected, nexpected) != 0) || (dec.sd_ndropped != 0)) {
+                CHECK(0, "frames not decoded correctly when split at %lu in chunks of %lu bytes", (unsigned long) split, (unsigned long) chunklen);
+                return;
+            }
+        }
+    }
+    CHECK(1, "frames decoded correctly");
+
+    /* oversized frame is dropped, the next one still gets through */
+    slip_decoder_init(&dec, buf, sizeof(f3) - 1);
+    memcpy(stream, f3, sizeof(f3));
+    nbytes = sizeof(f3);
+    stream[nbytes++] = SLIP_END;
+    memcpy(stream + nbytes, f3, sizeof(f3) - 1);
+    nbytes += sizeof(f3) - 1;
+    stream[nbytes++] = SLIP_END;
+    nframes = decode_stream(&dec, stream, nbytes, 0, 1, out, lens);
+    CHECK((nframes == 1) && (lens[0] == sizeof(f3) - 1) && (memcmp(out, f3, sizeof(f3) - 1) == 0),
+          "oversized frame: %lu frames", (unsigned long) nframes);
+    CHECK((dec.sd_ndropped == 1) && (dec.sd_nframes == 1), "oversized frame: %lu dropped, %lu frames", (unsigned long) dec.sd_ndropped, (unsigned long) dec.sd_nframes);
+
+    /* invalid escape sequence is dropped, also at the end of a frame */
+    slip_decoder_init(&dec, buf, sizeof(buf));
+    nbytes = 0;
+    stream[nbytes++] = 0x01;
+    stream[nbytes++] = SLIP_ESC;
+    stream[nbytes++] = 0x41;
+    stream[nbytes++] = 0x02;
+    stream[nbytes++] = SLIP_END;
+    stream[nbytes++] = 0x03;
+    stream[nbytes++] = SLIP_ESC;
+    stream[nbytes++] = SLIP_END;
+    stream[nbytes++] = 0x04;
+    stream[nbytes++] = SLIP_END;
+    for (split = 0; split <= nbytes; ++split) {
+        slip_decoder_init(&dec, buf, sizeof(buf));
+        nframes = decode_stream(&dec, stream, nbytes, split, nbytes, out, lens);
+        if ((nframes != 1) || (lens[0] != 1) || (out[0] != 0x04) || (dec.sd_ndropped != 2)) {
+            CHECK(0, "invalid escape sequences not dropped when split at %lu", (unsigned long) split);
+            return;
+        }
+    }
+    CHECK(1, "invalid escape sequences dropped");
+}
+
+
+/*
+ * main function
+ */
+int main()
+{
+    test_udpip_encode_headers();
+    test_udpip_parse();
+    test_tftp_build_request();
+    test_tftp_get_option();
+    test_slip_decoder();
+    printf("%lu tests, %lu failed\n", (unsigned long) ntests, (unsigned long) nfailed);
+    return nfailed ? 1 : 0;
+}
@@ -6,26 +6,147 @@
  */
 
 
+#include <stdarg.h>
+
 #include "util.h"
 
 
 /*
- * log a message to the console
+ * The LOG_xxx() macros format the message into a preallocated ring and return at once.
+ * The log task writes the messages to the console / log file in batches and runs at a
+ * lower priority than the handler, so logging never blocks the handler or the network
+ * task. If the log task can't keep up, messages are dropped and only counted.
+ */
+static char            logring[LOG_RING_SIZE][LOG_MSG_LEN];
+static ULONG           loghead, logtail;    /* number of messages written / added so far */
+static struct Process *logtask;
+static struct Task    *logparent;           /* signalled when the log task has started / stopped */
+static const char     *logfname;
+static BPTR            logfh;
+static const char     *levelnames[] = {"DEBUG", "INFO", "WARN", "ERROR", "CRITICAL"};
+
+
+/*
+ * add a message to the log ring
+ */
+void log_printf(ULONG level, const char *fmt, ...)
+{
+    va_list args;
+    char   *msg;
+    LONG    n;
+    BOOL    wakeup;
+
+    ObtainSemaphore(&g_logsem);
+    if (logtail - loghead == LOG_RING_SIZE) {
+        ++g_log_ndropped;
+        ReleaseSemaphore(&g_logsem);
+        return;
+    }
+    msg = logring[logtail % LOG_RING_SIZE];
+    n = sprintf(msg, "%s: ", levelnames[level]);
+    va_start(args, fmt);
+    vsnprintf(msg + n, LOG_MSG_LEN - n, fmt, args);
+    va_end(args);
+    /* a truncated message still has to end the line */
+    if (strlen(msg) == LOG_MSG_LEN - 1)
+        msg[LOG_MSG_LEN - 2] = '\n';
+    /* the log task only needs to be woken up if it may have emptied the ring already */
+    wakeup = (logtail++ == loghead);
+    ReleaseSemaphore(&g_logsem);
+    if (wakeup && logtask)
+        Signal((struct Task *) logtask, SIGBREAKF_CTRL_E);
+}
+
+
+/*
+ * write the messages in the log ring to the log in batches, until it is empty
+ */
+static void flush_log()
+{
+    static char batch[LOG_BATCH_SIZE];
+    static ULONG nreported = 0;    /* number of dropped messages already reported */
+    ULONG len, n;
+
+    do {
+        len = 0;
+        ObtainSemaphore(&g_logsem);
+        if (g_log_ndropped != nreported) {
+            len = sprintf(batch, "WARN: %ld log messages dropped\n", g_log_ndropped - nreported);
+            nreported = g_log_ndropped;
+        }
+        while ((loghead != logtail) && (len + LOG_MSG_LEN <= LOG_BATCH_SIZE)) {
+            n = strlen(logring[loghead % LOG_RING_SIZE]);
+            memcpy(batch + len, logring[loghead % LOG_RING_SIZE], n);
+            len += n;
+            ++loghead;
+        }
+        ReleaseSemaphore(&g_logsem);
+        if (len > 0)
+            Write(logfh, batch, len);
+    } while (len > 0);
+}
+
+
+/*
+ * main function of the log task
+ * Unlike the handler, the task can use the DOS functions because its process port isn't
+ * used for anything else.
+ */
+static void log_task()
+{
+    ULONG signals;
+
+    if ((logfh = Open(logfname, MODE_NEWFILE)) == 0) {
+        Forbid();
+        Signal(logparent, SIGBREAKF_CTRL_F);
+        return;
+    }
+    Signal(logparent, SIGBREAKF_CTRL_F);
+
+    do {
+        signals = Wait(SIGBREAKF_CTRL_E | SIGBREAKF_CTRL_C);
+        flush_log();
+    } while (!(signals & SIGBREAKF_CTRL_C));
+
+    Close(logfh);
+    /* we must not be rescheduled after the handler has been signalled (see nettask.c) */
+    Forbid();
+    Signal(logparent, SIGBREAKF_CTRL_F);
+}
+
+
+/*
+ * start the log task and wait until it has opened the log (console or file)
+ */
+LONG log_start(const char *fname)
+{
+    InitSemaphore(&g_logsem);
+    logfname  = fname;
+    logparent = FindTask(NULL);
+    if ((logtask = CreateNewProcTags(NP_Entry, (ULONG) log_task,
+                                     NP_Name, (ULONG) "CWNet log task",
+                                     NP_Priority, logparent->tc_Node.ln_Pri - 1,
+                                     NP_StackSize, LOGTASK_STACK_SIZE,
+                                     TAG_DONE)) == NULL)
+        return DOSFALSE;
+    Wait(SIGBREAKF_CTRL_F);
+    if (logfh == 0) {
+        logtask = NULL;
+        return DOSFALSE;
+    }
+    return DOSTRUE;
+}
+
+
+/*
+ * stop the log task after it has written all messages still in the ring (messages
+ * logged afterwards are lost)
  */
-void log(const char *msg)
+void log_stop()
 {
-    struct StandardPacket pkt;
-    pkt.sp_Msg.mn_ReplyPort    = g_logport;
-    pkt.sp_Pkt.dp_Port         = g_logport;
-    pkt.sp_Msg.mn_Node.ln_Name = (char *) &(pkt.sp_Pkt);
-    pkt.sp_Pkt.dp_Link         = &(pkt.sp_Msg);
-    pkt.sp_Pkt.dp_Type = ACTION_WRITE;
-    pkt.sp_Pkt.dp_Arg1 = ((struct FileHandle *) BCPL_TO_C_PTR(g_logfh))->fh_Arg1;
-    pkt.sp_Pkt.dp_Arg2 = (LONG) msg;
-    pkt.sp_Pkt.dp_Arg3 = strlen(msg);
-    PutMsg((struct MsgPort *) ((struct FileHandle *) BCPL_TO_C_PTR(g_logfh))->fh_Type, &(pkt.sp_Msg));
-    WaitPort(g_logport);
-    GetMsg(g_logport);
+    Signal((struct Task *) logtask, SIGBREAKF_CTRL_C);
+    Wait(SIGBREAKF_CTRL_F);
+    logtask = NULL;
 }
 
 
@@ -50,7 +171,7 @@ Buffer *create_buffer(ULONG size)
     Buffer *buffer;
 
     /* allocate a memory block large enough for the Buffer structure and buffer itself */
-    if ((buffer = AllocVec(size + sizeof(Buffer), 0)) != NULL) {
+    if ((buffer = alloc_fast(size + sizeof(Buffer))) != NULL) {
         buffer->b_addr = ((UBYTE *) buffer) + sizeof(Buffer);
         buffer->b_size = 0;
         return buffer;
@@ -67,21 +188,116 @@ void delete_buffer(const Buffer *buffer)
 
 
 /*
- * create a hexdump of a buffer
+ * allocate memory, preferably fast memory (falls back to chip memory on machines that
+ * don't have any fast memory)
+ */
+APTR alloc_fast(ULONG size)
+{
+    APTR mem;
+
+    if ((mem = AllocVec(size, MEMF_FAST)) == NULL)
+        mem = AllocVec(size, MEMF_ANY);
+    return mem;
+}
+
+
+/*
+ * create / delete a pool of objects of a fixed size
+ */
+LONG create_pool(Pool *pool, const char *name, ULONG objsize, ULONG nobjs)
+{
+    ULONG i;
+
+    /* objects are aligned on longwords and must be able to hold the link to the next free one */
+    objsize = (objsize + 3) & ~3;
+    if (objsize < sizeof(APTR))
+        objsize = sizeof(APTR);
+    pool->p_name       = name;
+    pool->p_objsize    = objsize;
+    pool->p_nobjs      = nobjs;
+    pool->p_free       = NULL;
+    pool->p_nused      = 0;
+    pool->p_maxused    = 0;
+    pool->p_noverflows = 0;
+    pool->p_nfailures  = 0;
+    if ((pool->p_slab = alloc_fast(objsize * nobjs)) == NULL)
+        return DOSFALSE;
+    /* put all objects on the free list (in reverse order so that the first one is used first) */
+    for (i = nobjs; i > 0; --i) {
+        *((APTR *) (pool->p_slab + (i - 1) * objsize)) = pool->p_free;
+        pool->p_free = pool->p_slab + (i - 1) * objsize;
+    }
+    return DOSTRUE;
+}
+
+
+void delete_pool(Pool *pool)
+{
+    FreeVec(pool->p_slab);
+    pool->p_slab = NULL;
+    pool->p_free = NULL;
+}
+
+
+/*
+ * allocate / free an object from / to a pool
+ */
+APTR pool_alloc(Pool *pool)
+{
+    APTR obj;
+
+    if ((obj = pool->p_free) != NULL)
+        pool->p_free = *((APTR *) obj);
+    else if ((obj = alloc_fast(pool->p_objsize)) != NULL)
+        ++pool->p_noverflows;
+    else {
+        ++pool->p_nfailures;
+        return NULL;
+    }
+    if (++pool->p_nused > pool->p_maxused)
+        pool->p_maxused = pool->p_nused;
+    return obj;
+}
+
+
+void pool_free(Pool *pool, APTR obj)
+{
+    if (obj == NULL)
+        return;
+    --pool->p_nused;
+    if (((UBYTE *) obj >= pool->p_slab) && ((UBYTE *) obj < pool->p_slab + pool->p_nobjs * pool->p_objsize)) {
+        *((APTR *) obj) = pool->p_free;
+        pool->p_free = obj;
+    }
+    else
+        FreeVec(obj);
+}
+
+
+void log_pool_stats(const Pool *pool)
+{
+    LOG_INFO("pool '%s': %ld objects of %ld bytes, %ld in use, max. %ld in use, %ld overflows, %ld failures\n",
+        pool->p_name, pool->p_nobjs, pool->p_objsize, pool->p_nused, pool->p_maxused,
+        pool->p_noverflows, pool->p_nfailures);
+}
+
+
+/*
+ * create a hexdump of a buffer (one message per line, so that lines are not torn apart
+ * by messages from the other task)
  */
 void dump_buffer(const Buffer *buffer)
 {
     ULONG pos = 0, i, nchars;
-    char line[256], *p;
+    char hex[64], *h, line[32], *p;
 
     /* For some reason, we have to use the 'l' modifier for all integers in sprintf(),
      * otherwise only zeros instead of the real values are printed. Maybe this is
      * because sprintf() from amiga.lib defaults to 16-bit integers, but GCC always uses
      * 32-bit integers? Anyway, it works now... */
     while (pos < buffer->b_size) {
-        LOG("DEBUG: %04lx: ", pos);
-        for (i = pos, p = line, nchars = 0; (i < pos + 16) && (i < buffer->b_size); ++i, ++p, ++nchars) {
-            LOG("%02lx ", (ULONG) buffer->b_addr[i]);
+        for (i = pos, h = hex, p = line, nchars = 0; (i < pos + 16) && (i < buffer->b_size); ++i, h += 3, ++p, ++nchars) {
+            sprintf(h, "%02lx ", (ULONG) buffer->b_addr[i]);
             if (buffer->b_addr[i] >= 0x20 && buffer->b_addr[i] <= 0x7e) {
                 sprintf(p, "%lc", buffer->b_addr[i]);
             }
@@ -90,13 +306,14 @@ void dump_buffer(const Buffer *buffer)
             }
         }
         if (nchars < 16) {
-            for (i = 1; i <= (3 * (16 - nchars)); ++i, ++p, ++nchars) {
-                sprintf(p, " ");
+            for (i = 1; i <= (3 * (16 - nchars)); ++i, ++h) {
+                sprintf(h, " ");
             }
         }
+        *h = '\0';
         *p = '\0';
 
-        LOG("\t%s\n", line);
+        LOG_DEBUG("%04lx: %s\t%s\n", pos, hex, line);
         pos += 16;
     }
 }
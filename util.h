@@ -13,9 +13,12 @@
  */
 #include <dos/dos.h>
 #include <dos/dosextens.h>
+#include <dos/dostags.h>
 #include <exec/memory.h>
+#include <exec/semaphores.h>
 #include <exec/types.h>
 #include <proto/exec.h>
+#include <proto/dos.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -29,29 +32,93 @@ typedef struct {
 } Buffer;
 
 
+/*
+ * pool of objects of a fixed size
+ * The objects are preallocated in one block of memory at startup, so that the memory
+ * doesn't get fragmented over time. If the pool is exhausted, objects are allocated
+ * individually. The counters can be used to size the pools.
+ */
+typedef struct {
+    const char *p_name;
+    ULONG       p_objsize;
+    ULONG       p_nobjs;        /* number of preallocated objects */
+    UBYTE      *p_slab;         /* memory block holding the preallocated objects */
+    APTR        p_free;         /* list of free objects, linked via their first longword */
+    ULONG       p_nused;        /* number of objects in use */
+    ULONG       p_maxused;      /* high-water mark of p_nused */
+    ULONG       p_noverflows;   /* number of objects allocated individually */
+    ULONG       p_nfailures;    /* number of failed allocations */
+} Pool;
+
+
 /*
  * function prototypes
  */
-void log(const char *msg);
+LONG log_start(const char *fname);
+void log_stop();
+void log_printf(ULONG level, const char *fmt, ...);
 char *BCPL_TO_C_STR(char *buffer, BSTR str);
 Buffer *create_buffer(ULONG size);
 void delete_buffer(const Buffer *buffer);
 void dump_buffer(const Buffer *buffer);
+APTR alloc_fast(ULONG size);
+LONG create_pool(Pool *pool, const char *name, ULONG objsize, ULONG nobjs);
+void delete_pool(Pool *pool);
+APTR pool_alloc(Pool *pool);
+void pool_free(Pool *pool, APTR obj);
+void log_pool_stats(const Pool *pool);
 
 
 /*
  * external references
  */
-extern struct MsgPort *g_logport;
-extern BPTR g_logfh;
-extern char g_logmsg[256];
+extern struct SignalSemaphore g_logsem;   /* the log ring is used by the handler and the network task */
+extern ULONG g_loglevel;            /* messages below this level are discarded */
+extern ULONG g_log_ndropped;        /* number of messages dropped because the log ring was full */
+extern ULONG g_max_buffer_size;     /* maximum size of an IP datagram (the SLIP MTU) */
 
 
 /*
  * constants / macros
  */
-#define MAX_BUFFER_SIZE 1024
-#define LOG(fmt, ...) {sprintf(g_logmsg, fmt, ##__VA_ARGS__); log(g_logmsg);}
+#define DEFAULT_BUFFER_SIZE 1024    /* default for g_max_buffer_size */
+#define LOG_RING_SIZE 64            /* number of messages the log ring can hold */
+#define LOG_MSG_LEN 160             /* maximum length of a message (longer ones are truncated) */
+#define LOG_BATCH_SIZE 2048         /* maximum number of bytes written to the log at a time */
+#define LOGTASK_STACK_SIZE 4096
+
+/*
+ * log levels
+ * Messages below LOG_MIN_LEVEL are removed at compile time (add -DLOG_MIN_LEVEL=0 to
+ * CFLAGS to get the DEBUG messages), messages below g_loglevel at runtime.
+ */
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_CRITICAL  4
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, fmt, ...) {if ((level) >= g_loglevel) log_printf((level), fmt, ##__VA_ARGS__);}
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) {}
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) {}
+#endif
+#if LOG_MIN_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOG_WARN(fmt, ...) {}
+#endif
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define LOG_CRITICAL(fmt, ...) LOG_AT(LOG_LEVEL_CRITICAL, fmt, ##__VA_ARGS__)
 #define C_TO_BCPL_PTR(ptr) ((BPTR) (((ULONG) (ptr)) >> 2))
 #define BCPL_TO_C_PTR(ptr) ((APTR) (((ULONG) (ptr)) << 2))
 